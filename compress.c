@@ -0,0 +1,346 @@
+/*
+ * Transparent compression for regular files with UX_COMPR_FL.
+ *
+ * Each page of such a file is one cluster. It is read and written
+ * whole through the block device's buffer cache, never through buffer
+ * heads on the page, and deflated at writeback. One zlib workspace and
+ * staging buffer per volume are shared under s_zlock.
+ *
+ * A cluster's slots and its i_cmap bit change together, so reads
+ * take a copy of both under i_map_seq and writeback replaces both in
+ * one write section.
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/zlib.h>
+#include "uxfs.h"
+
+#define UX_NCLUSTERS	(UX_DIRECT_BLOCKS / UX_CLUSTER_BLOCKS)
+
+/* Room for the stream when the cluster is to save at least a block. */
+#define UX_ZMAX		(UX_CLUSTER_SIZE - UX_BSIZE - sizeof(__u32))
+
+static int uxfs_zinit(struct ux_sb_info *sbi)
+{
+	if (sbi->s_zwork)
+		return 0;
+	sbi->s_zwork = vmalloc(max(zlib_deflate_workspacesize(),
+				   zlib_inflate_workspacesize()));
+	sbi->s_zbuf = kmalloc(UX_CLUSTER_SIZE, GFP_NOFS);
+	if (!sbi->s_zwork || !sbi->s_zbuf) {
+		uxfs_zexit(sbi);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void uxfs_zexit(struct ux_sb_info *sbi)
+{
+	vfree(sbi->s_zwork);
+	kfree(sbi->s_zbuf);
+	sbi->s_zwork = NULL;
+	sbi->s_zbuf = NULL;
+}
+
+/*
+ * Deflate len bytes of src into at most max bytes at dst. Returns the
+ * length of the stream, or 0 if it doesn't fit.
+ */
+static int uxfs_deflate(struct ux_sb_info *sbi, void *src, int len,
+			void *dst, int max)
+{
+	z_stream zs;
+	int out = 0;
+
+	memset(&zs, 0, sizeof(zs));
+	zs.workspace = sbi->s_zwork;
+	if (zlib_deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+		return 0;
+	zs.next_in = src;
+	zs.avail_in = len;
+	zs.next_out = dst;
+	zs.avail_out = max;
+	if (zlib_deflate(&zs, Z_FINISH) == Z_STREAM_END)
+		out = zs.total_out;
+	zlib_deflateEnd(&zs);
+	return out;
+}
+
+static int uxfs_inflate(struct ux_sb_info *sbi, void *src, int len,
+			void *dst, int max)
+{
+	z_stream zs;
+	int err = -EIO;
+
+	memset(&zs, 0, sizeof(zs));
+	zs.workspace = sbi->s_zwork;
+	if (zlib_inflateInit(&zs) != Z_OK)
+		return -EIO;
+	zs.next_in = src;
+	zs.avail_in = len;
+	zs.next_out = dst;
+	zs.avail_out = max;
+	if (zlib_inflate(&zs, Z_FINISH) == Z_STREAM_END)
+		err = 0;
+	zlib_inflateEnd(&zs);
+	return err;
+}
+
+/*
+ * Fill a page from its cluster on disk.
+ */
+static int uxfs_read_cluster(struct inode *inode, struct page *page)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	__u32 slot[UX_CLUSTER_BLOCKS], clen, packed;
+	struct buffer_head *bh;
+	unsigned seq;
+	char *dst;
+	int i, n, err = 0;
+
+	if (PAGE_CACHE_SIZE != UX_CLUSTER_SIZE)
+		return -EOPNOTSUPP;
+	dst = kmap(page);
+	memset(dst, 0, PAGE_CACHE_SIZE);
+	if (page->index >= UX_NCLUSTERS)
+		goto out;
+
+	do {
+		seq = read_seqbegin(&ux_inode->i_map_seq);
+		memcpy(slot, ux_inode->i_data + page->index * UX_CLUSTER_BLOCKS,
+		       sizeof(slot));
+		packed = ux_inode->i_cmap & (1U << page->index);
+	} while (read_seqretry(&ux_inode->i_map_seq, seq));
+
+	if (!packed) {
+		for (i = 0; i < UX_CLUSTER_BLOCKS && !err; i++) {
+			if (!slot[i])
+				continue;
+			bh = sb_bread(sb, slot[i]);
+			if (!bh) {
+				err = -EIO;
+				break;
+			}
+			memcpy(dst + i * UX_BSIZE, bh->b_data, UX_BSIZE);
+			brelse(bh);
+		}
+		goto out;
+	}
+
+	mutex_lock(&sbi->s_zlock);
+	err = uxfs_zinit(sbi);
+	for (n = 0; !err && n < UX_CLUSTER_BLOCKS - 1 && slot[n]; n++) {
+		bh = sb_bread(sb, slot[n]);
+		if (!bh) {
+			err = -EIO;
+			break;
+		}
+		memcpy(sbi->s_zbuf + n * UX_BSIZE, bh->b_data, UX_BSIZE);
+		brelse(bh);
+	}
+	if (!err) {
+		clen = *(__u32 *)sbi->s_zbuf;
+		if (!n || clen > n * UX_BSIZE - sizeof(__u32) ||
+		    uxfs_inflate(sbi, sbi->s_zbuf + sizeof(__u32), clen, dst,
+				 PAGE_CACHE_SIZE)) {
+			printk("uxfs: %s: inode %lu: bad compressed cluster %lu\n",
+			       sb->s_id, inode->i_ino, page->index);
+			err = -EIO;
+		}
+	}
+	mutex_unlock(&sbi->s_zlock);
+out:
+	flush_dcache_page(page);
+	kunmap(page);
+	return err;
+}
+
+/*
+ * Write the first len bytes of a locked page back as its cluster,
+ * deflated if that saves a block. All the blocks needed are allocated
+ * before any is overwritten, so running out of space leaves the
+ * cluster as it was. The new map is built in map[] and only made
+ * visible once the blocks hold the data.
+ */
+static int uxfs_write_cluster(struct inode *inode, struct page *page,
+			      unsigned len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	__u32 *slot = ux_inode->i_data + page->index * UX_CLUSTER_BLOCKS;
+	__u32 bit = 1U << page->index, blk, map[UX_CLUSTER_BLOCKS];
+	struct buffer_head *bh;
+	int i, n, clen = 0, bytes, fresh = 0, delta = 0, err = 0;
+	char *src, *data;
+
+	src = kmap(page);
+	mutex_lock(&sbi->s_zlock);
+	mutex_lock(&ux_inode->i_map_mutex);
+	memcpy(map, slot, sizeof(map));
+	if (!uxfs_zinit(sbi))
+		clen = uxfs_deflate(sbi, src, len,
+				    sbi->s_zbuf + sizeof(__u32), UX_ZMAX);
+	if (clen) {
+		*(__u32 *)sbi->s_zbuf = clen;
+		data = sbi->s_zbuf;
+		bytes = clen + sizeof(__u32);
+	} else {
+		data = src;
+		bytes = len;
+	}
+	n = (bytes + UX_BSIZE - 1) / UX_BSIZE;
+
+	for (i = 0; i < n; i++) {
+		if (map[i])
+			continue;
+		blk = uxfs_new_block(sb, &err);
+		if (err)
+			break;
+		map[i] = blk;
+		fresh |= 1 << i;
+		delta += UX_BSIZE / 512;
+	}
+	if (err) {
+		for (i = 0; i < n; i++) {
+			if (fresh & (1 << i))
+				uxfs_free_block(sb, map[i]);
+		}
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		bh = sb_getblk(sb, map[i]);
+		lock_buffer(bh);
+		memset(bh->b_data, 0, UX_BSIZE);
+		memcpy(bh->b_data, data + i * UX_BSIZE,
+		       min(bytes - i * UX_BSIZE, UX_BSIZE));
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty_inode(bh, inode);
+		brelse(bh);
+	}
+
+	write_seqlock(&ux_inode->i_map_seq);
+	for (i = 0; i < UX_CLUSTER_BLOCKS; i++) {
+		if (i >= n && map[i])
+			delta -= UX_BSIZE / 512;
+		slot[i] = i < n ? map[i] : 0;
+	}
+	inode->i_blocks += delta;
+	if (clen)
+		ux_inode->i_cmap |= bit;
+	else
+		ux_inode->i_cmap &= ~bit;
+	write_sequnlock(&ux_inode->i_map_seq);
+	for (i = n; i < UX_CLUSTER_BLOCKS; i++) {
+		if (map[i])
+			uxfs_free_block(sb, map[i]);
+	}
+	mark_inode_dirty(inode);
+out:
+	mutex_unlock(&ux_inode->i_map_mutex);
+	mutex_unlock(&sbi->s_zlock);
+	kunmap(page);
+	return err;
+}
+
+int uxfs_zreadpage(struct file *file, struct page *page)
+{
+	int err;
+
+	err = uxfs_read_cluster(page->mapping->host, page);
+	if (!err)
+		SetPageUptodate(page);
+	else
+		SetPageError(page);
+	unlock_page(page);
+	return err;
+}
+
+int uxfs_zwritepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t size = i_size_read(inode);
+	loff_t start = (loff_t)page->index << PAGE_CACHE_SHIFT;
+	unsigned len = PAGE_CACHE_SIZE;
+	int err = -EOPNOTSUPP;
+
+	/* Wholly past EOF: truncate got here first. */
+	if (start >= size) {
+		unlock_page(page);
+		return 0;
+	}
+	if (size - start < PAGE_CACHE_SIZE) {
+		len = size - start;
+		zero_user_segment(page, len, PAGE_CACHE_SIZE);
+	}
+	/*
+	 * The cluster is only handed to the buffer layer here, as dirty
+	 * buffers on the inode's list, so writeback of the page is over
+	 * once it returns. fsync and O_SYNC reach the buffers through
+	 * sync_mapping_buffers(), sync through the block device.
+	 */
+	set_page_writeback(page);
+	if (PAGE_CACHE_SIZE == UX_CLUSTER_SIZE)
+		err = uxfs_write_cluster(inode, page, len);
+	if (err) {
+		SetPageError(page);
+		mapping_set_error(page->mapping, err);
+	}
+	unlock_page(page);
+	end_page_writeback(page);
+	return err;
+}
+
+int uxfs_zwrite_begin(struct file *file, struct address_space *mapping,
+		      loff_t pos, unsigned len, unsigned flags,
+		      struct page **pagep, void **fsdata)
+{
+	struct page *page;
+	int err;
+
+	*pagep = NULL;
+	page = __grab_cache_page(mapping, pos >> PAGE_CACHE_SHIFT);
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page) && len != PAGE_CACHE_SIZE) {
+		err = uxfs_read_cluster(mapping->host, page);
+		if (err) {
+			unlock_page(page);
+			page_cache_release(page);
+			return err;
+		}
+		SetPageUptodate(page);
+	}
+	*pagep = page;
+	return 0;
+}
+
+/*
+ * Zero the last cluster past the new EOF, as block_truncate_page()
+ * does for other files, so that growing the file again reads zeroes.
+ */
+int uxfs_ztruncate_page(struct inode *inode)
+{
+	unsigned offset = inode->i_size & (PAGE_CACHE_SIZE - 1);
+	struct page *page;
+
+	if (!offset)
+		return 0;
+	page = read_mapping_page(inode->i_mapping,
+				 inode->i_size >> PAGE_CACHE_SHIFT, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	zero_user_segment(page, offset, PAGE_CACHE_SIZE);
+	set_page_dirty(page);
+	unlock_page(page);
+	page_cache_release(page);
+	return 0;
+}
@@ -1,44 +1,88 @@
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <asm/uaccess.h>
 #include "uxfs.h"
 
+/*
+ * Start reads of the inode blocks of the entries just returned, so the
+ * stat() calls that usually follow a readdir find them in the buffer
+ * cache. Blocks already cached or under I/O are skipped by ll_rw_block().
+ */
+static void uxfs_prefetch_inodes(int rw, struct buffer_head **bhs, int n)
+{
+	int i;
+
+	if (!n)
+		return;
+	ll_rw_block(rw, n, bhs);
+	for (i = 0; i < n; i++)
+		brelse(bhs[i]);
+}
+
+/*
+ * Start reads of all of a directory's blocks at once.
+ */
+void uxfs_dir_readahead(struct inode *dir)
+{
+	struct ux_inode_info *ux_inode = uxfs_i(dir);
+	struct buffer_head *bhs[UX_DIRECT_BLOCKS];
+	int i, n = 0;
+
+	for (i = 0; i < dir->i_blocks && i < UX_DIRECT_BLOCKS; i++) {
+		if (ux_inode->i_data[i])
+			bhs[n++] = sb_getblk(dir->i_sb, ux_inode->i_data[i]);
+	}
+	uxfs_prefetch_inodes(READA, bhs, n);
+}
+
 static int uxfs_readdir(struct file * filp, void * dirent, filldir_t filldir)
 {
 	unsigned long pos = filp->f_pos;
 	struct inode *inode = filp->f_dentry->d_inode;
 	struct ux_inode_info *ux_inode = uxfs_i(inode);
 	struct super_block *sb = inode->i_sb;
+	int prefetch = uxfs_sb(sb)->s_mount_opt & UX_MOUNT_PREFETCH;
+	struct buffer_head *ra[UX_DIR_PER_BLK];
 	struct buffer_head *bh;
 	struct ux_dirent *de;
-	off_t offset = 0;
-	int i, j;
+	off_t offset;
+	int i, j, nra;
 
 	if (pos >= inode->i_size) {
 		offset = inode->i_size;
 		goto done;
 	}
 
-	for (i = 0; i < inode->i_blocks; i++) {
+	/* Resume at the slot f_pos points to. */
+	offset = pos & ~(sizeof(struct ux_dirent) - 1);
+	for (i = offset / UX_BSIZE; i < inode->i_blocks &&
+	     offset < inode->i_size; i++) {
 		bh = sb_bread(sb, ux_inode->i_data[i]);
 		if (!bh) {
 			printk("uxfs: unable to read dir block\n");
 			goto done;
 		}
 
-		de = (struct ux_dirent *)bh->b_data;
-		for (j = 0; j < UX_DIR_PER_BLK && offset < inode->i_size; j++, de++) {
-			if (offset < pos)
+		nra = 0;
+		j = (offset % UX_BSIZE) / sizeof(struct ux_dirent);
+		de = (struct ux_dirent *)bh->b_data + j;
+		for (; j < UX_DIR_PER_BLK && offset < inode->i_size;
+		     j++, de++, offset += sizeof(struct ux_dirent)) {
+			if (!de->d_ino)
 				continue;
-			if (de->d_ino) {
-				if (filldir(dirent, de->d_name,
-					   strnlen(de->d_name, UX_NAMELEN),
-					   offset, de->d_ino, DT_UNKNOWN)) {
-					brelse(bh);
-					goto done;
-				}
+			if (filldir(dirent, de->d_name,
+				   strnlen(de->d_name, UX_NAMELEN),
+				   offset, de->d_ino, DT_UNKNOWN)) {
+				brelse(bh);
+				uxfs_prefetch_inodes(READA, ra, nra);
+				goto done;
 			}
-			offset += sizeof(struct ux_dirent);
+			if (prefetch && de->d_ino < UX_NINODES)
+				ra[nra++] = sb_getblk(sb, UX_INODE_BLOCK +
+						      de->d_ino);
 		}
 		brelse(bh);
+		uxfs_prefetch_inodes(READA, ra, nra);
 	}
 
 done:
@@ -46,7 +90,138 @@ done:
 	return 0;
 }
 
+#define UX_BULKSTAT_MAX	(PAGE_SIZE / sizeof(struct ux_bstat))
+
+/*
+ * The entries for one call are gathered first. The reads of the inode
+ * blocks they need are all submitted together, and only then are the
+ * inodes looked up, so a cold directory costs one batch of I/O per
+ * call rather than one round trip per entry.
+ */
+static int uxfs_bulkstat(struct inode *dir, struct ux_bulkstat __user *ubk)
+{
+	struct ux_inode_info *ux_inode = uxfs_i(dir);
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *ra[UX_DIR_PER_BLK];
+	struct buffer_head *bh;
+	struct ux_bulkstat bk;
+	struct ux_bstat *bs;
+	struct ux_dirent *de;
+	struct inode *inode;
+	int i, j, n, nra, max, err = 0;
+	off_t offset;
+
+	/* As for stat on each entry, the directory must be searchable. */
+	err = permission(dir, MAY_EXEC, NULL);
+	if (err)
+		return err;
+	if (copy_from_user(&bk, ubk, sizeof(bk)))
+		return -EFAULT;
+	max = min_t(__u32, bk.bk_count, UX_BULKSTAT_MAX);
+	bs = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!bs)
+		return -ENOMEM;
+
+	mutex_lock(&dir->i_mutex);
+	n = 0;
+	offset = bk.bk_pos < dir->i_size ? bk.bk_pos : dir->i_size;
+	offset &= ~(sizeof(struct ux_dirent) - 1);
+	for (i = offset / UX_BSIZE; n < max && i < dir->i_blocks &&
+	     offset < dir->i_size; i++) {
+		bh = sb_bread(sb, ux_inode->i_data[i]);
+		if (!bh) {
+			printk("uxfs: unable to read dir block\n");
+			err = -EIO;
+			goto out;
+		}
+
+		nra = 0;
+		j = (offset % UX_BSIZE) / sizeof(struct ux_dirent);
+		de = (struct ux_dirent *)bh->b_data + j;
+		for (; j < UX_DIR_PER_BLK && offset < dir->i_size && n < max;
+		     j++, de++, offset += sizeof(struct ux_dirent)) {
+			if (!de->d_ino || de->d_ino >= UX_NINODES)
+				continue;
+			memset(&bs[n], 0, sizeof(bs[n]));
+			bs[n].bs_ino = de->d_ino;
+			memcpy(bs[n].bs_name, de->d_name, UX_NAMELEN);
+			n++;
+			ra[nra++] = sb_getblk(sb, UX_INODE_BLOCK + de->d_ino);
+		}
+		brelse(bh);
+		uxfs_prefetch_inodes(READ, ra, nra);
+	}
+
+	for (i = 0; i < n; i++) {
+		inode = uxfs_iget(sb, bs[i].bs_ino);
+		if (IS_ERR(inode)) {
+			err = PTR_ERR(inode);
+			goto out;
+		}
+		bs[i].bs_mode = inode->i_mode;
+		bs[i].bs_nlink = inode->i_nlink;
+		bs[i].bs_uid = inode->i_uid;
+		bs[i].bs_gid = inode->i_gid;
+		bs[i].bs_size = inode->i_size;
+		bs[i].bs_blocks = inode->i_blocks;
+		bs[i].bs_atime = inode->i_atime.tv_sec;
+		bs[i].bs_mtime = inode->i_mtime.tv_sec;
+		bs[i].bs_ctime = inode->i_ctime.tv_sec;
+		iput(inode);
+	}
+	mutex_unlock(&dir->i_mutex);
+
+	bk.bk_pos = offset;
+	bk.bk_count = n;
+	if (copy_to_user((void __user *)(unsigned long)bk.bk_buf, bs,
+			 n * sizeof(*bs)) ||
+	    copy_to_user(ubk, &bk, sizeof(bk)))
+		err = -EFAULT;
+	kfree(bs);
+	return err;
+
+out:
+	mutex_unlock(&dir->i_mutex);
+	kfree(bs);
+	return err;
+}
+
+static int uxfs_dir_ioctl(struct inode *inode, struct file *filp,
+			  unsigned int cmd, unsigned long arg)
+{
+	__u32 nblocks;
+	int err;
+
+	switch (cmd) {
+	case UX_IOC_COMPACT:
+		if (!is_owner_or_cap(inode))
+			return -EACCES;
+		if (IS_RDONLY(inode))
+			return -EROFS;
+		mutex_lock(&inode->i_mutex);
+		err = uxfs_dir_compact(inode);
+		mutex_unlock(&inode->i_mutex);
+		return err;
+	case UX_IOC_BULKSTAT:
+		return uxfs_bulkstat(inode, (struct ux_bulkstat __user *)arg);
+	case UX_IOC_RESIZE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (get_user(nblocks, (__u32 __user *)arg))
+			return -EFAULT;
+		err = uxfs_resize(inode->i_sb, &nblocks);
+		if (!err && put_user(nblocks, (__u32 __user *)arg))
+			err = -EFAULT;
+		return err;
+	case FS_IOC_GETFLAGS:
+	case FS_IOC_SETFLAGS:
+		return uxfs_flags_ioctl(inode, cmd, arg);
+	}
+	return -ENOTTY;
+}
+
 struct file_operations ux_dir_operations = {
 	.read		= generic_read_dir,
 	.readdir	= uxfs_readdir,
+	.ioctl		= uxfs_dir_ioctl,
 };
@@ -1,5 +1,9 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/pagemap.h>
+#include <linux/xattr.h>
+#include <asm/uaccess.h>
 #include "uxfs.h"
 
 static int uxfs_sync_file(struct file * file, struct dentry *dentry, int datasync)
@@ -17,6 +21,331 @@ static int uxfs_sync_file(struct file * file, struct dentry *dentry, int datasyn
 	return err ? -EIO : 0;
 }
 
+/*
+ * Make [doff, doff + len) of dst share the blocks behind
+ * [soff, soff + len) of src. Both i_mutexes are held.
+ */
+static int uxfs_clone_blocks(struct inode *src, struct inode *dst,
+			     u64 soff, u64 len, u64 doff)
+{
+	struct super_block *sb = dst->i_sb;
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	struct ux_inode_info *ux_src = uxfs_i(src), *ux_dst = uxfs_i(dst);
+	__u32	sdata[UX_DIRECT_BLOCKS], *ddata = ux_dst->i_data;
+	int	sb0 = soff / UX_BSIZE, db0 = doff / UX_BSIZE;
+	int	n = (len + UX_BSIZE - 1) / UX_BSIZE, i, err = 0;
+	unsigned seq;
+	__u32	blk, old;
+
+	if (len % UX_BSIZE && doff + len < dst->i_size)
+		return -EINVAL;
+	if (doff + len > sb->s_maxbytes)
+		return -EFBIG;
+
+	do {
+		seq = read_seqbegin(&ux_src->i_map_seq);
+		memcpy(sdata, ux_src->i_data, sizeof(sdata));
+	} while (read_seqretry(&ux_src->i_map_seq, seq));
+
+	mutex_lock(&ux_dst->i_map_mutex);
+	/* Fail before touching anything if a count would overflow. */
+	for (i = 0; i < n; i++) {
+		blk = sdata[sb0 + i];
+		if (blk && blk != ddata[db0 + i] &&
+		    sbi->s_block[blk - UX_FIRST_DATA_BLOCK] >= UX_BLOCK_MAXREF) {
+			err = -EMLINK;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		blk = sdata[sb0 + i];
+		old = ddata[db0 + i];
+		if (blk == old)
+			continue;
+		/* Another clone may have taken the last reference since. */
+		if (blk && (err = uxfs_ref_block(sb, blk))) {
+			mark_inode_dirty(dst);
+			goto out;
+		}
+		uxfs_map_set(dst, db0 + i, blk,
+			     (blk ? UX_BSIZE / 512 : 0) -
+			     (old ? UX_BSIZE / 512 : 0));
+		if (old)
+			uxfs_free_block(sb, old);
+	}
+	sb->s_dirt = 1;
+	if (doff + len > dst->i_size)
+		i_size_write(dst, doff + len);
+	dst->i_mtime = dst->i_ctime = current_fs_time(sb);
+	mark_inode_dirty(dst);
+out:
+	mutex_unlock(&ux_dst->i_map_mutex);
+	return err;
+}
+
+static int uxfs_clone(struct file *dst_file, unsigned long srcfd,
+		      u64 soff, u64 len, u64 doff)
+{
+	struct inode *dst = dst_file->f_dentry->d_inode, *src;
+	struct file *src_file;
+	pgoff_t first, last;
+	int err;
+
+	if (!(dst_file->f_mode & FMODE_WRITE) ||
+	    (dst_file->f_flags & O_APPEND))
+		return -EBADF;
+	src_file = fget(srcfd);
+	if (!src_file)
+		return -EBADF;
+	src = src_file->f_dentry->d_inode;
+	err = -EBADF;
+	if (!(src_file->f_mode & FMODE_READ))
+		goto out_fput;
+	err = -EXDEV;
+	if (src->i_sb != dst->i_sb)
+		goto out_fput;
+	err = -EINVAL;
+	if (!S_ISREG(src->i_mode) || src == dst ||
+	    uxfs_compressed(src) || uxfs_compressed(dst))
+		goto out_fput;
+
+	if (src < dst) {
+		mutex_lock_nested(&src->i_mutex, I_MUTEX_PARENT);
+		mutex_lock_nested(&dst->i_mutex, I_MUTEX_CHILD);
+	} else {
+		mutex_lock_nested(&dst->i_mutex, I_MUTEX_PARENT);
+		mutex_lock_nested(&src->i_mutex, I_MUTEX_CHILD);
+	}
+
+	err = -EINVAL;
+	if (!len && soff <= src->i_size)
+		len = src->i_size - soff;
+	if (!len || soff % UX_BSIZE || doff % UX_BSIZE ||
+	    soff + len < soff || soff + len > src->i_size ||
+	    (len % UX_BSIZE && soff + len != src->i_size))
+		goto out_unlock;
+
+	/*
+	 * Get the source's data onto disk and drop the destination's
+	 * cached pages over the range, which would otherwise still map
+	 * the blocks being replaced.
+	 */
+	err = filemap_write_and_wait(src->i_mapping);
+	if (!err)
+		err = filemap_write_and_wait(dst->i_mapping);
+	if (err)
+		goto out_unlock;
+	first = doff >> PAGE_CACHE_SHIFT;
+	last = (doff + len - 1) >> PAGE_CACHE_SHIFT;
+	err = invalidate_inode_pages2_range(dst->i_mapping, first, last);
+	if (!err)
+		err = uxfs_clone_blocks(src, dst, soff, len, doff);
+
+out_unlock:
+	mutex_unlock(&src->i_mutex);
+	mutex_unlock(&dst->i_mutex);
+out_fput:
+	fput(src_file);
+	return err;
+}
+
+/*
+ * Count the physically contiguous runs of a file's blocks; a hole
+ * ends a run.
+ */
+static int uxfs_extents(struct inode *inode, int *nblocks)
+{
+	__u32 *data = uxfs_i(inode)->i_data;
+	int i, n = 0, ext = 0;
+
+	for (i = 0; i < UX_DIRECT_BLOCKS; i++) {
+		if (!data[i])
+			continue;
+		n++;
+		if (!i || data[i] != data[i - 1] + 1)
+			ext++;
+	}
+	*nblocks = n;
+	return ext;
+}
+
+/*
+ * Move the cached buffer for block i of the file to blk, once the map
+ * points there. A reader that mapped the old block already has the
+ * page locked, so it is found here once its read is done. Writeback
+ * or an mmap store may have put newer data in the old block since it
+ * was copied, so an uptodate buffer is dirtied to go to the new one.
+ */
+static void uxfs_defrag_page(struct inode *inode, int i, __u32 blk)
+{
+	int shift = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	struct buffer_head *bh;
+	struct page *page;
+	int n;
+
+	page = find_lock_page(inode->i_mapping, i >> shift);
+	if (!page)
+		return;
+	wait_on_page_writeback(page);
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, 1 << inode->i_blkbits, 0);
+	bh = page_buffers(page);
+	for (n = i & ((1 << shift) - 1); n; n--)
+		bh = bh->b_this_page;
+	map_bh(bh, inode->i_sb, blk);
+	if (PageUptodate(page)) {
+		set_buffer_uptodate(bh);
+		mark_buffer_dirty(bh);
+	}
+	unlock_page(page);
+	page_cache_release(page);
+}
+
+/*
+ * Copy the file's blocks into one free run, in file order, and switch
+ * the mapping over. i_mutex, held by the caller, keeps out write(2)
+ * but not mmap stores or writeback, which can still fill a hole; the
+ * map is copied under i_map_mutex and the defrag given up (EAGAIN) if
+ * it has changed by the switch. The old blocks are freed only once
+ * the data and the inode pointing at the new ones are on disk.
+ */
+static int uxfs_defrag(struct inode *inode, struct ux_defrag *df)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	__u32	*data = ux_inode->i_data;
+	struct buffer_head *bhs[UX_DIRECT_BLOCKS], *bh;
+	__u32	old[UX_DIRECT_BLOCKS];
+	int	i, n = 0, nblocks, blk, err;
+
+	df->df_before = df->df_after = uxfs_extents(inode, &nblocks);
+	df->df_blocks = nblocks;
+	if ((df->df_flags & UX_DEFRAG_QUERY) || df->df_before <= 1)
+		return 0;
+	/* Clusters are placed by the compressor; leave them be. */
+	if (uxfs_compressed(inode))
+		return -EOPNOTSUPP;
+
+	err = filemap_write_and_wait(inode->i_mapping);
+	if (err)
+		return err;
+	mutex_lock(&ux_inode->i_map_mutex);
+	memcpy(old, data, sizeof(old));
+	mutex_unlock(&ux_inode->i_map_mutex);
+	for (i = 0, n = 0; i < UX_DIRECT_BLOCKS; i++) {
+		if (!old[i])
+			continue;
+		if (sbi->s_block[old[i] - UX_FIRST_DATA_BLOCK] > UX_BLOCK_INUSE)
+			return -EBUSY;
+		n++;
+	}
+	nblocks = n;
+	n = 0;
+	blk = uxfs_new_run(sb, nblocks, &err);
+	if (err)
+		return err;
+
+	for (i = 0; i < UX_DIRECT_BLOCKS && !err; i++) {
+		if (!old[i])
+			continue;
+		bh = sb_bread(sb, old[i]);
+		if (!bh) {
+			err = -EIO;
+			break;
+		}
+		bhs[n] = sb_getblk(sb, blk + n);
+		lock_buffer(bhs[n]);
+		memcpy(bhs[n]->b_data, bh->b_data, UX_BSIZE);
+		set_buffer_uptodate(bhs[n]);
+		unlock_buffer(bhs[n]);
+		mark_buffer_dirty(bhs[n]);
+		brelse(bh);
+		n++;
+	}
+	if (!err)
+		ll_rw_block(SWRITE, n, bhs);
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			err = -EIO;
+		brelse(bhs[i]);
+	}
+	if (err) {
+		for (i = 0; i < nblocks; i++)
+			uxfs_free_block(sb, blk + i);
+		return err;
+	}
+
+	mutex_lock(&ux_inode->i_map_mutex);
+	if (memcmp(old, data, sizeof(old))) {
+		mutex_unlock(&ux_inode->i_map_mutex);
+		for (i = 0; i < nblocks; i++)
+			uxfs_free_block(sb, blk + i);
+		return -EAGAIN;
+	}
+	for (i = 0, n = 0; i < UX_DIRECT_BLOCKS; i++) {
+		if (old[i])
+			uxfs_map_set(inode, i, blk + n++, 0);
+	}
+	mutex_unlock(&ux_inode->i_map_mutex);
+
+	/* Page locks nest outside i_map_mutex, so the pages come after. */
+	for (i = 0, n = 0; i < UX_DIRECT_BLOCKS; i++) {
+		if (old[i])
+			uxfs_defrag_page(inode, i, blk + n++);
+	}
+	mark_inode_dirty(inode);
+	/* If either can't be written the old blocks stay allocated. */
+	err = filemap_write_and_wait(inode->i_mapping);
+	if (err)
+		return err;
+	if (uxfs_sync_inode(inode))
+		return -EIO;
+	for (i = 0; i < UX_DIRECT_BLOCKS; i++) {
+		if (old[i])
+			uxfs_free_block(sb, old[i]);
+	}
+	df->df_after = 1;
+	return 0;
+}
+
+static int uxfs_file_ioctl(struct inode *inode, struct file *filp,
+			   unsigned int cmd, unsigned long arg)
+{
+	struct ux_clone_range cr;
+	struct ux_defrag df;
+	int err;
+
+	switch (cmd) {
+	case UX_IOC_CLONE:
+		return uxfs_clone(filp, arg, 0, 0, 0);
+	case UX_IOC_CLONE_RANGE:
+		if (copy_from_user(&cr, (void __user *)arg, sizeof(cr)))
+			return -EFAULT;
+		return uxfs_clone(filp, cr.src_fd, cr.src_offset,
+				  cr.src_length, cr.dest_offset);
+	case UX_IOC_DEFRAG:
+		if (copy_from_user(&df, (void __user *)arg, sizeof(df)))
+			return -EFAULT;
+		if (!(df.df_flags & UX_DEFRAG_QUERY) && !is_owner_or_cap(inode))
+			return -EACCES;
+		if (!(df.df_flags & UX_DEFRAG_QUERY) && IS_RDONLY(inode))
+			return -EROFS;
+		mutex_lock(&inode->i_mutex);
+		err = uxfs_defrag(inode, &df);
+		mutex_unlock(&inode->i_mutex);
+		if (!err && copy_to_user((void __user *)arg, &df, sizeof(df)))
+			err = -EFAULT;
+		return err;
+	case FS_IOC_GETFLAGS:
+	case FS_IOC_SETFLAGS:
+		return uxfs_flags_ioctl(inode, cmd, arg);
+	}
+	return -ENOTTY;
+}
+
 struct file_operations ux_file_operations = {
 	.llseek		= generic_file_llseek,
 	.read		= do_sync_read,
@@ -25,6 +354,7 @@ struct file_operations ux_file_operations = {
 	.aio_write	= generic_file_aio_write,
 	.mmap		= generic_file_mmap,
 	.fsync		= uxfs_sync_file,
+	.ioctl		= uxfs_file_ioctl,
 };
 
 static int uxfs_get_block(struct inode *inode, sector_t block,
@@ -32,35 +362,123 @@ static int uxfs_get_block(struct inode *inode, sector_t block,
 {
 	struct ux_inode_info *ux_inode = uxfs_i(inode);
 	__u32	blk;
-	int	error;
+	int	error = 0;
 
 	/* First check to see is the file can be extended. */
 	if (block >= UX_DIRECT_BLOCKS)
 		return -EFBIG;
 
-	/* If we're creating, we must allocate a new block.  */
-	if (create) {
-		blk = uxfs_new_block(inode->i_sb, &error);
+	/*
+	 * Only holes need a new block, and only filling one takes
+	 * i_map_mutex; mapping a block that is there takes no lock. A
+	 * block shared with a clone is mapped as it is, so a partial
+	 * write can read it in first; uxfs_cow_page() moves the buffer
+	 * before it is written.
+	 */
+	blk = ux_inode->i_data[block];
+	if (!blk) {
+		if (!create)
+			return 0;
+		mutex_lock(&ux_inode->i_map_mutex);
+		blk = ux_inode->i_data[block];
+		if (!blk) {
+			blk = uxfs_new_block(inode->i_sb, &error);
+			if (!error) {
+				uxfs_map_set(inode, block, blk, UX_BSIZE / 512);
+				mark_inode_dirty(inode);
+				set_buffer_new(bh);
+			}
+		}
+		mutex_unlock(&ux_inode->i_map_mutex);
 		if (error) {
 			printk("uxfs: ux_get_block - Out of space\n");
 			return -ENOSPC;
 		}
-		ux_inode->i_data[block] = blk;
-		inode->i_blocks += UX_BSIZE / 512;
-		mark_inode_dirty(inode);
 	}
 
-	map_bh(bh, inode->i_sb, ux_inode->i_data[block]);
+	map_bh(bh, inode->i_sb, blk);
 	return 0;
 }
 
+/*
+ * Give the file a private block in place of one it shares with a
+ * clone. The whole buffer is uptodate or about to be overwritten, so
+ * it is only pointed at the new block; nothing is copied.
+ */
+static int uxfs_cow_buffer(struct inode *inode, struct buffer_head *bh,
+			   sector_t block)
+{
+	struct ux_sb_info *sbi = uxfs_sb(inode->i_sb);
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	__u32	old, blk;
+	int	error = 0;
+
+	mutex_lock(&ux_inode->i_map_mutex);
+	old = ux_inode->i_data[block];
+	if (!old || sbi->s_block[old - UX_FIRST_DATA_BLOCK] <= UX_BLOCK_INUSE)
+		goto out;
+	blk = uxfs_new_block(inode->i_sb, &error);
+	if (error) {
+		error = -ENOSPC;
+		goto out;
+	}
+	uxfs_map_set(inode, block, blk, 0);
+	uxfs_free_block(inode->i_sb, old);
+	mark_inode_dirty(inode);
+	map_bh(bh, inode->i_sb, blk);
+out:
+	mutex_unlock(&ux_inode->i_map_mutex);
+	return error;
+}
+
+/*
+ * Break sharing for the mapped buffers of a page that overlap
+ * [from, to), or only for its dirty ones when writing the page back.
+ */
+static int uxfs_cow_page(struct inode *inode, struct page *page,
+			 unsigned from, unsigned to, int dirty_only)
+{
+	struct buffer_head *head, *bh;
+	sector_t block;
+	unsigned start = 0;
+	int err = 0;
+
+	if (!page_has_buffers(page))
+		return 0;
+	block = (sector_t)page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+	head = bh = page_buffers(page);
+	do {
+		if (start < to && start + bh->b_size > from &&
+		    block < UX_DIRECT_BLOCKS && buffer_mapped(bh) &&
+		    (!dirty_only || buffer_dirty(bh)))
+			err = uxfs_cow_buffer(inode, bh, block);
+		start += bh->b_size;
+		block++;
+		bh = bh->b_this_page;
+	} while (!err && bh != head);
+	return err;
+}
+
 static int uxfs_writepage(struct page *page, struct writeback_control *wbc)
 {
+	int err;
+
+	if (uxfs_compressed(page->mapping->host))
+		return uxfs_zwritepage(page, wbc);
+	err = uxfs_cow_page(page->mapping->host, page, 0, PAGE_CACHE_SIZE, 1);
+	if (err) {
+		SetPageError(page);
+		mapping_set_error(page->mapping, err);
+		unlock_page(page);
+		return err;
+	}
 	return block_write_full_page(page, uxfs_get_block, wbc);
 }
 
 static int uxfs_readpage(struct file *file, struct page *page)
 {
+	if (uxfs_compressed(page->mapping->host))
+		return uxfs_zreadpage(file, page);
 	return block_read_full_page(page,uxfs_get_block);
 }
 
@@ -76,12 +494,41 @@ static int uxfs_write_begin(struct file *file, struct address_space *mapping,
 			loff_t pos, unsigned len, unsigned flags,
 			struct page **pagep, void **fsdata)
 {
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	int err;
+
+	if (uxfs_compressed(mapping->host))
+		return uxfs_zwrite_begin(file, mapping, pos, len, flags, pagep,
+					 fsdata);
 	*pagep = NULL;
-	return __uxfs_write_begin(file, mapping, pos, len, flags, pagep, fsdata);
+	err = __uxfs_write_begin(file, mapping, pos, len, flags, pagep, fsdata);
+	if (err)
+		return err;
+	err = uxfs_cow_page(mapping->host, *pagep, from, from + len, 0);
+	if (err) {
+		unlock_page(*pagep);
+		page_cache_release(*pagep);
+		*pagep = NULL;
+	}
+	return err;
+}
+
+static int uxfs_write_end(struct file *file, struct address_space *mapping,
+			  loff_t pos, unsigned len, unsigned copied,
+			  struct page *page, void *fsdata)
+{
+	if (uxfs_compressed(mapping->host))
+		return simple_write_end(file, mapping, pos, len, copied, page,
+					fsdata);
+	return generic_write_end(file, mapping, pos, len, copied, page,
+				 fsdata);
 }
 
 static sector_t uxfs_bmap(struct address_space *mapping, sector_t block)
 {
+	/* A compressed cluster has no block for each part of the file. */
+	if (uxfs_compressed(mapping->host))
+		return 0;
 	return generic_block_bmap(mapping,block,uxfs_get_block);
 }
 
@@ -90,30 +537,76 @@ struct address_space_operations ux_aops = {
 	.writepage = uxfs_writepage,
 	.sync_page = block_sync_page,
 	.write_begin = uxfs_write_begin,
-	.write_end = generic_write_end,
+	.write_end = uxfs_write_end,
 	.bmap = uxfs_bmap
 };
 
+/*
+ * For a linked inode the table block with the new size and cleared
+ * slots is written before any block is released, and the orphan bit
+ * cleared only after that. A crash in between leaks the blocks, for
+ * uxfsck to find, rather than leave the inode pointing at blocks the
+ * map calls free.
+ */
 void uxfs_truncate(struct inode * inode)
 {
-	struct ux_sb_info *sbi = uxfs_sb(inode->i_sb);
 	struct ux_inode_info *ux_inode = uxfs_i(inode);
-	int i, blk, last_block;
+	__u32	freed[UX_DIRECT_BLOCKS];
+	int i, n = 0, blk, last_block, orphan = 0;
 	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) || S_ISLNK(inode->i_mode)))
 		return;
 
+	/* Clones can leave holes, so look at every slot past the end. */
 	last_block = (inode->i_size + UX_BSIZE - 1) / UX_BSIZE;
-	block_truncate_page(inode->i_mapping, inode->i_size, uxfs_get_block);
-	for (i = last_block; i < (inode->i_blocks / 2); i++) {
+	if (uxfs_compressed(inode)) {
+		last_block = roundup(last_block, UX_CLUSTER_BLOCKS);
+		mutex_lock(&ux_inode->i_map_mutex);
+		write_seqlock(&ux_inode->i_map_seq);
+		ux_inode->i_cmap &= (1U << last_block / UX_CLUSTER_BLOCKS) - 1;
+		write_sequnlock(&ux_inode->i_map_seq);
+		mutex_unlock(&ux_inode->i_map_mutex);
+	}
+	for (i = last_block; i < UX_DIRECT_BLOCKS; i++)
+		if (ux_inode->i_data[i])
+			break;
+	if (i < UX_DIRECT_BLOCKS && inode->i_nlink) {
+		uxfs_orphan_add(inode);
+		orphan = 1;
+	}
+	if (uxfs_compressed(inode))
+		uxfs_ztruncate_page(inode);
+	else
+		block_truncate_page(inode->i_mapping, inode->i_size,
+				    uxfs_get_block);
+	/*
+	 * The map lock is only taken now: block_truncate_page() locks a
+	 * page, and page locks come before it.
+	 */
+	mutex_lock(&ux_inode->i_map_mutex);
+	for (i = last_block; i < UX_DIRECT_BLOCKS; i++) {
 		blk = ux_inode->i_data[i];
-		if (blk) {
-			sbi->s_block[blk - UX_FIRST_DATA_BLOCK] = UX_BLOCK_FREE;
-			sbi->s_nbfree++;
-		}
+		if (!blk)
+			continue;
+		/* Directories count i_blocks in blocks, files in sectors. */
+		uxfs_map_set(inode, i, 0,
+			     S_ISDIR(inode->i_mode) ? -1 : -(UX_BSIZE / 512));
+		freed[n++] = blk;
 	}
-	inode->i_blocks = last_block * 2;
+	mutex_unlock(&ux_inode->i_map_mutex);
+
+	/* If the inode can't be written the blocks stay allocated. */
+	if (orphan && uxfs_sync_inode(inode))
+		return;
+	for (i = 0; i < n; i++)
+		uxfs_free_block(inode->i_sb, freed[i]);
+	if (orphan)
+		uxfs_orphan_del(inode);
 }
 
 struct inode_operations ux_file_inode_operations = {
 	.truncate	= uxfs_truncate,
+	.setxattr	= generic_setxattr,
+	.getxattr	= generic_getxattr,
+	.listxattr	= uxfs_listxattr,
+	.removexattr	= generic_removexattr,
 };
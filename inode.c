@@ -5,6 +5,9 @@
 #include <linux/init.h>
 #include <linux/buffer_head.h>
 #include <linux/statfs.h>
+#include <linux/parser.h>
+#include <linux/blkdev.h>
+#include <asm/uaccess.h>
 #include "uxfs.h"
 
 static int uxfs_statfs(struct dentry *dentry, struct kstatfs *buf)
@@ -13,7 +16,7 @@ static int uxfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	struct ux_sb_info *sbi = uxfs_sb(sb);
 	buf->f_type = sb->s_magic;
 	buf->f_bsize = sb->s_blocksize;
-	buf->f_blocks = UX_MAXBLOCKS;
+	buf->f_blocks = sbi->s_nblocks;
 	buf->f_bfree = sbi->s_nbfree;
 	buf->f_bavail = sbi->s_nbfree;
 	buf->f_files = UX_MAXFILES;
@@ -29,7 +32,7 @@ uxfs_raw_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh)
 	struct ux_inode *p;
 
 	*bh = NULL;
-	if (!ino || ino > UX_MAXFILES) {
+	if (!ino || ino >= UX_NINODES) {
 		printk("Bad inode number on dev %s: %ld is out of range\n",
 		       sb->s_id, (long)ino);
 		return NULL;
@@ -82,21 +85,73 @@ struct inode * uxfs_iget(struct super_block *sb, unsigned long ino)
 	inode->i_atime.tv_sec = raw_inode->i_atime;
 	inode->i_mtime.tv_sec = raw_inode->i_mtime;
 	inode->i_ctime.tv_sec = raw_inode->i_ctime;
-	inode->i_mtime.tv_nsec = 0;
-	inode->i_atime.tv_nsec = 0;
-	inode->i_ctime.tv_nsec = 0;
+	inode->i_atime.tv_nsec = raw_inode->i_atime_ns % NSEC_PER_SEC;
+	inode->i_mtime.tv_nsec = raw_inode->i_mtime_ns % NSEC_PER_SEC;
+	inode->i_ctime.tv_nsec = raw_inode->i_ctime_ns % NSEC_PER_SEC;
 	inode->i_uid = (uid_t)raw_inode->i_uid;
 	inode->i_gid = (gid_t)raw_inode->i_gid;
 	inode->i_size = raw_inode->i_size;
 	inode->i_blocks = raw_inode->i_blocks;
 	for (i = 0; i < UX_DIRECT_BLOCKS; i++)
 		ux_inode->i_data[i] = raw_inode->i_addr[i];
+	ux_inode->i_flags = raw_inode->i_flags;
+	ux_inode->i_cmap = raw_inode->i_cmap;
+	if (uxfs_xattr_load(inode, (char *)raw_inode + UX_XATTR_OFFSET)) {
+		brelse(bh);
+		iget_failed(inode);
+		return ERR_PTR(-ENOMEM);
+	}
 	uxfs_set_inode(inode);
 	brelse(bh);
+	/*
+	 * Nothing on an immutable image changes, so a directory's blocks
+	 * are read in along with it, ready for lookup and readdir.
+	 */
+	if (uxfs_immutable(sb) && S_ISDIR(inode->i_mode))
+		uxfs_dir_readahead(inode);
 	unlock_new_inode(inode);
 	return inode;
 }
 
+/*
+ * FS_IOC_GETFLAGS and FS_IOC_SETFLAGS, for files and directories.
+ * Compression can only be switched on or off while a file is empty.
+ */
+int uxfs_flags_ioctl(struct inode *inode, unsigned int cmd, unsigned long arg)
+{
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	unsigned int flags;
+	int err = 0;
+
+	if (cmd == FS_IOC_GETFLAGS)
+		return put_user(ux_inode->i_flags, (int __user *)arg);
+	if (IS_RDONLY(inode))
+		return -EROFS;
+
+	if (!is_owner_or_cap(inode))
+		return -EACCES;
+	if (get_user(flags, (int __user *)arg))
+		return -EFAULT;
+	flags &= UX_FL_USER_MODIFIABLE;
+
+	mutex_lock(&inode->i_mutex);
+	if ((flags ^ ux_inode->i_flags) & UX_COMPR_FL) {
+		if (PAGE_CACHE_SIZE != UX_CLUSTER_SIZE)
+			err = -EOPNOTSUPP;
+		else if (S_ISREG(inode->i_mode) &&
+			 (inode->i_size || inode->i_blocks))
+			err = -EBUSY;
+	}
+	if (!err) {
+		ux_inode->i_flags = (ux_inode->i_flags & ~UX_FL_USER_MODIFIABLE) |
+				    flags;
+		inode->i_ctime = current_fs_time(inode->i_sb);
+		mark_inode_dirty(inode);
+	}
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
 static struct kmem_cache * uxfs_inode_cachep;
 
 static struct inode *uxfs_alloc_inode(struct super_block *sb)
@@ -105,11 +160,15 @@ static struct inode *uxfs_alloc_inode(struct super_block *sb)
 	ei = (struct ux_inode_info *)kmem_cache_alloc(uxfs_inode_cachep, GFP_KERNEL);
 	if (!ei)
 		return NULL;
+	ei->i_dvalid = 0;
+	ei->i_xattr = NULL;
+	INIT_LIST_HEAD(&ei->i_lazy);
 	return &ei->vfs_inode;
 }
 
 static void uxfs_destroy_inode(struct inode *inode)
 {
+	kfree(uxfs_i(inode)->i_xattr);
 	kmem_cache_free(uxfs_inode_cachep, uxfs_i(inode));
 }
 
@@ -117,6 +176,9 @@ static void init_once(void * foo)
 {
 	struct ux_inode_info *ei = (struct ux_inode_info *) foo;
 
+	init_rwsem(&ei->i_xattr_sem);
+	mutex_init(&ei->i_map_mutex);
+	seqlock_init(&ei->i_map_seq);
 	inode_init_once(&ei->vfs_inode);
 }
 
@@ -137,37 +199,97 @@ static void destroy_inodecache(void)
 	kmem_cache_destroy(uxfs_inode_cachep);
 }
 
-static void uxfs_put_super(struct super_block *sb)
+/*
+ * Copy the in-core counts back into the superblock buffer; the maps
+ * are already there. A read-only mount leaves the buffer alone.
+ */
+static void uxfs_commit_super(struct super_block *sb)
 {
 	struct ux_sb_info *sbi = uxfs_sb(sb);
 	struct ux_superblock *usb = sbi->s_ms;
-	int	i;
+	int	r;
 
-	if (!(sb->s_flags & MS_RDONLY))
-		mark_buffer_dirty(sbi->s_sbh);
+	sb->s_dirt = 0;
+	if (sb->s_flags & MS_RDONLY)
+		return;
 	usb->s_nifree = sbi->s_nifree;
 	usb->s_nbfree = sbi->s_nbfree;
+	usb->s_nblocks = sbi->s_nblocks;
 	usb->s_mod = sbi->s_mount_state;
-	for (i = 0; i < UX_MAXFILES; i++)
-		usb->s_inode[i] = sbi->s_inode[i];
-	for (i = 0; i < UX_MAXBLOCKS; i++)
-		usb->s_block[i] = sbi->s_block[i];
-	brelse(sbi->s_sbh);
-	sb->s_fs_info = NULL;
-	kfree(sbi);
-	return;
+	usb->s_inoinit = sbi->s_inoinit;
+	usb->s_orphan = sbi->s_orphan;
+	usb->s_features = sbi->s_features;
+	for (r = 0; r < UX_NREGIONS; r++)
+		usb->s_rfree[r] = sbi->s_rfree[r];
+	mark_buffer_dirty(sbi->s_sbh);
 }
 
-static struct buffer_head * uxfs_update_inode(struct inode * inode)
+/*
+ * Grow the data area to *nblocks blocks, or as far as the device and
+ * the block map allow if it is 0, and return the new size there. The
+ * inode table and the map are fixed in size, so growing only frees
+ * the map entries past the old end; it is written out before return.
+ */
+int uxfs_resize(struct super_block *sb, __u32 *nblocks)
+{
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	struct buffer_head *bh;
+	sector_t devblocks;
+	__u32 i, n = *nblocks;
+	int err = 0;
+
+	if (sb->s_flags & MS_RDONLY)
+		return -EROFS;
+	mutex_lock(&sbi->s_resize_lock);
+	devblocks = i_size_read(sb->s_bdev->bd_inode) >> UX_BSIZE_BITS;
+	if (!n)
+		n = min_t(sector_t, devblocks - UX_FIRST_DATA_BLOCK,
+			  UX_MAXBLOCKS);
+	if (n < sbi->s_nblocks)
+		err = -EINVAL;		/* no shrinking */
+	else if (n > UX_MAXBLOCKS)
+		err = -EFBIG;
+	else if (UX_FIRST_DATA_BLOCK + n > devblocks)
+		err = -ENOSPC;
+	*nblocks = n;
+	if (err || n == sbi->s_nblocks)
+		goto out;
+
+	/* Make sure the new end of the device is really there. */
+	bh = sb_bread(sb, UX_FIRST_DATA_BLOCK + n - 1);
+	if (!bh) {
+		err = -EIO;
+		goto out;
+	}
+	brelse(bh);
+
+	spin_lock(&sbi->s_alloc_lock);
+	if (n <= sbi->s_nblocks) {
+		spin_unlock(&sbi->s_alloc_lock);
+		err = n < sbi->s_nblocks ? -EINVAL : 0;
+		goto out;
+	}
+	for (i = sbi->s_nblocks; i < n; i++) {
+		sbi->s_block[i] = UX_BLOCK_FREE;
+		sbi->s_rfree[i / UX_REGION_BLOCKS]++;
+	}
+	sbi->s_nbfree += n - sbi->s_nblocks;
+	sbi->s_nblocks = n;
+	spin_unlock(&sbi->s_alloc_lock);
+	uxfs_commit_super(sb);
+	sync_dirty_buffer(sbi->s_sbh);
+	printk("uxfs: %s: grown to %u data blocks\n", sb->s_id, n);
+out:
+	mutex_unlock(&sbi->s_resize_lock);
+	return err;
+}
+
+static void uxfs_fill_raw_inode(struct inode *inode, struct ux_inode *raw_inode)
 {
-	struct buffer_head	*bh;	
-	struct ux_inode		*raw_inode;
 	struct ux_inode_info	*ux_inode = uxfs_i(inode);
+	unsigned		seq;
 	int			i;
 
-	raw_inode = uxfs_raw_inode(inode->i_sb, inode->i_ino, &bh);
-	if (!raw_inode)
-		return NULL;
 	raw_inode->i_mode = inode->i_mode;
 	raw_inode->i_uid = inode->i_uid;
 	raw_inode->i_gid = inode->i_gid;
@@ -176,16 +298,218 @@ static struct buffer_head * uxfs_update_inode(struct inode * inode)
 	raw_inode->i_mtime = inode->i_mtime.tv_sec;
 	raw_inode->i_atime = inode->i_atime.tv_sec;
 	raw_inode->i_ctime = inode->i_ctime.tv_sec;
-	raw_inode->i_blocks = inode->i_blocks;
-	for (i = 0; i < UX_DIRECT_BLOCKS; i++)
-		raw_inode->i_addr[i] = ux_inode->i_data[i];
+	raw_inode->i_mtime_ns = inode->i_mtime.tv_nsec;
+	raw_inode->i_atime_ns = inode->i_atime.tv_nsec;
+	raw_inode->i_ctime_ns = inode->i_ctime.tv_nsec;
+	raw_inode->i_flags = ux_inode->i_flags;
+	/* Writeback may be allocating blocks under us. */
+	do {
+		seq = read_seqbegin(&ux_inode->i_map_seq);
+		raw_inode->i_blocks = inode->i_blocks;
+		for (i = 0; i < UX_DIRECT_BLOCKS; i++)
+			raw_inode->i_addr[i] = ux_inode->i_data[i];
+		raw_inode->i_cmap = ux_inode->i_cmap;
+	} while (read_seqretry(&ux_inode->i_map_seq, seq));
+}
+
+/*
+ * Lazytime. When only an inode's timestamps have changed since it was
+ * last written, its table block is left alone and the inode goes on
+ * the s_lazy list, oldest first. The times are written with the next
+ * real update of the inode, at sync or unmount, when the inode leaves
+ * the cache, or once they are UX_LAZYTIME_EXPIRE old.
+ *
+ * Returns 1 if the update can be skipped. Called with s_lazy_lock held.
+ */
+static int uxfs_lazy_check(struct inode *inode, struct ux_inode *raw_inode)
+{
+	struct ux_sb_info *sbi = uxfs_sb(inode->i_sb);
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	struct ux_inode new;
+
+	memcpy(&new, raw_inode, sizeof(new));
+	uxfs_fill_raw_inode(inode, &new);
+	if (memcmp(&new, raw_inode, sizeof(new)) == 0)
+		return 1;
+	new.i_atime = raw_inode->i_atime;
+	new.i_mtime = raw_inode->i_mtime;
+	new.i_ctime = raw_inode->i_ctime;
+	new.i_atime_ns = raw_inode->i_atime_ns;
+	new.i_mtime_ns = raw_inode->i_mtime_ns;
+	new.i_ctime_ns = raw_inode->i_ctime_ns;
+	if (memcmp(&new, raw_inode, sizeof(new)) != 0)
+		return 0;
+
+	if (list_empty(&ux_inode->i_lazy)) {
+		if (list_empty(&sbi->s_lazy))
+			schedule_delayed_work(&sbi->s_lazy_work,
+					      UX_LAZYTIME_EXPIRE);
+		ux_inode->i_lazy_since = jiffies;
+		list_add_tail(&ux_inode->i_lazy, &sbi->s_lazy);
+	}
+	return 1;
+}
+
+/* Write out held timestamps. Called with s_lazy_lock held. */
+static void uxfs_lazy_write(struct ux_inode_info *ux_inode)
+{
+	struct inode *inode = &ux_inode->vfs_inode;
+	struct buffer_head *bh;
+	struct ux_inode *raw_inode;
+
+	list_del_init(&ux_inode->i_lazy);
+	raw_inode = uxfs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+	if (raw_inode) {
+		uxfs_fill_raw_inode(inode, raw_inode);
+		mark_buffer_dirty(bh);
+	}
+	brelse(bh);
+}
+
+/*
+ * Write the held timestamps that have expired, or all of them.
+ */
+static void uxfs_flush_lazy(struct super_block *sb, int all)
+{
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	struct ux_inode_info *ux_inode, *next;
+
+	mutex_lock(&sbi->s_lazy_lock);
+	list_for_each_entry_safe(ux_inode, next, &sbi->s_lazy, i_lazy) {
+		if (!all && time_before(jiffies, ux_inode->i_lazy_since +
+					UX_LAZYTIME_EXPIRE))
+			break;
+		uxfs_lazy_write(ux_inode);
+	}
+	if (!list_empty(&sbi->s_lazy)) {
+		ux_inode = list_first_entry(&sbi->s_lazy, struct ux_inode_info,
+					    i_lazy);
+		schedule_delayed_work(&sbi->s_lazy_work,
+				      ux_inode->i_lazy_since +
+				      UX_LAZYTIME_EXPIRE - jiffies);
+	}
+	mutex_unlock(&sbi->s_lazy_lock);
+}
+
+static void uxfs_lazy_worker(struct work_struct *work)
+{
+	struct ux_sb_info *sbi = container_of(work, struct ux_sb_info,
+					      s_lazy_work.work);
+
+	uxfs_flush_lazy(sbi->s_sb, 0);
+}
+
+/*
+ * An inode leaving the cache takes its held timestamps with it unless
+ * they are written now.
+ */
+static void uxfs_clear_inode(struct inode *inode)
+{
+	struct ux_sb_info *sbi = uxfs_sb(inode->i_sb);
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+
+	/* Not just on lazytime: it may have been turned off since. */
+	if (list_empty(&ux_inode->i_lazy))
+		return;
+	mutex_lock(&sbi->s_lazy_lock);
+	if (!list_empty(&ux_inode->i_lazy)) {
+		if (inode->i_nlink)
+			uxfs_lazy_write(ux_inode);
+		else
+			list_del_init(&ux_inode->i_lazy);
+	}
+	mutex_unlock(&sbi->s_lazy_lock);
+}
+
+/*
+ * Background inode writeback only updates the table block in the
+ * buffer cache (see uxfs_write_inode), so by the time sync gets here
+ * most dirty inodes and the superblock are dirty buffers of the block
+ * device. Write them out in one ascending pass, which the block layer
+ * merges since the table is contiguous, and flush the device's write
+ * cache once for the lot. Timestamps held back by lazytime are
+ * written first.
+ */
+static int uxfs_sync_fs(struct super_block *sb, int wait)
+{
+	int err;
+
+	if (sb->s_flags & MS_RDONLY)
+		return 0;
+	uxfs_flush_lazy(sb, 1);
+	uxfs_commit_super(sb);
+	if (!wait)
+		return 0;
+	err = sync_blockdev(sb->s_bdev);
+	if (err)
+		return err;
+	err = blkdev_issue_flush(sb->s_bdev, NULL);
+	return err == -EOPNOTSUPP ? 0 : err;
+}
+
+static void uxfs_put_super(struct super_block *sb)
+{
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+
+	cancel_delayed_work_sync(&sbi->s_lazy_work);
+	uxfs_flush_lazy(sb, 1);
+	uxfs_commit_super(sb);
+	uxfs_zexit(sbi);
+	brelse(sbi->s_sbh);
+	sb->s_fs_info = NULL;
+	kfree(sbi);
+	return;
+}
+
+static void uxfs_write_super(struct super_block *sb)
+{
+	uxfs_commit_super(sb);
+}
+
+/*
+ * Copy the in-core inode into its table block. Unless force is set, a
+ * lazytime mount skips the update when only timestamps have changed.
+ */
+static struct buffer_head * uxfs_update_inode(struct inode * inode, int force)
+{
+	struct ux_sb_info	*sbi = uxfs_sb(inode->i_sb);
+	struct buffer_head	*bh;	
+	struct ux_inode		*raw_inode;
+
+	raw_inode = uxfs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+	if (!raw_inode)
+		return NULL;
+	if (sbi->s_mount_opt & UX_MOUNT_LAZYTIME) {
+		mutex_lock(&sbi->s_lazy_lock);
+		if (!force && uxfs_lazy_check(inode, raw_inode)) {
+			mutex_unlock(&sbi->s_lazy_lock);
+			return bh;
+		}
+		list_del_init(&uxfs_i(inode)->i_lazy);
+		mutex_unlock(&sbi->s_lazy_lock);
+	}
+	uxfs_fill_raw_inode(inode, raw_inode);
 	mark_buffer_dirty(bh);
 	return bh;
 }
 
+/*
+ * Background writeback only dirties the inode's table block. The
+ * flusher threads write the block device out afterwards, so table
+ * blocks go to disk together in one pass (see uxfs_sync_fs) rather
+ * than one write per inode. A caller that waits, such as an O_SYNC
+ * write, gets the block on disk before return.
+ */
 static int uxfs_write_inode(struct inode * inode, int wait)
 {
-	brelse(uxfs_update_inode(inode));
+	struct buffer_head *bh;
+
+	if (wait)
+		return uxfs_sync_inode(inode) ? -EIO : 0;
+	bh = uxfs_update_inode(inode, 0);
+	if (!bh)
+		return -EIO;
+	brelse(bh);
 	return 0;
 }
 
@@ -194,7 +518,7 @@ int uxfs_sync_inode(struct inode * inode)
 	int err = 0;
 	struct buffer_head *bh;
 
-	bh = uxfs_update_inode(inode);
+	bh = uxfs_update_inode(inode, 1);
 	if (bh && buffer_dirty(bh))
 	{
 		sync_dirty_buffer(bh);
@@ -219,14 +543,19 @@ static void uxfs_delete_inode(struct inode *inode)
 	truncate_inode_pages(&inode->i_data, 0);
 	inode->i_size = 0;
 	uxfs_truncate(inode);
+	spin_lock(&sbi->s_alloc_lock);
 	sbi->s_inode[inode->i_ino] = UX_INODE_FREE;
 	sbi->s_nifree++;
+	spin_unlock(&sbi->s_alloc_lock);
+	uxfs_orphan_del(inode);
 
 	/* clear on-disk copy */
 	raw_inode = uxfs_raw_inode(inode->i_sb, inode->i_ino, &bh);
 	if (raw_inode) {
 		raw_inode->i_nlink = 0;
 		raw_inode->i_mode = 0;
+		uxfs_xattr_clear(inode->i_sb,
+				 (char *)raw_inode + UX_XATTR_OFFSET);
 	}
 	if (bh) {
 		mark_buffer_dirty(bh);
@@ -237,30 +566,197 @@ static void uxfs_delete_inode(struct inode *inode)
 	clear_inode(inode);
 }
 
+static int uxfs_remount(struct super_block *sb, int *flags, char *data);
+
 struct super_operations uxfs_sops = {
 	.alloc_inode	= uxfs_alloc_inode,
 	.destroy_inode	= uxfs_destroy_inode,
 	.write_inode	= uxfs_write_inode,
 	.delete_inode	= uxfs_delete_inode,
+	.clear_inode	= uxfs_clear_inode,
 	.statfs		= uxfs_statfs,
 	.put_super	= uxfs_put_super,
+	.write_super	= uxfs_write_super,
+	.sync_fs	= uxfs_sync_fs,
+	.remount_fs	= uxfs_remount,
+};
+
+/*
+ * Finish off the inodes left on the orphan list: free those with no
+ * links and release the blocks past i_size of the rest. Only the
+ * listed inodes are read.
+ */
+static void uxfs_recover_orphans(struct super_block *sb)
+{
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	struct ux_inode *raw_inode;
+	struct buffer_head *bh;
+	__u32 ino, blk;
+	int b, keep, n = 0;
+
+	sbi->s_orphan &= (1U << UX_NINODES) - 1;
+	while (sbi->s_orphan) {
+		ino = ffs(sbi->s_orphan) - 1;
+		sbi->s_orphan &= ~(1U << ino);
+		sb->s_dirt = 1;
+		raw_inode = uxfs_raw_inode(sb, ino, &bh);
+		if (!raw_inode)
+			continue;
+
+		if (!raw_inode->i_nlink)
+			keep = 0;
+		else if (S_ISDIR(raw_inode->i_mode))
+			keep = UX_DIRECT_BLOCKS;
+		else
+			keep = (raw_inode->i_size + UX_BSIZE - 1) / UX_BSIZE;
+		if (S_ISREG(raw_inode->i_mode) &&
+		    (raw_inode->i_flags & UX_COMPR_FL)) {
+			keep = roundup(keep, UX_CLUSTER_BLOCKS);
+			raw_inode->i_cmap &= (1U << keep / UX_CLUSTER_BLOCKS) - 1;
+		}
+		for (b = keep; b < UX_DIRECT_BLOCKS; b++) {
+			blk = raw_inode->i_addr[b];
+			if (!blk)
+				continue;
+			raw_inode->i_addr[b] = 0;
+			if (blk >= UX_FIRST_DATA_BLOCK &&
+			    blk < UX_FIRST_DATA_BLOCK + sbi->s_nblocks &&
+			    sbi->s_block[blk - UX_FIRST_DATA_BLOCK] !=
+			    UX_BLOCK_FREE)
+				uxfs_free_block(sb, blk);
+		}
+		if (!raw_inode->i_nlink) {
+			memset(raw_inode, 0, sizeof(*raw_inode));
+			uxfs_xattr_clear(sb, (char *)raw_inode +
+					 UX_XATTR_OFFSET);
+			spin_lock(&sbi->s_alloc_lock);
+			if (sbi->s_inode[ino] == UX_INODE_INUSE) {
+				sbi->s_inode[ino] = UX_INODE_FREE;
+				sbi->s_nifree++;
+			}
+			spin_unlock(&sbi->s_alloc_lock);
+		} else if (!S_ISDIR(raw_inode->i_mode)) {
+			raw_inode->i_blocks = 0;
+			for (b = 0; b < keep; b++)
+				if (raw_inode->i_addr[b])
+					raw_inode->i_blocks += UX_BSIZE / 512;
+		}
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		n++;
+	}
+	if (n)
+		printk("uxfs: %s: recovered %d orphan inodes\n", sb->s_id, n);
+}
+
+enum { Opt_prefetch, Opt_noprefetch, Opt_lazytime, Opt_nolazytime, Opt_err };
+
+static match_table_t tokens = {
+	{Opt_prefetch, "prefetch"},
+	{Opt_noprefetch, "noprefetch"},
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+	{Opt_err, NULL}
 };
 
+static int uxfs_parse_options(char *options, struct ux_sb_info *sbi)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 1;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_prefetch:
+			sbi->s_mount_opt |= UX_MOUNT_PREFETCH;
+			break;
+		case Opt_noprefetch:
+			sbi->s_mount_opt &= ~UX_MOUNT_PREFETCH;
+			break;
+		case Opt_lazytime:
+			sbi->s_mount_opt |= UX_MOUNT_LAZYTIME;
+			break;
+		case Opt_nolazytime:
+			sbi->s_mount_opt &= ~UX_MOUNT_LAZYTIME;
+			break;
+		default:
+			printk("uxfs: unrecognized mount option \"%s\"\n", p);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Options given on remount replace the current ones; turning lazytime
+ * off writes the timestamps it was holding. Going read-write finishes
+ * any orphans; going read-only writes the superblock while that is
+ * still allowed.
+ */
+static int uxfs_remount(struct super_block *sb, int *flags, char *data)
+{
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	unsigned long old_opt = sbi->s_mount_opt;
+
+	if (!uxfs_parse_options(data, sbi)) {
+		sbi->s_mount_opt = old_opt;
+		return -EINVAL;
+	}
+	if (!(*flags & MS_RDONLY) && (sb->s_flags & MS_RDONLY) &&
+	    uxfs_immutable(sb)) {
+		sbi->s_mount_opt = old_opt;
+		printk("uxfs: %s: image is immutable\n", sb->s_id);
+		return -EROFS;
+	}
+	if (uxfs_immutable(sb))
+		sbi->s_mount_opt |= UX_MOUNT_PREFETCH;
+	if ((old_opt & ~sbi->s_mount_opt) & UX_MOUNT_LAZYTIME)
+		uxfs_flush_lazy(sb, 1);
+
+	if ((*flags & MS_RDONLY) == (sb->s_flags & MS_RDONLY))
+		return 0;
+	if (*flags & MS_RDONLY) {
+		uxfs_flush_lazy(sb, 1);
+		uxfs_commit_super(sb);
+		sync_dirty_buffer(sbi->s_sbh);
+		return 0;
+	}
+	if (sbi->s_orphan)
+		uxfs_recover_orphans(sb);
+	return 0;
+}
+
 static int uxfs_fill_super(struct super_block *s, void *data, int silent)
 {
 	struct ux_superblock	*usb;
 	struct buffer_head	*bh;
 	struct inode		*root;
 	struct ux_sb_info	*sbi;
-	int			i;
+	int			r;
 
 	sbi = kmalloc(sizeof(struct ux_sb_info), GFP_KERNEL);
 	if (!sbi)
 		return -ENOMEM;
 	s->s_fs_info = sbi;
 	memset(sbi, 0, sizeof(struct ux_sb_info));
+	sbi->s_sb = s;
+	mutex_init(&sbi->s_lazy_lock);
+	INIT_LIST_HEAD(&sbi->s_lazy);
+	INIT_DELAYED_WORK(&sbi->s_lazy_work, uxfs_lazy_worker);
+	mutex_init(&sbi->s_zlock);
+	spin_lock_init(&sbi->s_alloc_lock);
+	mutex_init(&sbi->s_resize_lock);
+
+	if (!uxfs_parse_options(data, sbi))
+		goto outnobh;
 
 	sb_set_blocksize(s, UX_BSIZE);
+	s->s_time_gran = 1;
 	s->s_maxbytes = UX_BSIZE * UX_DIRECT_BLOCKS;
 
 	bh = sb_bread(s, 0);
@@ -277,26 +773,52 @@ static int uxfs_fill_super(struct super_block *s, void *data, int silent)
 		goto out;
 	}
 	if (usb->s_mod == UX_FSDIRTY) {
-		printk("uxfs: Filesystem is not clean. Write and "
-		       "run fsck!\n");
+		printk("uxfs: Filesystem is not clean. Run uxfsck!\n");
 		goto out;
 	}
 	sbi->s_ms = usb;
 	sbi->s_sbh = bh;
 	sbi->s_nifree = usb->s_nifree;
 	sbi->s_nbfree = usb->s_nbfree;
+	sbi->s_nblocks = ux_nblocks(usb);
+	sbi->s_inoinit = usb->s_inoinit;
+	sbi->s_orphan = usb->s_orphan;
+	sbi->s_features = usb->s_features;
 	sbi->s_mount_state = usb->s_mod;
-	for (i = 0; i < UX_MAXFILES; i++)
-		sbi->s_inode[i] = usb->s_inode[i];
-	for (i = 0; i < UX_MAXBLOCKS; i++)
-		sbi->s_block[i] = usb->s_block[i];
+	sbi->s_inode = usb->s_inode;
+	sbi->s_block = usb->s_block;
+
+	/* Images made before the region counts existed get them now. */
+	if (!(sbi->s_features & UX_FEATURE_RFREE)) {
+		memset(sbi->s_rfree, 0, sizeof(sbi->s_rfree));
+		for (r = 0; r < sbi->s_nblocks; r++)
+			if (usb->s_block[r] == UX_BLOCK_FREE)
+				sbi->s_rfree[r / UX_REGION_BLOCKS]++;
+	} else {
+		for (r = 0; r < UX_NREGIONS; r++)
+			sbi->s_rfree[r] = usb->s_rfree[r];
+	}
+	if (sbi->s_features & UX_FEATURE_IMMUTABLE) {
+		if (!(s->s_flags & MS_RDONLY)) {
+			printk("uxfs: %s: image is immutable, mount it "
+			       "read-only\n", s->s_id);
+			goto out;
+		}
+		s->s_flags |= MS_NOATIME | MS_NODIRATIME;
+		sbi->s_mount_opt |= UX_MOUNT_PREFETCH;
+	}
+	sbi->s_features |= UX_FEATURE_RFREE;
 
 	s->s_magic = UX_MAGIC;
 	s->s_fs_info = sbi;
 	s->s_op = &uxfs_sops;
+	s->s_xattr = uxfs_xattr_handlers;
+
+	if (sbi->s_orphan && !(s->s_flags & MS_RDONLY))
+		uxfs_recover_orphans(s);
 
 	root = uxfs_iget(s, UX_ROOT_INO);
-	if (!root)
+	if (IS_ERR(root))
 		goto out;
 
 	s->s_root = d_alloc_root(root);
@@ -308,9 +830,9 @@ static int uxfs_fill_super(struct super_block *s, void *data, int silent)
 	return 0;
 
 out:
-	s->s_fs_info = NULL;
 	brelse(bh);
 outnobh:
+	s->s_fs_info = NULL;
 	kfree(sbi);
 	return -EINVAL;
 }
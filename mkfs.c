@@ -1,158 +1,424 @@
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #include <time.h>
 #include <string.h>
 #include "ux_fs.h"
 
-int main(int argc, char **argv)
+/*
+ * The whole filesystem is built in memory first and then written
+ * with two pwrite calls: one for the superblock and the used part
+ * of the inode table, one for the used part of the data area. The
+ * rest of the inode table is zeroed lazily when each inode is first
+ * allocated, so no other block is touched.
+ *
+ * With -d, the tree under a source directory is copied in. Inodes
+ * are numbered breadth first, so the entries of a directory get
+ * consecutive inodes, and blocks are handed out in inode order, so
+ * every file and directory is contiguous and they follow each other
+ * in the order a directory scan visits them.
+ *
+ * With -r the image is marked immutable, for one built with -d to be
+ * shared read-only: the driver then refuses to mount it read-write.
+ */
+
+struct mk_ent {
+	char		name[UX_NAMELEN];
+	__u32		ino;
+};
+
+struct mk_node {
+	char		*path;		/* source, NULL for lost+found */
+	struct stat	st;
+	__u32		parent;
+	__u32		nlink;
+	__u32		nent;
+	struct mk_ent	*ent;		/* directory entries */
+};
+
+static struct mk_node	nodes[UX_NINODES];
+static __u32		next_ino = UX_ROOT_INO;
+static __u32		next_blk;
+static __u32		nblocks;
+static char		*image;
+
+#define BLOCK(n)	(image + (size_t)(n) * UX_BSIZE)
+
+static struct ux_inode *ux_ino(__u32 ino)
 {
-	struct ux_dirent	dir;
-	struct ux_superblock    sb;
-	struct ux_inode		inode;
-	time_t			tm;
-	off_t			nsectors = UX_MAXBLOCKS;
-	int			devfd, error, i;
-	int			map_blks;
-	char			block[UX_BSIZE];
+	return (struct ux_inode *)BLOCK(UX_INODE_BLOCK + ino);
+}
+
+static off_t device_blocks(int devfd)
+{
+	struct stat st;
+	__u64 bytes;
+
+	if (fstat(devfd, &st) < 0)
+		return -1;
+	if (!S_ISBLK(st.st_mode))
+		return st.st_size / UX_BSIZE;
+	if (ioctl(devfd, BLKGETSIZE64, &bytes) < 0)
+		return -1;
+	return bytes / UX_BSIZE;
+}
+
+/*
+ * Tell the device that none of its old contents matter. Nothing relies
+ * on the result, since every block read before it is written is
+ * either written here or zeroed on first use.
+ */
+static void discard(int devfd, off_t len)
+{
+	struct stat st;
+	__u64 range[2] = { 0, len };
 
-	if (argc != 2) {
-		fprintf(stderr, "uxmkfs: Need to specify device\n");
+	if (fstat(devfd, &st) < 0)
+		return;
+	if (S_ISBLK(st.st_mode))
+		ioctl(devfd, BLKDISCARD, range);
+	else
+		fallocate(devfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  0, len);
+}
+
+static __u32 new_node(char *path, struct stat *st, __u32 parent)
+{
+	struct mk_node *np;
+
+	if (next_ino == UX_NINODES) {
+		fprintf(stderr, "uxmkfs: Too many files, at most %d fit\n",
+			UX_NINODES - UX_ROOT_INO - 2);
 		exit(1);
 	}
-	devfd = open(argv[1], O_WRONLY);
-	if (devfd < 0) {
-		fprintf(stderr, "uxmkfs: Failed to open device\n");
+	np = &nodes[next_ino];
+	np->path = path;
+	np->st = *st;
+	np->parent = parent;
+	np->nlink = S_ISDIR(st->st_mode) ? 2 : 1;
+	return next_ino++;
+}
+
+static void add_entry(__u32 dir, const char *name, __u32 ino)
+{
+	struct mk_node *np = &nodes[dir];
+
+	np->ent = realloc(np->ent, (np->nent + 1) * sizeof(struct mk_ent));
+	if (!np->ent) {
+		fprintf(stderr, "uxmkfs: Out of memory\n");
 		exit(1);
 	}
-	error = lseek(devfd, (off_t)(nsectors * UX_BSIZE), SEEK_SET);
-	if (error == -1) {
-		fprintf(stderr, "uxmkfs: Cannot create filesystem"
-			" of specified size\n");
+	memset(&np->ent[np->nent], 0, sizeof(struct mk_ent));
+	memcpy(np->ent[np->nent].name, name, strlen(name));
+	np->ent[np->nent++].ino = ino;
+}
+
+static int by_name(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * Give every entry of a source directory an inode, in name order.
+ * Hard links within the tree share one inode.
+ */
+static void scan_dir(__u32 dir)
+{
+	struct dirent **names;
+	struct stat st;
+	char *path;
+	__u32 ino;
+	int i, n;
+
+	n = scandir(nodes[dir].path, &names, NULL, by_name);
+	if (n < 0) {
+		perror(nodes[dir].path);
 		exit(1);
 	}
-	lseek(devfd, 0, SEEK_SET);
+	for (i = 0; i < n; i++) {
+		const char *name = names[i]->d_name;
 
-	/*
-	 * Fill in the fields of the superblock and write
-	 * it out to the first block of the device.
-	 */
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+		if (dir == UX_ROOT_INO && !strcmp(name, "lost+found"))
+			continue;
+		if (strlen(name) > UX_NAMELEN) {
+			fprintf(stderr, "uxmkfs: %s/%s: name too long\n",
+				nodes[dir].path, name);
+			exit(1);
+		}
+		if (asprintf(&path, "%s/%s", nodes[dir].path, name) < 0 ||
+		    lstat(path, &st) < 0) {
+			perror(name);
+			exit(1);
+		}
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "uxmkfs: %s: not a file or "
+				"directory, skipped\n", path);
+			free(path);
+			continue;
+		}
+		if (S_ISREG(st.st_mode) &&
+		    st.st_size > UX_DIRECT_BLOCKS * UX_BSIZE) {
+			fprintf(stderr, "uxmkfs: %s: larger than %d bytes\n",
+				path, UX_DIRECT_BLOCKS * UX_BSIZE);
+			exit(1);
+		}
+		for (ino = UX_ROOT_INO + 2; ino < next_ino; ino++) {
+			if (S_ISREG(st.st_mode) && st.st_nlink > 1 &&
+			    nodes[ino].st.st_dev == st.st_dev &&
+			    nodes[ino].st.st_ino == st.st_ino)
+				break;
+		}
+		if (ino < next_ino) {
+			nodes[ino].nlink++;
+			free(path);
+		} else {
+			ino = new_node(path, &st, dir);
+			if (S_ISDIR(st.st_mode))
+				nodes[dir].nlink++;
+		}
+		add_entry(dir, name, ino);
+	}
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+}
 
-	sb.s_magic = UX_MAGIC;
-	sb.s_mod = UX_FSCLEAN;
-	sb.s_nifree = UX_MAXFILES - 4;
-	sb.s_nbfree = UX_MAXBLOCKS - 2;
+static __u32 alloc_blocks(__u32 size)
+{
+	__u32 first = next_blk;
 
-	/*
-	 * First 4 inodes are in use. Inodes 0 and 1 are not
-	 * used by anything, 2 is the root directory and 3 is
-	 * lost+found.
-	 */
+	next_blk += (size + UX_BSIZE - 1) / UX_BSIZE;
+	if (next_blk > nblocks) {
+		fprintf(stderr, "uxmkfs: Not enough space, need more than "
+			"%u blocks\n", nblocks);
+		exit(1);
+	}
+	return first;
+}
 
-	sb.s_inode[0]  = UX_INODE_INUSE;
-	sb.s_inode[1]  = UX_INODE_INUSE;
-	sb.s_inode[2]  = UX_INODE_INUSE;
-	sb.s_inode[3]  = UX_INODE_INUSE;
+static void make_inode(__u32 ino)
+{
+	struct mk_node *np = &nodes[ino];
+	struct ux_inode *inode = ux_ino(ino);
+	struct ux_dirent *dir;
+	__u32 i, blk, size;
+	int fd;
 
-	/*
-	 * The rest of the inodes are marked unused
-	 */
+	inode->i_mode = np->st.st_mode;
+	inode->i_nlink = np->nlink;
+	inode->i_atime = np->st.st_atim.tv_sec;
+	inode->i_mtime = np->st.st_mtim.tv_sec;
+	inode->i_ctime = np->st.st_ctim.tv_sec;
+	inode->i_atime_ns = np->st.st_atim.tv_nsec;
+	inode->i_mtime_ns = np->st.st_mtim.tv_nsec;
+	inode->i_ctime_ns = np->st.st_ctim.tv_nsec;
+	inode->i_uid = np->st.st_uid;
+	inode->i_gid = np->st.st_gid;
 
-	for (i = 4 ; i < UX_MAXFILES ; i++)
-		sb.s_inode[i] = UX_INODE_FREE;
+	if (S_ISDIR(np->st.st_mode)) {
+		size = (np->nent + 2) * sizeof(struct ux_dirent);
+		if (size > UX_DIRECT_BLOCKS * UX_BSIZE) {
+			fprintf(stderr, "uxmkfs: %s: too many entries\n",
+				np->path);
+			exit(1);
+		}
+		blk = alloc_blocks(size);
+		dir = (struct ux_dirent *)BLOCK(UX_FIRST_DATA_BLOCK + blk);
+		dir[0].d_ino = ino;
+		strcpy(dir[0].d_name, ".");
+		dir[1].d_ino = np->parent;
+		strcpy(dir[1].d_name, "..");
+		for (i = 0; i < np->nent; i++) {
+			dir[i + 2].d_ino = np->ent[i].ino;
+			memcpy(dir[i + 2].d_name, np->ent[i].name, UX_NAMELEN);
+		}
+		inode->i_blocks = (size + UX_BSIZE - 1) / UX_BSIZE;
+	} else {
+		size = np->st.st_size;
+		blk = alloc_blocks(size);
+		fd = open(np->path, O_RDONLY);
+		if (fd < 0 || read(fd, BLOCK(UX_FIRST_DATA_BLOCK + blk),
+				   size) != size) {
+			perror(np->path);
+			exit(1);
+		}
+		close(fd);
+		inode->i_blocks = (size + UX_BSIZE - 1) / UX_BSIZE *
+				  (UX_BSIZE / 512);
+	}
+	inode->i_size = size;
+	for (i = 0; i * UX_BSIZE < size; i++)
+		inode->i_addr[i] = UX_FIRST_DATA_BLOCK + blk + i;
+}
+
+int main(int argc, char **argv)
+{
+	struct ux_superblock	*sb;
+	struct stat		st;
+	time_t			tm;
+	off_t			nsectors;
+	char			*srcdir = NULL;
+	int			devfd, i, c;
+	int			nodiscard = 0, immutable = 0;
+
+	while ((c = getopt(argc, argv, "Kd:r")) != -1) {
+		switch (c) {
+		case 'K':
+			nodiscard = 1;
+			break;
+		case 'd':
+			srcdir = optarg;
+			break;
+		case 'r':
+			immutable = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 && optind != argc - 2)
+		goto usage;
+	/* The source becomes the root, so it has to be a directory. */
+	if (srcdir && stat(srcdir, &st) < 0) {
+		perror(srcdir);
+		exit(1);
+	}
+	if (srcdir && !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "uxmkfs: %s: Not a directory\n", srcdir);
+		exit(1);
+	}
+	devfd = open(argv[optind], O_RDWR | (optind == argc - 2 ? O_CREAT : 0),
+		     0644);
+	if (devfd < 0) {
+		fprintf(stderr, "uxmkfs: Failed to open device\n");
+		exit(1);
+	}
 
 	/*
-	 * The first two blocks are allocated for the entries
-	 * for the root and lost+found directories.
+	 * Size the filesystem from the device unless told otherwise. A
+	 * regular file is extended to the requested size.
 	 */
+	nsectors = device_blocks(devfd);
+	if (nsectors < 0) {
+		fprintf(stderr, "uxmkfs: Cannot determine device size\n");
+		exit(1);
+	}
+	if (optind == argc - 2) {
+		off_t want = atol(argv[optind + 1]);
 
-	sb.s_block[0] = UX_BLOCK_INUSE;
-	sb.s_block[1] = UX_BLOCK_INUSE;
+		if (want > nsectors && ftruncate(devfd, want * UX_BSIZE) < 0) {
+			fprintf(stderr, "uxmkfs: Cannot create filesystem"
+				" of specified size\n");
+			exit(1);
+		}
+		nsectors = want;
+	}
+	if (nsectors < UX_FIRST_DATA_BLOCK + 2) {
+		fprintf(stderr, "uxmkfs: Device too small, need at least"
+			" %d blocks\n", UX_FIRST_DATA_BLOCK + 2);
+		exit(1);
+	}
+	nblocks = nsectors - UX_FIRST_DATA_BLOCK;
+	if (nblocks > UX_MAXBLOCKS)
+		nblocks = UX_MAXBLOCKS;
+	image = calloc(UX_FIRST_DATA_BLOCK + nblocks, UX_BSIZE);
+	if (!image) {
+		fprintf(stderr, "uxmkfs: Out of memory\n");
+		exit(1);
+	}
 
 	/*
-	 * The rest of the blocks are marked unused
+	 * Inode 2 is the root directory and 3 is lost+found. The
+	 * source tree, if any, follows.
 	 */
 
-	for (i = 2 ; i < UX_MAXBLOCKS ; i++)
-		sb.s_block[i] = UX_BLOCK_FREE;
-
-	write(devfd, (char *)&sb, sizeof(struct ux_superblock));
+	time(&tm);
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFDIR | 0755;
+	st.st_atime = st.st_mtime = st.st_ctime = tm;
+	if (srcdir && stat(srcdir, &st) < 0) {
+		perror(srcdir);
+		exit(1);
+	}
+	new_node(srcdir, &st, UX_ROOT_INO);
+	st.st_mode = S_IFDIR | 0755;
+	st.st_uid = st.st_gid = 0;
+	new_node(NULL, &st, UX_ROOT_INO);
+	add_entry(UX_ROOT_INO, "lost+found", UX_ROOT_INO + 1);
+	nodes[UX_ROOT_INO].nlink++;
+	for (i = UX_ROOT_INO; srcdir && i < next_ino; i++) {
+		if (S_ISDIR(nodes[i].st.st_mode) && nodes[i].path)
+			scan_dir(i);
+	}
+	for (i = UX_ROOT_INO; i < next_ino; i++)
+		make_inode(i);
 
 	/*
-	 * The root directory and lost+found directory inodes
-	 * must be initialized.
+	 * Fill in the fields of the superblock.
 	 */
 
-	time(&tm);
-	memset((void *)&inode, 0, sizeof(struct ux_inode));
-	inode.i_mode = S_IFDIR | 0755;
-	inode.i_nlink = 3;	/* ".", ".." and "lost+found" */
-	inode.i_atime = tm;
-	inode.i_mtime = tm;
-	inode.i_ctime = tm;
-	inode.i_uid = 0;
-	inode.i_gid = 0;
-	inode.i_size = 3 * sizeof(struct ux_dirent);
-	inode.i_blocks = 1;
-	inode.i_addr[0] = UX_FIRST_DATA_BLOCK;
-
-	lseek(devfd, (UX_INODE_BLOCK + UX_ROOT_INO)* UX_BSIZE, SEEK_SET);
-	write(devfd, (char *)&inode, sizeof(struct ux_inode));
-
-	memset((void *)&inode, 0 , sizeof(struct ux_inode));
-	inode.i_mode = S_IFDIR | 0755;
-	inode.i_nlink = 2;	/* "." and ".." */
-	inode.i_atime = tm;
-	inode.i_mtime = tm;
-	inode.i_ctime = tm;
-	inode.i_uid = 0;
-	inode.i_gid = 0;
-	inode.i_size = 2 * sizeof(struct ux_dirent);
-	inode.i_blocks = 1;
-	inode.i_addr[0] = UX_FIRST_DATA_BLOCK + 1;
-
-	lseek(devfd, (UX_INODE_BLOCK + UX_ROOT_INO + 1)* UX_BSIZE, SEEK_SET);
-	write(devfd, (char *)&inode, sizeof(struct ux_inode));
+	sb = (struct ux_superblock *)image;
+	sb->s_magic = UX_MAGIC;
+	sb->s_mod = UX_FSCLEAN;
+	sb->s_nifree = UX_NINODES - next_ino;
+	sb->s_nbfree = nblocks - next_blk;
+	sb->s_nblocks = nblocks;
+	sb->s_features = immutable ? UX_FEATURE_IMMUTABLE : 0;
 
 	/*
-	 * Fill in the directory entries for root 
+	 * Inodes 0 and 1 are not used by anything. Those past the
+	 * ones built here are free, except the ones whose table
+	 * block would overlap the data area.
 	 */
 
-	lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE, SEEK_SET);
-	memset((void *)&block, 0, UX_BSIZE);
-	write(devfd, block, UX_BSIZE);
-	lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE, SEEK_SET);
-	memset(&dir, 0, sizeof(struct ux_dirent));
-	dir.d_ino = 2;
-	strcpy(dir.d_name, ".");
-	write(devfd, (char *)&dir, sizeof(struct ux_dirent));
-	dir.d_ino = 2;
-	strcpy(dir.d_name, "..");
-	write(devfd, (char *)&dir, sizeof(struct ux_dirent));
-	dir.d_ino = 3;
-	strcpy(dir.d_name, "lost+found");
-	write(devfd, (char *)&dir, sizeof(struct ux_dirent));
+	for (i = 0 ; i < UX_MAXFILES ; i++) {
+		if (i < next_ino || i >= UX_NINODES)
+			sb->s_inode[i] = UX_INODE_INUSE;
+		else
+			sb->s_inode[i] = UX_INODE_FREE;
+		if (i < next_ino)
+			sb->s_inoinit |= 1U << i;
+	}
 
 	/*
-	 * Fill in the directory entries for lost+found 
+	 * Blocks past the end of the device are never free.
 	 */
 
-	lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE + UX_BSIZE,
-	      SEEK_SET);
-	memset((void *)&block, 0, UX_BSIZE);
-	write(devfd, block, UX_BSIZE);
-	lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE + UX_BSIZE, 
-	      SEEK_SET);
-	memset(&dir, 0, sizeof(struct ux_dirent));
-	dir.d_ino = 2;
-	strcpy(dir.d_name, ".");
-	write(devfd, (char *)&dir, sizeof(struct ux_dirent));
-	dir.d_ino = 2;
-	strcpy(dir.d_name, "..");
-	write(devfd, (char *)&dir, sizeof(struct ux_dirent));
+	for (i = 0 ; i < UX_MAXBLOCKS ; i++)
+		sb->s_block[i] = (i < next_blk || i >= nblocks) ?
+				 UX_BLOCK_INUSE : UX_BLOCK_FREE;
+	ux_count_regions(sb);
+
+	if (!nodiscard)
+		discard(devfd, (off_t)(UX_FIRST_DATA_BLOCK + nblocks) * UX_BSIZE);
+	if (pwrite(devfd, image, (UX_INODE_BLOCK + next_ino) * UX_BSIZE, 0) !=
+	    (UX_INODE_BLOCK + next_ino) * UX_BSIZE)
+		goto ioerr;
+	if (pwrite(devfd, BLOCK(UX_FIRST_DATA_BLOCK), next_blk * UX_BSIZE,
+		   (off_t)UX_FIRST_DATA_BLOCK * UX_BSIZE) != next_blk * UX_BSIZE)
+		goto ioerr;
+	if (fsync(devfd) < 0)
+		goto ioerr;
 	close(devfd);
 
+	printf("uxmkfs: %u/%u data blocks, %u/%d inodes used\n", next_blk,
+	       nblocks, next_ino - UX_ROOT_INO, UX_NINODES - UX_ROOT_INO);
 	return 0;
+
+ioerr:
+	fprintf(stderr, "uxmkfs: Write error\n");
+	exit(1);
+usage:
+	fprintf(stderr, "usage: uxmkfs [-Kr] [-d dir] device [blocks]\n");
+	exit(1);
 }
@@ -1,38 +1,62 @@
 #include <linux/buffer_head.h>
+#include <linux/xattr.h>
 #include "uxfs.h"
 
 struct inode * uxfs_new_inode(struct super_block *sb, int *error)
 {
 	struct ux_sb_info *sbi = uxfs_sb(sb);
 	struct inode *inode = new_inode(sb);
-	int i;
+	int i, init = 0;
 
 	if (!inode) {
 		*error = -ENOMEM;
 		return NULL;
 	}
 
-	if (sbi->s_nifree == 0) {
+	spin_lock(&sbi->s_alloc_lock);
+	i = UX_NINODES;
+	if (sbi->s_nifree) {
+		for (i = 3; i < UX_NINODES; i++) {
+			if (sbi->s_inode[i] == UX_INODE_FREE) {
+				sbi->s_inode[i] = UX_INODE_INUSE;
+				sbi->s_nifree--;
+				init = sbi->s_inoinit & (1U << i);
+				sbi->s_inoinit |= 1U << i;
+				sb->s_dirt = 1;
+				break;
+			}
+		}
+	}
+	spin_unlock(&sbi->s_alloc_lock);
+	if (i == UX_NINODES) {
 		printk("uxfs: Out of inodes\n");
 		iput(inode);
 		*error = -ENOSPC;
 		return NULL;
 	}
 
-	for (i = 3; i < UX_MAXFILES; i++) {
-		if (sbi->s_inode[i] == UX_INODE_FREE) {
-			sbi->s_inode[i] = UX_INODE_INUSE;
-			sbi->s_nifree--;
-			sb->s_dirt = 1;
-			break;
-		}
+	/*
+	 * uxmkfs leaves the inode table uninitialised, so zero
+	 * this inode's block the first time it is handed out.
+	 */
+	if (!init) {
+		struct buffer_head *bh = sb_getblk(sb, UX_INODE_BLOCK + i);
+
+		lock_buffer(bh);
+		memset(bh->b_data, 0, UX_BSIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
 	}
 	inode->i_uid = current->fsuid;
 	inode->i_gid = current->fsgid;
 	inode->i_ino = i;
-	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
+	inode->i_mtime = inode->i_atime = inode->i_ctime = current_fs_time(sb);
 	inode->i_blocks = 0;
-	memset(uxfs_i(inode)->i_data, 0, UX_DIRECT_BLOCKS);
+	memset(uxfs_i(inode)->i_data, 0, sizeof(uxfs_i(inode)->i_data));
+	uxfs_i(inode)->i_flags = 0;
+	uxfs_i(inode)->i_cmap = 0;
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
 
@@ -40,78 +64,361 @@ struct inode * uxfs_new_inode(struct super_block *sb, int *error)
 	return inode;
 }
 
+/*
+ * First fit, passing over the regions with no free blocks.
+ */
 int uxfs_new_block(struct super_block *sb, int *error)
 {
 	struct ux_sb_info *sbi = uxfs_sb(sb);
-	int i;
-
-	if (sbi->s_nbfree == 0)
-		goto nospace;
-
-	for (i = 0; i < UX_MAXBLOCKS; i++) {
-		if (sbi->s_block[i] == UX_BLOCK_FREE) {
-			sbi->s_inode[i] = UX_BLOCK_INUSE;
+	int i, r, end;
+
+	spin_lock(&sbi->s_alloc_lock);
+	for (r = 0; sbi->s_nbfree && r < UX_NREGIONS; r++) {
+		if (!sbi->s_rfree[r])
+			continue;
+		end = min_t(int, (r + 1) * UX_REGION_BLOCKS, sbi->s_nblocks);
+		for (i = r * UX_REGION_BLOCKS; i < end; i++) {
+			if (sbi->s_block[i] != UX_BLOCK_FREE)
+				continue;
+			sbi->s_block[i] = UX_BLOCK_INUSE;
 			sbi->s_nbfree--;
+			sbi->s_rfree[r]--;
 			sb->s_dirt = 1;
+			spin_unlock(&sbi->s_alloc_lock);
 			*error = 0;
 			return i + UX_FIRST_DATA_BLOCK;
 		}
 	}
+	spin_unlock(&sbi->s_alloc_lock);
 
-nospace:
 	printk("uxfs: Out of blocks\n");
 	*error = -ENOSPC;
 	return 0;
 }
 
-int uxfs_add_link(struct dentry *dentry, struct inode *inode)
+/*
+ * Allocate n contiguous blocks, first fit, for the defragmenter.
+ */
+int uxfs_new_run(struct super_block *sb, int n, int *error)
+{
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	int i, run = 0;
+
+	spin_lock(&sbi->s_alloc_lock);
+	for (i = 0; i < sbi->s_nblocks && sbi->s_nbfree >= n; i++) {
+		/* A run can't cross a full region. */
+		if (i % UX_REGION_BLOCKS == 0 &&
+		    !sbi->s_rfree[i / UX_REGION_BLOCKS]) {
+			i += UX_REGION_BLOCKS - 1;
+			run = 0;
+			continue;
+		}
+		run = sbi->s_block[i] == UX_BLOCK_FREE ? run + 1 : 0;
+		if (run < n)
+			continue;
+		for (i -= n - 1; run; run--) {
+			sbi->s_block[i + run - 1] = UX_BLOCK_INUSE;
+			sbi->s_rfree[(i + run - 1) / UX_REGION_BLOCKS]--;
+		}
+		sbi->s_nbfree -= n;
+		sb->s_dirt = 1;
+		spin_unlock(&sbi->s_alloc_lock);
+		*error = 0;
+		return i + UX_FIRST_DATA_BLOCK;
+	}
+	spin_unlock(&sbi->s_alloc_lock);
+	*error = -ENOSPC;
+	return 0;
+}
+
+/*
+ * Drop a reference to a data block, freeing it with the last one.
+ */
+void uxfs_free_block(struct super_block *sb, __u32 blk)
+{
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	__u8 *ref = &sbi->s_block[blk - UX_FIRST_DATA_BLOCK];
+
+	spin_lock(&sbi->s_alloc_lock);
+	sb->s_dirt = 1;
+	if (*ref > UX_BLOCK_INUSE) {
+		(*ref)--;
+		spin_unlock(&sbi->s_alloc_lock);
+		return;
+	}
+	*ref = UX_BLOCK_FREE;
+	sbi->s_nbfree++;
+	sbi->s_rfree[(blk - UX_FIRST_DATA_BLOCK) / UX_REGION_BLOCKS]++;
+	spin_unlock(&sbi->s_alloc_lock);
+	/* Drop any cached metadata copy so it can't be written back. */
+	bforget(sb_find_get_block(sb, blk));
+}
+
+/*
+ * Take another reference to a data block for a clone.
+ */
+int uxfs_ref_block(struct super_block *sb, __u32 blk)
+{
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	__u8 *ref = &sbi->s_block[blk - UX_FIRST_DATA_BLOCK];
+	int err = 0;
+
+	spin_lock(&sbi->s_alloc_lock);
+	if (*ref >= UX_BLOCK_MAXREF)
+		err = -EMLINK;
+	else
+		(*ref)++;
+	spin_unlock(&sbi->s_alloc_lock);
+	sb->s_dirt = 1;
+	return err;
+}
+
+/*
+ * The orphan bits live in the superblock next to the allocation maps.
+ * A truncate clears its bit only once the shorter inode is on disk
+ * (see uxfs_truncate). The bits are shared by every directory, so
+ * they change under s_alloc_lock.
+ */
+void uxfs_orphan_add(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+
+	spin_lock(&sbi->s_alloc_lock);
+	sbi->s_orphan |= 1U << inode->i_ino;
+	spin_unlock(&sbi->s_alloc_lock);
+	sb->s_dirt = 1;
+}
+
+void uxfs_orphan_del(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+
+	spin_lock(&sbi->s_alloc_lock);
+	if (sbi->s_orphan & (1U << inode->i_ino)) {
+		sbi->s_orphan &= ~(1U << inode->i_ino);
+		sb->s_dirt = 1;
+	}
+	spin_unlock(&sbi->s_alloc_lock);
+}
+
+/*
+ * Compare a name against a directory entry. Names fill the whole of
+ * d_name when they are UX_NAMELEN long, otherwise they are NUL padded.
+ */
+static inline int uxfs_match(const char *name, struct ux_dirent *de)
+{
+	int len = strlen(name);
+
+	if (!de->d_ino || len > UX_NAMELEN)
+		return 0;
+	if (len < UX_NAMELEN && de->d_name[len])
+		return 0;
+	return memcmp(name, de->d_name, len) == 0;
+}
+
+/*
+ * Build the free-slot map and live-entry count of a directory. This
+ * reads every directory block once; afterwards add_link, delete_entry
+ * and empty_dir keep the state current without further scans.
+ */
+static int uxfs_dir_load(struct inode *dir)
 {
-	struct inode *dir = dentry->d_parent->d_inode;
 	struct ux_inode_info *ux_inode = uxfs_i(dir);
-	const char * name = dentry->d_name.name;
-	struct super_block * sb = dir->i_sb;
-	struct ux_dirent * de;
 	struct buffer_head *bh;
-        __u32 blk = 0;
-	int error;
+	struct ux_dirent *de;
 	int i, j;
 
+	if (ux_inode->i_dvalid)
+		return 0;
+
+	ux_inode->i_dlive = 0;
 	for (i = 0; i < dir->i_blocks; i++) {
-		bh = sb_bread(dir->i_sb, ux_inode->i_data[i]);	
+		bh = sb_bread(dir->i_sb, ux_inode->i_data[i]);
 		if (!bh) {
 			printk("uxfs: unable to read dir block\n");
 			return -EIO;
 		}
 
+		ux_inode->i_dfree[i] = 0;
 		de = (struct ux_dirent *)bh->b_data;
 		for (j = 0; j < UX_DIR_PER_BLK; j++, de++) {
-			if (de->d_ino == 0)
-				goto found_empty_dentry;	
+			if (de->d_ino)
+				ux_inode->i_dlive++;
+			else
+				ux_inode->i_dfree[i] |= 1U << j;
 		}
 		brelse(bh);
 	}
+	ux_inode->i_dvalid = 1;
+	return 0;
+}
+
+/*
+ * Shrink a directory to end at its last live slot and free the blocks
+ * past it. The state must be loaded. Only empty slots at the tail go
+ * away, so the offsets of the remaining entries, which readdir hands
+ * out as positions, are unchanged.
+ */
+static void uxfs_dir_trim(struct inode *dir)
+{
+	struct ux_inode_info *ux_inode = uxfs_i(dir);
+	int i, last = 0;
+
+	for (i = dir->i_blocks - 1; i >= 0; i--) {
+		if (~ux_inode->i_dfree[i]) {
+			last = i * UX_DIR_PER_BLK + fls(~ux_inode->i_dfree[i]);
+			break;
+		}
+	}
+	while (dir->i_blocks > 1 &&
+	       (dir->i_blocks - 1) * UX_DIR_PER_BLK >= last) {
+		dir->i_blocks--;
+		uxfs_free_block(dir->i_sb, ux_inode->i_data[dir->i_blocks]);
+		ux_inode->i_data[dir->i_blocks] = 0;
+	}
+	if (last * sizeof(struct ux_dirent) < dir->i_size)
+		dir->i_size = last * sizeof(struct ux_dirent);
+}
+
+/*
+ * Repack the live entries of a directory into its leading slots, in
+ * their current order, then trim it. Unlike trimming this moves
+ * entries, so a readdir running at the same time may miss or repeat
+ * some; it is only done on request (UX_IOC_COMPACT). Called with
+ * i_mutex held.
+ */
+int uxfs_dir_compact(struct inode *dir)
+{
+	struct ux_inode_info *ux_inode = uxfs_i(dir);
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *sbh, *dbh = NULL;
+	struct ux_dirent *de;
+	int i, j, err, db = -1;
+	__u32 slot = 0;
+
+	err = uxfs_dir_load(dir);
+	if (err)
+		return err;
+
+	for (i = 0; i < dir->i_blocks; i++) {
+		if (ux_inode->i_dfree[i] == ~0U)
+			continue;
+		sbh = sb_bread(sb, ux_inode->i_data[i]);
+		if (!sbh) {
+			err = -EIO;
+			break;
+		}
+		de = (struct ux_dirent *)sbh->b_data;
+		for (j = 0; j < UX_DIR_PER_BLK; j++, de++) {
+			if (!de->d_ino)
+				continue;
+			if (slot == i * UX_DIR_PER_BLK + j) {
+				slot++;
+				continue;
+			}
+			if (db != slot / UX_DIR_PER_BLK) {
+				if (dbh) {
+					mark_buffer_dirty(dbh);
+					brelse(dbh);
+				}
+				db = slot / UX_DIR_PER_BLK;
+				dbh = sb_bread(sb, ux_inode->i_data[db]);
+				if (!dbh) {
+					brelse(sbh);
+					err = -EIO;
+					goto out;
+				}
+			}
+			memcpy((struct ux_dirent *)dbh->b_data +
+			       slot % UX_DIR_PER_BLK, de, sizeof(*de));
+			memset(de, 0, sizeof(*de));
+			ux_inode->i_dfree[db] &= ~(1U << (slot % UX_DIR_PER_BLK));
+			ux_inode->i_dfree[i] |= 1U << j;
+			mark_buffer_dirty(sbh);
+			slot++;
+		}
+		brelse(sbh);
+	}
+out:
+	if (dbh) {
+		mark_buffer_dirty(dbh);
+		brelse(dbh);
+	}
+	uxfs_dir_trim(dir);
+	dir->i_mtime = dir->i_ctime = current_fs_time(dir->i_sb);
+	mark_inode_dirty(dir);
+	return err;
+}
+
+int uxfs_add_link(struct dentry *dentry, struct inode *inode)
+{
+	struct inode *dir = dentry->d_parent->d_inode;
+	struct ux_inode_info *ux_inode = uxfs_i(dir);
+	struct super_block * sb = dir->i_sb;
+	struct ux_dirent * de;
+	struct buffer_head *bh;
+	__u32 blk = 0;
+	loff_t end;
+	int error;
+	int i, j;
+
+	error = uxfs_dir_load(dir);
+	if (error)
+		return error;
 
 	/*
-	 * We didn't find an empty slot so need to allocate 
-	 * a new block if there's space in the inode.
+	 * Take the lowest free slot, so the directory stays packed
+	 * towards the front and i_size only grows when it is full.
 	 */
-	if (dir->i_blocks < UX_DIRECT_BLOCKS) {
+	for (i = 0; i < dir->i_blocks; i++) {
+		if (ux_inode->i_dfree[i])
+			break;
+	}
+
+	if (i < dir->i_blocks) {
+		j = ffs(ux_inode->i_dfree[i]) - 1;
+		bh = sb_bread(sb, ux_inode->i_data[i]);
+		if (!bh) {
+			printk("uxfs: unable to read dir block\n");
+			return -EIO;
+		}
+	} else {
+		/*
+		 * No empty slot so we need to allocate a new
+		 * block if there's space in the inode.
+		 */
+		if (dir->i_blocks >= UX_DIRECT_BLOCKS)
+			return -ENOSPC;
 		blk = uxfs_new_block(sb, &error);
-		dir->i_blocks++;
-		ux_inode->i_data[dir->i_blocks] = blk;
-		bh = sb_bread(sb, blk);
+		if (error)
+			return error;
+		bh = sb_getblk(sb, blk);
+		lock_buffer(bh);
 		memset(bh->b_data, 0, UX_BSIZE);
-		de = (struct ux_dirent *)bh->b_data;
-		goto found_empty_dentry;
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		ux_inode->i_data[i] = blk;
+		ux_inode->i_dfree[i] = ~0U;
+		dir->i_blocks++;
+		j = 0;
 	}
 
-found_empty_dentry:
+	de = (struct ux_dirent *)bh->b_data + j;
 	de->d_ino = inode->i_ino;
-	strcpy(de->d_name, name);
+	memset(de->d_name, 0, UX_NAMELEN);
+	memcpy(de->d_name, dentry->d_name.name, dentry->d_name.len);
 	mark_buffer_dirty(bh);
-	dir->i_size += sizeof(struct ux_dirent);
-	mark_inode_dirty(dir);
 	brelse(bh);
+
+	ux_inode->i_dfree[i] &= ~(1U << j);
+	ux_inode->i_dlive++;
+	end = (loff_t)(i * UX_DIR_PER_BLK + j + 1) * sizeof(struct ux_dirent);
+	if (end > dir->i_size)
+		dir->i_size = end;
+	dir->i_mtime = dir->i_ctime = current_fs_time(dir->i_sb);
+	mark_inode_dirty(dir);
 	return 0;
 }
 
@@ -127,68 +434,93 @@ static int uxfs_diradd(struct dentry *dentry, struct inode *inode)
 	return err;
 }
 
-int uxfs_find_entry(struct inode *dir, char *name)
+/*
+ * Find the entry for name in dir. On success the entry is returned
+ * along with its buffer, which the caller must release, and its slot.
+ */
+static struct ux_dirent *uxfs_find_dirent(struct inode *dir, const char *name,
+					  struct buffer_head **bhp, int *slotp)
 {
 	struct ux_inode_info *ux_inode = uxfs_i(dir);
 	struct buffer_head *bh;
 	struct ux_dirent *de;
 	off_t offset = 0;
-	__u32 ino = 0;
 	int i, j;
 
 	for (i = 0, offset = 0; i < dir->i_blocks; i++) {
 		bh = sb_bread(dir->i_sb, ux_inode->i_data[i]);	
 		if (!bh) {
 			printk("uxfs: unable to read dir block\n");
-			goto out;
+			return NULL;
 		}
 
 		de = (struct ux_dirent *)bh->b_data;
 		for (j = 0; j < UX_DIR_PER_BLK && offset < dir->i_size;
-				j++, de++) {
-			if (strncmp(name, de->d_name, strlen(name)) == 0) {
-				ino = de->d_ino;
-			    	brelse(bh);
-				goto out;
+				j++, de++, offset += sizeof(struct ux_dirent)) {
+			if (uxfs_match(name, de)) {
+				*bhp = bh;
+				*slotp = i * UX_DIR_PER_BLK + j;
+				return de;
 			}
 		}
 		brelse(bh);
 	}
-out:
+	return NULL;
+}
+
+/*
+ * Clear an entry found by uxfs_find_dirent() and release its buffer.
+ */
+static void uxfs_delete_dirent(struct inode *dir, struct buffer_head *bh,
+			       struct ux_dirent *de, int slot)
+{
+	struct ux_inode_info *ux_inode = uxfs_i(dir);
+
+	de->d_ino = 0;
+	memset(de->d_name, 0, UX_NAMELEN);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	if (ux_inode->i_dvalid) {
+		ux_inode->i_dfree[slot / UX_DIR_PER_BLK] |=
+			1U << (slot % UX_DIR_PER_BLK);
+		ux_inode->i_dlive--;
+		if ((slot + 1) * sizeof(struct ux_dirent) >= dir->i_size)
+			uxfs_dir_trim(dir);
+	}
+	dir->i_mtime = dir->i_ctime = current_fs_time(dir->i_sb);
+	mark_inode_dirty(dir);
+}
+
+int uxfs_find_entry(struct inode *dir, char *name)
+{
+	struct buffer_head *bh;
+	struct ux_dirent *de;
+	__u32 ino;
+	int slot;
+
+	de = uxfs_find_dirent(dir, name, &bh, &slot);
+	if (!de)
+		return 0;
+	ino = de->d_ino;
+	brelse(bh);
 	return ino;
 }
 
 int uxfs_delete_entry(struct inode *dir, char *name)
 {
-	struct ux_inode_info *ux_inode = uxfs_i(dir);
 	struct buffer_head *bh;
 	struct ux_dirent *de;
-	off_t offset = 0;
-	int i, j;
+	int slot, err;
 
-	for (i = 0, offset = 0; i < dir->i_blocks; i++) {
-		bh = sb_bread(dir->i_sb, ux_inode->i_data[i]);	
-		if (!bh) {
-			printk("uxfs: unable to read dir block\n");
-			goto out;
-		}
+	err = uxfs_dir_load(dir);
+	if (err)
+		return err;
 
-		de = (struct ux_dirent *)bh->b_data;
-		for (j = 0; j < UX_DIR_PER_BLK && offset < dir->i_size;
-				j++, de++) {
-			if (strncmp(name, de->d_name, strlen(name)) == 0) {
-				de->d_ino = 0;
-				memset(de->d_name, 0, UX_NAMELEN);
-				mark_inode_dirty(dir);
-				mark_buffer_dirty(bh);
-			    	brelse(bh);
-				return 0;
-			}
-		}
-		brelse(bh);
-	}
-out:
-	return -ENOENT;
+	de = uxfs_find_dirent(dir, name, &bh, &slot);
+	if (!de)
+		return -ENOENT;
+	uxfs_delete_dirent(dir, bh, de, slot);
+	return 0;
 }
 
 static struct dentry *uxfs_lookup(struct inode * dir, struct dentry *dentry,
@@ -203,8 +535,8 @@ static struct dentry *uxfs_lookup(struct inode * dir, struct dentry *dentry,
 	ino = uxfs_find_entry(dir, (char *)dentry->d_name.name);
 	if (ino) {
 		inode = uxfs_iget(dir->i_sb, ino);
-		if (!inode)
-			return ERR_PTR(-EACCES);
+		if (IS_ERR(inode))
+			return ERR_CAST(inode);
 	}
 	d_add(dentry, inode);
 	return NULL;
@@ -230,8 +562,15 @@ static int uxfs_create(struct inode * dir, struct dentry *dentry, int mode,
 	inode = uxfs_new_inode(dir->i_sb, &error);
 	if (inode) {
 		inode->i_mode = mode;
+		uxfs_i(inode)->i_flags = uxfs_i(dir)->i_flags & UX_COMPR_FL;
 		uxfs_set_inode(inode);
 		mark_inode_dirty(inode);
+		error = uxfs_init_security(inode, dir);
+		if (error) {
+			inode_dec_link_count(inode);
+			iput(inode);
+			return error;
+		}
 		error = uxfs_diradd(dentry, inode);
 	}
 	return error;
@@ -248,6 +587,8 @@ static int uxfs_unlink(struct inode * dir, struct dentry *dentry)
 
 	inode->i_ctime = dir->i_ctime;
 	inode_dec_link_count(inode);
+	if (!inode->i_nlink)
+		uxfs_orphan_add(inode);
 end_unlink:
 	return err;
 }
@@ -262,19 +603,26 @@ static int uxfs_make_empty(struct inode *inode, struct inode *dir)
 	blk = uxfs_new_block(inode->i_sb, &err);
 	if (err)
 		return err;
-	bh = sb_bread(inode->i_sb, blk);
+	bh = sb_getblk(inode->i_sb, blk);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, UX_BSIZE);
 	de = (struct ux_dirent *)bh->b_data;
 	de->d_ino = inode->i_ino;
 	strcpy(de->d_name, ".");
 	de++;
 	de->d_ino = dir->i_ino;
 	strcpy(de->d_name, "..");
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
 	mark_buffer_dirty(bh);
 	brelse(bh);
 
 	inode->i_blocks = 1;
 	inode->i_size = sizeof(struct ux_dirent) * 2;
 	ux_inode->i_data[0] = blk;
+	ux_inode->i_dfree[0] = ~3U;
+	ux_inode->i_dlive = 2;
+	ux_inode->i_dvalid = 1;
 	mark_inode_dirty(inode);
 	return 0;
 }
@@ -293,6 +641,7 @@ static int uxfs_mkdir(struct inode * dir, struct dentry *dentry, int mode)
 	inode->i_mode = S_IFDIR | mode;
 	if (dir->i_mode & S_ISGID)
 		inode->i_mode |= S_ISGID;
+	uxfs_i(inode)->i_flags = uxfs_i(dir)->i_flags & UX_COMPR_FL;
 	uxfs_set_inode(inode);
 
 	inode_inc_link_count(inode);
@@ -301,6 +650,10 @@ static int uxfs_mkdir(struct inode * dir, struct dentry *dentry, int mode)
 	if (err)
 		goto out_fail;
 
+	err = uxfs_init_security(inode, dir);
+	if (err)
+		goto out_fail;
+
 	err = uxfs_add_link(dentry, inode);
 	if (err)
 		goto out_fail;
@@ -321,48 +674,15 @@ out_dir:
 }
 
 /*
- * routine to check that the specified directory is empty (for rmdir)
+ * routine to check that the specified directory is empty (for rmdir).
+ * Only "." and ".." may be left, which the live-entry count tells us
+ * without reading the directory.
  */
 int uxfs_empty_dir(struct inode * inode)
 {
-	struct ux_inode_info *ux_inode = uxfs_i(inode);
-	struct super_block *sb = inode->i_sb;
-	struct buffer_head *bh;
-	struct ux_dirent *de;
-	off_t offset = 0;
-	int i, j;
-
-	for (i = 0; i < inode->i_blocks; i++) {
-		bh = sb_bread(sb, ux_inode->i_data[i]);
-		if (!bh) {
-			printk("uxfs: unable to read dir block\n");
-			return 0;
-		}
-
-		de = (struct ux_dirent *)bh->b_data;
-		for (j = 0; j < UX_DIR_PER_BLK && offset < inode->i_size; j++, de++) {
-			if (de->d_ino) {
-				/* check for . and .. */
-				if (de->d_name[0] != '.')
-					goto not_empty;
-				if (!de->d_name[1]) {
-					if (de->d_ino != inode->i_ino)
-						goto not_empty;
-				} else if (de->d_name[1] != '.') {
-					goto not_empty;
-				} else if (de->d_name[2]) {
-					goto not_empty;
-				}
-			}
-			offset += sizeof(struct ux_dirent);
-		}
-		brelse(bh);
-	}
-
-	return 1;
-not_empty:
-	brelse(bh);
-	return 0;
+	if (uxfs_dir_load(inode))
+		return 0;
+	return uxfs_i(inode)->i_dlive <= 2;
 }
 
 static int uxfs_rmdir(struct inode * dir, struct dentry *dentry)
@@ -375,15 +695,126 @@ static int uxfs_rmdir(struct inode * dir, struct dentry *dentry)
 		if (!err) {
 			inode_dec_link_count(dir);
 			inode_dec_link_count(inode);
+			if (!inode->i_nlink)
+				uxfs_orphan_add(inode);
 		}
 	}
 	return err;
 }
 
+static int uxfs_link(struct dentry *old_dentry, struct inode *dir,
+		     struct dentry *dentry)
+{
+	struct inode *inode = old_dentry->d_inode;
+
+	inode->i_ctime = current_fs_time(inode->i_sb);
+	inode_inc_link_count(inode);
+	atomic_inc(&inode->i_count);
+	return uxfs_diradd(dentry, inode);
+}
+
+/*
+ * Renaming within a directory rewrites the name of the existing entry
+ * in its block. Otherwise the new entry is added, or an existing
+ * target's entry is pointed at the inode, before the old entry is
+ * removed. A directory moving to a new parent has its ".." updated.
+ * The VFS holds the locks and has checked for loops.
+ */
+static int uxfs_rename(struct inode *old_dir, struct dentry *old_dentry,
+		       struct inode *new_dir, struct dentry *new_dentry)
+{
+	struct inode *old_inode = old_dentry->d_inode;
+	struct inode *new_inode = new_dentry->d_inode;
+	struct buffer_head *old_bh, *new_bh, *dir_bh = NULL;
+	struct ux_dirent *old_de, *new_de, *dir_de = NULL;
+	int old_slot, new_slot, dir_slot, err;
+
+	err = uxfs_dir_load(old_dir);
+	if (err)
+		return err;
+	old_de = uxfs_find_dirent(old_dir, old_dentry->d_name.name,
+				  &old_bh, &old_slot);
+	if (!old_de)
+		return -ENOENT;
+
+	if (S_ISDIR(old_inode->i_mode)) {
+		err = -EIO;
+		dir_de = uxfs_find_dirent(old_inode, "..", &dir_bh, &dir_slot);
+		if (!dir_de)
+			goto out_old;
+	}
+
+	if (new_inode) {
+		err = -ENOTEMPTY;
+		if (S_ISDIR(old_inode->i_mode) && !uxfs_empty_dir(new_inode))
+			goto out_dir;
+		err = -ENOENT;
+		new_de = uxfs_find_dirent(new_dir, new_dentry->d_name.name,
+					  &new_bh, &new_slot);
+		if (!new_de)
+			goto out_dir;
+		new_de->d_ino = old_inode->i_ino;
+		mark_buffer_dirty(new_bh);
+		brelse(new_bh);
+		new_dir->i_mtime = new_dir->i_ctime =
+			current_fs_time(new_dir->i_sb);
+		mark_inode_dirty(new_dir);
+		new_inode->i_ctime = new_dir->i_ctime;
+		if (S_ISDIR(new_inode->i_mode))
+			drop_nlink(new_inode);
+		inode_dec_link_count(new_inode);
+		if (!new_inode->i_nlink)
+			uxfs_orphan_add(new_inode);
+	} else if (old_dir == new_dir) {
+		memset(old_de->d_name, 0, UX_NAMELEN);
+		memcpy(old_de->d_name, new_dentry->d_name.name,
+		       new_dentry->d_name.len);
+		mark_buffer_dirty(old_bh);
+		brelse(old_bh);
+		old_dir->i_mtime = old_dir->i_ctime =
+			current_fs_time(old_dir->i_sb);
+		mark_inode_dirty(old_dir);
+		old_inode->i_ctime = old_dir->i_ctime;
+		mark_inode_dirty(old_inode);
+		brelse(dir_bh);
+		return 0;
+	} else {
+		err = uxfs_add_link(new_dentry, old_inode);
+		if (err)
+			goto out_dir;
+		if (dir_de)
+			inode_inc_link_count(new_dir);
+	}
+
+	uxfs_delete_dirent(old_dir, old_bh, old_de, old_slot);
+	old_inode->i_ctime = old_dir->i_ctime;
+	mark_inode_dirty(old_inode);
+
+	if (dir_de) {
+		dir_de->d_ino = new_dir->i_ino;
+		mark_buffer_dirty(dir_bh);
+		brelse(dir_bh);
+		inode_dec_link_count(old_dir);
+	}
+	return 0;
+
+out_dir:
+	brelse(dir_bh);
+out_old:
+	brelse(old_bh);
+	return err;
+}
+
 struct inode_operations ux_dir_inode_operations = {
 	.lookup = uxfs_lookup,
 	.create = uxfs_create,
 	.unlink	= uxfs_unlink,
 	.mkdir	= uxfs_mkdir,
 	.rmdir	= uxfs_rmdir,
+	.link	= uxfs_link,
+	.rename	= uxfs_rename,
+	.setxattr	= generic_setxattr,
+	.getxattr	= generic_getxattr,
+	.listxattr	= uxfs_listxattr,
+	.removexattr	= generic_removexattr,
 };
@@ -2,6 +2,7 @@
 #define __UX_FS_H__
 
 #include <linux/types.h>
+#include <linux/ioctl.h>
 #define UX_NAMELEN		28
 #define UX_DIRECT_BLOCKS	16
 #define UX_MAXFILES		32
@@ -13,9 +14,42 @@
 #define UX_INODE_BLOCK		4
 #define UX_ROOT_INO		2
 #define UX_DIR_PER_BLK		32	/* 1024 / 32 */
+
+/*
+ * Each inode lives in its own block starting at UX_INODE_BLOCK, so
+ * inodes past this point would overlap the data area and are never
+ * allocated.
+ */
+#define UX_NINODES		(UX_FIRST_DATA_BLOCK - UX_INODE_BLOCK)
+
+#define UX_REGION_BLOCKS	64
+#define UX_NREGIONS \
+	((UX_MAXBLOCKS + UX_REGION_BLOCKS - 1) / UX_REGION_BLOCKS)
 /*
  * The on-disk superblock. The number of inodes and 
- * data blocks is fixed.
+ * data blocks is fixed, although a small device may
+ * hold fewer than UX_MAXBLOCKS data blocks; those past
+ * s_nblocks are always marked in use. Images made before
+ * s_nblocks existed have it set to zero.
+ *
+ * s_inoinit has one bit per inode, set once the inode's
+ * table block has been zeroed. uxmkfs leaves the table
+ * alone and each block is zeroed on first allocation.
+ *
+ * s_orphan has one bit per inode that is unlinked but still
+ * open, or whose blocks past i_size are being released. Mount
+ * finishes the job for each of them.
+ *
+ * UX_FEATURE_IMMUTABLE in s_features marks an image made with
+ * uxmkfs -r, which is never to change again. It is only ever
+ * mounted read-only, so its directories and block maps may be
+ * cached without regard to writers.
+ *
+ * s_rfree holds the free blocks in each region of UX_REGION_BLOCKS
+ * of the block map, so the allocator can pass over full regions.
+ * It is only valid with UX_FEATURE_RFREE; older images get it
+ * counted at mount. Tools that change s_block[] call
+ * ux_count_regions() before writing the superblock back.
  */
 
 struct ux_superblock {
@@ -25,10 +59,27 @@ struct ux_superblock {
 	__u32	s_nbfree;
 	__u8	s_inode[UX_MAXFILES];
 	__u8	s_block[UX_MAXBLOCKS];
+	__u8	s_pad;
+	__u32	s_nblocks;
+	__u32	s_inoinit;
+	__u32	s_orphan;
+	__u32	s_features;	/* UX_FEATURE_* */
+	__u16	s_rfree[UX_NREGIONS];
 };
 
+#define UX_FEATURE_IMMUTABLE	0x1
+#define UX_FEATURE_RFREE	0x2
+
+static inline __u32 ux_nblocks(const struct ux_superblock *usb)
+{
+	if (usb->s_nblocks == 0 || usb->s_nblocks > UX_MAXBLOCKS)
+		return UX_MAXBLOCKS;
+	return usb->s_nblocks;
+}
+
 /*
- * The on-disk inode.
+ * The on-disk inode. It has its own table block and must end
+ * before UX_XATTR_OFFSET, where its extended attributes start.
  */
 
 struct ux_inode {
@@ -42,16 +93,87 @@ struct ux_inode {
 	__u32	i_size;
 	__u32	i_blocks;
 	__u32	i_addr[UX_DIRECT_BLOCKS];
+	__u32	i_atime_ns;	/* nanoseconds; 0 on older images */
+	__u32	i_mtime_ns;
+	__u32	i_ctime_ns;
+	__u32	i_flags;	/* UX_*_FL */
+	__u32	i_cmap;		/* clusters stored compressed */
 };
 
 /*
- * Allocation flags
+ * Inode flags, with the values of the matching FS_*_FL so that
+ * chattr can set them through FS_IOC_SETFLAGS.
+ *
+ * A regular file with UX_COMPR_FL stores each cluster of
+ * UX_CLUSTER_BLOCKS blocks deflated with zlib when that saves at
+ * least a block, and sets the cluster's bit in i_cmap. Such a
+ * cluster uses only its leading i_addr[] slots, and its first block
+ * starts with the __u32 length of the zlib stream that follows.
+ * Directories pass the flag on to files created in them.
+ */
+
+#define UX_COMPR_FL		0x00000004
+#define UX_FL_USER_MODIFIABLE	UX_COMPR_FL
+
+#define UX_CLUSTER_BLOCKS	4
+#define UX_CLUSTER_SIZE		(UX_CLUSTER_BLOCKS * UX_BSIZE)
+
+/*
+ * Extended attributes live in the inode's table block from
+ * UX_XATTR_OFFSET on, behind a header, and spill into one data
+ * block named in the header once that area is full. Entries are
+ * packed back to back, each padded to 4 bytes, and one with a
+ * zero e_name_len ends the list; the spill block holds entries
+ * only. Without UX_XATTR_MAGIC the area is unused.
+ */
+
+#define UX_XATTR_OFFSET		256
+#define UX_XATTR_INLINE		(UX_BSIZE - UX_XATTR_OFFSET)
+#define UX_XATTR_MAGIC		0x58415454
+
+#define UX_XATTR_INDEX_USER	1
+#define UX_XATTR_INDEX_TRUSTED	2
+#define UX_XATTR_INDEX_SECURITY	3
+
+struct ux_xattr_header {
+	__u32	x_magic;
+	__u32	x_spill;	/* spill block, or 0 */
+};
+
+struct ux_xattr_entry {
+	__u8	e_index;	/* UX_XATTR_INDEX_* */
+	__u8	e_name_len;
+	__u16	e_value_len;
+	char	e_name[0];	/* name, then value */
+};
+
+#define UX_XATTR_SIZE(nlen, vlen) \
+	((sizeof(struct ux_xattr_entry) + (nlen) + (vlen) + 3) & ~3)
+
+/*
+ * Allocation flags. s_block[] holds a reference count: data
+ * blocks of regular files may be shared by cloning, up to
+ * UX_BLOCK_MAXREF files per block.
  */
 
 #define UX_INODE_FREE     0
 #define UX_INODE_INUSE    1
 #define UX_BLOCK_FREE     0
 #define UX_BLOCK_INUSE    1
+#define UX_BLOCK_MAXREF   255
+
+static inline void ux_count_regions(struct ux_superblock *usb)
+{
+	__u32 i, n = ux_nblocks(usb);
+
+	for (i = 0; i < UX_NREGIONS; i++)
+		usb->s_rfree[i] = 0;
+	for (i = 0; i < n; i++) {
+		if (usb->s_block[i] == UX_BLOCK_FREE)
+			usb->s_rfree[i / UX_REGION_BLOCKS]++;
+	}
+	usb->s_features |= UX_FEATURE_RFREE;
+}
 
 /*
  * Filesystem flags
@@ -69,4 +191,118 @@ struct ux_dirent {
 	char	d_name[UX_NAMELEN];
 };
 
+/*
+ * The stream written by uxdump and read by uxrestore: a header,
+ * then one record per inode in use, in inode order, then the
+ * blocks of the dumped inodes in the order they sit on disk, and
+ * a UX_DUMP_END record.
+ *
+ * UX_DUMP_INODE carries the inode's whole table block, xattr area
+ * included. In an incremental dump, one with h_since set, inodes
+ * not changed since then get UX_DUMP_KEEP instead and none of
+ * their blocks follow. UX_DUMP_DATA carries i_addr[r_index] of
+ * r_ino and UX_DUMP_SPILL its xattr spill block; r_blk is the
+ * block's number on the dumped device, and UX_DUMP_SHARE stands
+ * for a block already sent with that number. Holes send nothing.
+ */
+
+#define UX_DUMP_MAGIC		0x50445855
+
+struct ux_dump_header {
+	__u32	h_magic;
+	__u32	h_date;		/* when the dump was taken */
+	__u32	h_since;	/* 0 for a full dump */
+	__u32	h_nblocks;	/* data blocks of the dumped file system */
+};
+
+#define UX_DUMP_INODE		1	/* UX_BSIZE bytes follow */
+#define UX_DUMP_KEEP		2
+#define UX_DUMP_DATA		3	/* UX_BSIZE bytes follow */
+#define UX_DUMP_SPILL		4	/* UX_BSIZE bytes follow */
+#define UX_DUMP_SHARE		5
+#define UX_DUMP_END		6
+
+struct ux_dump_rec {
+	__u16	r_type;		/* UX_DUMP_* */
+	__u16	r_index;
+	__u32	r_ino;
+	__u32	r_blk;
+};
+
+/*
+ * ioctls. UX_IOC_COMPACT, on a directory, moves its entries
+ * into the leading slots and frees the blocks left empty.
+ *
+ * UX_IOC_BULKSTAT, on a directory, returns up to bk_count
+ * entries from directory offset bk_pos together with their
+ * inode attributes, like readdir followed by stat. On return
+ * bk_count holds the number filled in and bk_pos the offset to
+ * pass next time; the end of the directory gives a count of 0.
+ * The caller needs search permission on the directory. bs_name
+ * is NUL padded, with no terminating NUL when the name is the
+ * full UX_NAMELEN bytes.
+ *
+ * UX_IOC_CLONE and UX_IOC_CLONE_RANGE share the numbers and
+ * arguments of FICLONE and FICLONERANGE. The destination file
+ * takes references to the source's blocks; offsets and length
+ * must be block aligned, except that the range may end at the
+ * source's EOF if it also reaches the destination's. A length
+ * of 0 means up to the source's EOF.
+ *
+ * UX_IOC_DEFRAG, on a regular file, moves its blocks into one
+ * contiguous free run and reports the number of extents before
+ * and after. With UX_DEFRAG_QUERY set nothing is moved. Files
+ * sharing blocks with a clone are left alone (EBUSY), as are
+ * compressed files (EOPNOTSUPP) and files whose blocks change while
+ * they are copied (EAGAIN).
+ *
+ * UX_IOC_RESIZE, on any directory, grows the mounted file system
+ * to the given number of data blocks, or as far as the device and
+ * UX_MAXBLOCKS allow if it is 0, and returns the new size.
+ */
+
+struct ux_bstat {
+	__u32	bs_ino;
+	__u32	bs_mode;
+	__u32	bs_nlink;
+	__s32	bs_uid;
+	__s32	bs_gid;
+	__u32	bs_size;
+	__u32	bs_blocks;
+	__u32	bs_atime;
+	__u32	bs_mtime;
+	__u32	bs_ctime;
+	char	bs_name[UX_NAMELEN];
+};
+
+struct ux_bulkstat {
+	__u64	bk_pos;
+	__u64	bk_buf;		/* struct ux_bstat array */
+	__u32	bk_count;
+	__u32	bk_pad;
+};
+
+struct ux_clone_range {
+	__s64	src_fd;
+	__u64	src_offset;
+	__u64	src_length;
+	__u64	dest_offset;
+};
+
+struct ux_defrag {
+	__u32	df_flags;
+	__u32	df_blocks;	/* blocks allocated to the file */
+	__u32	df_before;	/* extents before */
+	__u32	df_after;	/* extents after */
+};
+
+#define UX_DEFRAG_QUERY		0x1
+
+#define UX_IOC_COMPACT		_IO('u', 1)
+#define UX_IOC_BULKSTAT		_IOWR('u', 2, struct ux_bulkstat)
+#define UX_IOC_CLONE		_IOW(0x94, 9, int)
+#define UX_IOC_CLONE_RANGE	_IOW(0x94, 13, struct ux_clone_range)
+#define UX_IOC_DEFRAG		_IOWR('u', 3, struct ux_defrag)
+#define UX_IOC_RESIZE		_IOWR('u', 4, __u32)
+
 #endif /* __UX_FS_H__ */
@@ -0,0 +1,436 @@
+/*
+ * uxbench - microbenchmarks for a mounted uxfs.
+ *
+ * Run against a directory on a loop-mounted image or on uxfuse. Every
+ * test records the latency of each operation and reports the rate and
+ * latency percentiles. Random offsets come from a fixed seed, so two
+ * runs issue exactly the same operations.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "ux_fs.h"
+
+#define UX_MAXSIZE	(UX_DIRECT_BLOCKS * UX_BSIZE)
+#define BENCH_MAXOPS	65536
+
+/* Latencies of one kind of operation. */
+struct series {
+	int	n;
+	double	v[BENCH_MAXOPS];
+};
+
+static int		rounds = 20;
+static long		seed = 1;
+static char		*top;
+static double		t_start;
+static char		buf[UX_BSIZE];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "uxbench: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+/*
+ * Each measured operation is wrapped in op_begin()/op_end().
+ */
+static void op_begin(void)
+{
+	t_start = now();
+}
+
+static void op_end(struct series *sp)
+{
+	if (sp->n < BENCH_MAXOPS)
+		sp->v[sp->n++] = now() - t_start;
+}
+
+static int by_value(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(struct series *sp, double p)
+{
+	return sp->v[(int)(p * (sp->n - 1))] * 1e6;
+}
+
+static void report(struct series *sp, const char *fmt, ...)
+{
+	char name[64];
+	double total = 0;
+	va_list ap;
+	int i;
+
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof(name), fmt, ap);
+	va_end(ap);
+	if (!sp->n)
+		return;
+	for (i = 0; i < sp->n; i++)
+		total += sp->v[i];
+	qsort(sp->v, sp->n, sizeof(double), by_value);
+	printf("%-24s %7d %10.0f %9.1f %9.1f %9.1f %9.1f\n", name, sp->n,
+	       sp->n / total, pct(sp, 0.5), pct(sp, 0.9), pct(sp, 0.99),
+	       pct(sp, 1.0));
+	sp->n = 0;
+}
+
+static char *path(const char *fmt, int n)
+{
+	static char p[4096];
+	char name[UX_NAMELEN + 1];
+
+	snprintf(name, sizeof(name), fmt, n);
+	snprintf(p, sizeof(p), "%s/%s", top, name);
+	return p;
+}
+
+/*
+ * Directory size is bounded by the free inodes, so the sizes tried
+ * grow geometrically up to what the volume can hold.
+ */
+static int max_files(void)
+{
+	struct statvfs sv;
+
+	if (statvfs(top, &sv) < 0)
+		die("statvfs");
+	if (sv.f_ffree > UX_NINODES)
+		sv.f_ffree = UX_NINODES;
+	return sv.f_ffree > 2 ? sv.f_ffree - 2 : 0;
+}
+
+static void bench_namespace(void)
+{
+	static struct series create, lookup, miss, unlinks;
+	int n, i, r, fd, max = max_files();
+	struct stat st;
+
+	for (n = 1; n <= max; n = n * 2 > max && n < max ? max : n * 2) {
+		for (r = 0; r < rounds; r++) {
+			for (i = 0; i < n; i++) {
+				op_begin();
+				fd = open(path("f%d", i), O_CREAT | O_EXCL |
+					  O_WRONLY, 0644);
+				op_end(&create);
+				if (fd < 0)
+					die("create");
+				close(fd);
+			}
+			for (i = 0; i < n; i++) {
+				op_begin();
+				if (stat(path("f%d", i), &st) < 0)
+					die("stat");
+				op_end(&lookup);
+				op_begin();
+				stat(path("missing%d", i), &st);
+				op_end(&miss);
+			}
+			for (i = 0; i < n; i++) {
+				op_begin();
+				if (unlink(path("f%d", i)) < 0)
+					die("unlink");
+				op_end(&unlinks);
+			}
+		}
+		report(&create, "create/%d", n);
+		report(&lookup, "lookup/%d", n);
+		report(&miss, "lookup-miss/%d", n);
+		report(&unlinks, "unlink/%d", n);
+	}
+}
+
+/*
+ * One pass over the directory with UX_IOC_BULKSTAT. Returns -1 where
+ * the ioctl isn't supported, such as on uxfuse.
+ */
+static int bulkstat_pass(void)
+{
+	static struct ux_bstat bs[64];
+	struct ux_bulkstat bk;
+	int fd, err = 0;
+
+	fd = open(top, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		die("open");
+	memset(&bk, 0, sizeof(bk));
+	bk.bk_buf = (unsigned long)bs;
+	do {
+		bk.bk_count = 64;
+		if (ioctl(fd, UX_IOC_BULKSTAT, &bk) < 0) {
+			err = -1;
+			break;
+		}
+	} while (bk.bk_count);
+	close(fd);
+	return err;
+}
+
+static void bench_readdir(void)
+{
+	static struct series readdirs, rdstats, bulkstats;
+	int n, i, r, fd, max = max_files();
+	char name[4096];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	for (n = 1; n <= max; n = n * 2 > max && n < max ? max : n * 2) {
+		for (i = 0; i < n; i++) {
+			fd = open(path("f%d", i), O_CREAT | O_WRONLY, 0644);
+			if (fd < 0)
+				die("create");
+			close(fd);
+		}
+		for (r = 0; r < rounds; r++) {
+			op_begin();
+			d = opendir(top);
+			if (!d)
+				die("opendir");
+			while ((de = readdir(d)))
+				;
+			closedir(d);
+			op_end(&readdirs);
+
+			op_begin();
+			d = opendir(top);
+			if (!d)
+				die("opendir");
+			while ((de = readdir(d))) {
+				snprintf(name, sizeof(name), "%s/%s", top,
+					 de->d_name);
+				if (lstat(name, &st) < 0)
+					die("lstat");
+			}
+			closedir(d);
+			op_end(&rdstats);
+
+			op_begin();
+			if (bulkstat_pass() == 0)
+				op_end(&bulkstats);
+		}
+		report(&readdirs, "readdir/%d", n);
+		report(&rdstats, "readdir+stat/%d", n);
+		report(&bulkstats, "bulkstat/%d", n);
+		for (i = 0; i < n; i++)
+			unlink(path("f%d", i));
+	}
+}
+
+static void bench_mkdir(void)
+{
+	static struct series mkdirs, rmdirs;
+	int r;
+
+	for (r = 0; r < rounds; r++) {
+		op_begin();
+		if (mkdir(path("d%d", r), 0755) < 0)
+			die("mkdir");
+		op_end(&mkdirs);
+		op_begin();
+		if (rmdir(path("d%d", r)) < 0)
+			die("rmdir");
+		op_end(&rmdirs);
+	}
+	report(&mkdirs, "mkdir");
+	report(&rmdirs, "rmdir");
+}
+
+static void seq_pass(int fd, int writing, const char *name)
+{
+	static struct series ops;
+	off_t off;
+	ssize_t n;
+	int r;
+
+	for (r = 0; r < rounds; r++) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		for (off = 0; off < UX_MAXSIZE; off += UX_BSIZE) {
+			op_begin();
+			n = writing ? pwrite(fd, buf, UX_BSIZE, off) :
+				      pread(fd, buf, UX_BSIZE, off);
+			op_end(&ops);
+			if (n != UX_BSIZE)
+				die(name);
+		}
+		if (writing)
+			fsync(fd);
+	}
+	report(&ops, "%s", name);
+}
+
+static void rand_pass(int fd, int writing, const char *name)
+{
+	static struct series ops;
+	struct drand48_data rng;
+	long blk;
+	ssize_t n;
+	int i;
+
+	srand48_r(seed, &rng);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	for (i = 0; i < rounds * UX_DIRECT_BLOCKS; i++) {
+		lrand48_r(&rng, &blk);
+		blk %= UX_DIRECT_BLOCKS;
+		op_begin();
+		n = writing ? pwrite(fd, buf, UX_BSIZE, blk * UX_BSIZE) :
+			      pread(fd, buf, UX_BSIZE, blk * UX_BSIZE);
+		op_end(&ops);
+		if (n != UX_BSIZE)
+			die(name);
+	}
+	report(&ops, "%s", name);
+}
+
+static void bench_data(void)
+{
+	static struct series fsyncs;
+	int fd, r;
+
+	memset(buf, 0x5a, sizeof(buf));
+	fd = open(path("data", 0), O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		die("create");
+	seq_pass(fd, 1, "seqwrite/1k");
+	seq_pass(fd, 0, "seqread/1k");
+	rand_pass(fd, 1, "randwrite/1k");
+	rand_pass(fd, 0, "randread/1k");
+	for (r = 0; r < rounds; r++) {
+		if (pwrite(fd, buf, UX_BSIZE, (r % UX_DIRECT_BLOCKS) *
+			   UX_BSIZE) != UX_BSIZE)
+			die("write");
+		op_begin();
+		if (fsync(fd) < 0)
+			die("fsync");
+		op_end(&fsyncs);
+	}
+	report(&fsyncs, "fsync/1k");
+	close(fd);
+	unlink(path("data", 0));
+}
+
+/*
+ * Fill the volume with single-block files, free every other one and
+ * time the growth of a new file through the holes. The number of
+ * physical extents the file ends up with is reported when FIBMAP is
+ * available, and its sequential reads are timed before and after
+ * UX_IOC_DEFRAG.
+ */
+static void bench_alloc(void)
+{
+	static struct series writes;
+	struct ux_defrag df;
+	int i, nfiles = max_files() - 1, fd, extents = 0;
+	int blk, prev = -1;
+
+	memset(buf, 0xa5, sizeof(buf));
+	for (i = 0; i < nfiles; i++) {
+		fd = open(path("frag%d", i), O_CREAT | O_WRONLY, 0644);
+		if (fd < 0 || write(fd, buf, UX_BSIZE) != UX_BSIZE)
+			die("fill");
+		close(fd);
+	}
+	for (i = 0; i < nfiles; i += 2)
+		unlink(path("frag%d", i));
+	sync();
+
+	fd = open(path("big", 0), O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		die("create");
+	for (i = 0; i < UX_DIRECT_BLOCKS; i++) {
+		op_begin();
+		if (write(fd, buf, UX_BSIZE) != UX_BSIZE)
+			die("write");
+		fsync(fd);
+		op_end(&writes);
+	}
+	report(&writes, "fragwrite/1k");
+	for (i = 0; i < UX_DIRECT_BLOCKS; i++) {
+		blk = i;
+		if (ioctl(fd, FIBMAP, &blk) < 0) {
+			extents = -1;
+			break;
+		}
+		extents += blk != prev + 1;
+		prev = blk;
+	}
+	if (extents >= 0)
+		printf("%-24s %7d\n", "fragwrite/extents", extents);
+	seq_pass(fd, 0, "fragread/1k");
+	memset(&df, 0, sizeof(df));
+	if (ioctl(fd, UX_IOC_DEFRAG, &df) == 0) {
+		printf("%-24s %7u\n", "defrag/extents", df.df_after);
+		seq_pass(fd, 0, "defragread/1k");
+	}
+	close(fd);
+	unlink(path("big", 0));
+	for (i = 1; i < nfiles; i += 2)
+		unlink(path("frag%d", i));
+}
+
+int main(int argc, char **argv)
+{
+	char *dir;
+	int c;
+
+	while ((c = getopt(argc, argv, "r:s:")) != -1) {
+		switch (c) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 's':
+			seed = atol(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || rounds < 1)
+		goto usage;
+	dir = argv[optind];
+	if (asprintf(&top, "%s/uxbench.%d", dir, (int)getpid()) < 0)
+		die("asprintf");
+	if (mkdir(top, 0755) < 0)
+		die(top);
+
+	printf("%-24s %7s %10s %9s %9s %9s %9s\n", "test", "ops", "ops/s",
+	       "p50(us)", "p90(us)", "p99(us)", "max(us)");
+	bench_namespace();
+	bench_readdir();
+	bench_mkdir();
+	bench_data();
+	bench_alloc();
+
+	if (rmdir(top) < 0)
+		die(top);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: uxbench [-r rounds] [-s seed] dir\n");
+	exit(1);
+}
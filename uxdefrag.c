@@ -0,0 +1,106 @@
+/*
+ * uxdefrag - defragment the files of a mounted uxfs.
+ *
+ * Walks each tree given on the command line and asks the driver, with
+ * UX_IOC_DEFRAG, to move every fragmented regular file into a single
+ * run of free blocks. The walk stays on the starting file system.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "ux_fs.h"
+
+static int	query, verbose;
+static long	nfiles, nfrag, nskipped, nerrors;
+static long	ext_before, ext_after;
+
+static int defrag_one(const char *name, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	struct ux_defrag df;
+	int fd;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	fd = open(name, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		fprintf(stderr, "uxdefrag: %s: %s\n", name, strerror(errno));
+		nerrors++;
+		return 0;
+	}
+	memset(&df, 0, sizeof(df));
+	df.df_flags = query ? UX_DEFRAG_QUERY : 0;
+	if (ioctl(fd, UX_IOC_DEFRAG, &df) < 0) {
+		if (errno == EBUSY || errno == EOPNOTSUPP || errno == EAGAIN) {
+			if (verbose)
+				printf("%s: %s, skipped\n", name,
+				       errno == EBUSY ? "shared with a clone" :
+				       errno == EAGAIN ? "in use" : "compressed");
+			nskipped++;
+		} else {
+			fprintf(stderr, "uxdefrag: %s: %s\n", name,
+				strerror(errno));
+			nerrors++;
+		}
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	nfiles++;
+	nfrag += df.df_before > 1;
+	ext_before += df.df_before;
+	/* A query leaves df_after alone; a move would give one extent. */
+	ext_after += query && df.df_before > 1 ? 1 : df.df_after;
+	if (verbose && df.df_before > 1)
+		printf("%s: %u blocks, %u -> %u extents\n", name,
+		       df.df_blocks, df.df_before, df.df_after);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c, i;
+
+	while ((c = getopt(argc, argv, "nv")) != -1) {
+		switch (c) {
+		case 'n':
+			query = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc)
+		goto usage;
+
+	for (i = optind; i < argc; i++) {
+		if (nftw(argv[i], defrag_one, 16, FTW_PHYS | FTW_MOUNT) < 0) {
+			fprintf(stderr, "uxdefrag: %s: %s\n", argv[i],
+				strerror(errno));
+			nerrors++;
+		}
+	}
+
+	printf("%ld files, %ld fragmented, %ld skipped\n", nfiles, nfrag,
+	       nskipped);
+	printf("%ld extents before, %ld %s\n", ext_before, ext_after,
+	       query ? "possible" : "after");
+	return nerrors ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: uxdefrag [-nv] path...\n");
+	exit(1);
+}
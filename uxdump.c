@@ -0,0 +1,227 @@
+/*
+ * uxdump - write a uxfs file system to a stream for uxrestore.
+ *
+ * The device is read directly, never through a mounted file system:
+ * the inode table in one request and the data area front to back in
+ * batches of UX_DUMP_BATCH blocks, sending each block wanted as it
+ * goes by. So the whole dump is one sequential pass however small
+ * and scattered the files are. The device should not be mounted
+ * read-write while it is dumped.
+ *
+ * With -i, only inodes whose i_mtime or i_ctime is no older than the
+ * date of the earlier dump named are sent in full. The stream format
+ * is described in ux_fs.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include "ux_fs.h"
+
+#define UX_DUMP_BATCH	64
+
+/* A block to send: slot r_index of inode r_ino, UX_DIRECT_BLOCKS for spill. */
+struct dp_owner {
+	__u32	blk;
+	__u32	ino;
+	__u32	index;
+};
+
+static char		itable[UX_NINODES * UX_BSIZE];
+static struct dp_owner	owners[UX_NINODES * (UX_DIRECT_BLOCKS + 1)];
+static int		nowners;
+static FILE		*out;
+static const char	*devname;
+
+static void put(const void *buf, size_t len)
+{
+	if (fwrite(buf, len, 1, out) != 1) {
+		fprintf(stderr, "uxdump: write: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+static void put_rec(int type, __u32 ino, __u32 index, __u32 blk,
+		    const char *data)
+{
+	struct ux_dump_rec r;
+
+	memset(&r, 0, sizeof(r));
+	r.r_type = type;
+	r.r_ino = ino;
+	r.r_index = index;
+	r.r_blk = blk;
+	put(&r, sizeof(r));
+	if (data)
+		put(data, UX_BSIZE);
+}
+
+static void add_owner(__u32 blk, __u32 ino, __u32 index, __u32 nblocks)
+{
+	if (blk < UX_FIRST_DATA_BLOCK || blk >= UX_FIRST_DATA_BLOCK + nblocks) {
+		fprintf(stderr, "uxdump: %s: inode %u: bad block %u skipped\n",
+			devname, ino, blk);
+		return;
+	}
+	owners[nowners].blk = blk;
+	owners[nowners].ino = ino;
+	owners[nowners].index = index;
+	nowners++;
+}
+
+static int owner_cmp(const void *a, const void *b)
+{
+	const struct dp_owner *x = a, *y = b;
+
+	if (x->blk != y->blk)
+		return x->blk < y->blk ? -1 : 1;
+	return x->ino != y->ino ? (x->ino < y->ino ? -1 : 1) :
+				  (int)x->index - (int)y->index;
+}
+
+/* The date of an earlier dump, from its header. */
+static __u32 dump_date(const char *path)
+{
+	struct ux_dump_header h;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f || fread(&h, sizeof(h), 1, f) != 1 || h.h_magic != UX_DUMP_MAGIC) {
+		fprintf(stderr, "uxdump: %s: Not a uxdump stream\n", path);
+		exit(1);
+	}
+	fclose(f);
+	return h.h_date;
+}
+
+int main(int argc, char **argv)
+{
+	struct ux_superblock	usb;
+	struct ux_dump_header	h;
+	struct ux_inode		*di;
+	struct ux_xattr_header	*xh;
+	char			buf[UX_DUMP_BATCH * UX_BSIZE];
+	char			*outname = NULL;
+	__u32			since = 0, nblocks, ino, blk, last = 0;
+	__u32			start, n;
+	long			ninodes = 0, nfull = 0, nsent = 0;
+	int			fd, c, i, o;
+
+	while ((c = getopt(argc, argv, "f:i:")) != -1) {
+		switch (c) {
+		case 'f':
+			outname = optarg;
+			break;
+		case 'i':
+			since = dump_date(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	devname = argv[optind];
+	fd = open(devname, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "uxdump: %s: %s\n", devname, strerror(errno));
+		exit(1);
+	}
+	if (pread(fd, &usb, sizeof(usb), 0) != sizeof(usb) ||
+	    pread(fd, itable, sizeof(itable), UX_INODE_BLOCK * UX_BSIZE) !=
+	    sizeof(itable))
+		goto ioerr;
+	if (usb.s_magic != UX_MAGIC) {
+		fprintf(stderr, "uxdump: %s: Not a uxfs file system\n", devname);
+		exit(1);
+	}
+	nblocks = ux_nblocks(&usb);
+	out = stdout;
+	if (outname && !(out = fopen(outname, "w"))) {
+		fprintf(stderr, "uxdump: %s: %s\n", outname, strerror(errno));
+		exit(1);
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.h_magic = UX_DUMP_MAGIC;
+	h.h_date = time(NULL);
+	h.h_since = since;
+	h.h_nblocks = nblocks;
+	put(&h, sizeof(h));
+
+	/*
+	 * The manifest. Unlinked inodes still open at the time are
+	 * left out, as fsck would free them.
+	 */
+	for (ino = UX_ROOT_INO; ino < UX_NINODES; ino++) {
+		di = (struct ux_inode *)(itable + ino * UX_BSIZE);
+		if (usb.s_inode[ino] != UX_INODE_INUSE ||
+		    !(usb.s_inoinit & (1U << ino)) ||
+		    !di->i_mode || !di->i_nlink)
+			continue;
+		ninodes++;
+		if (since && di->i_mtime < since && di->i_ctime < since) {
+			put_rec(UX_DUMP_KEEP, ino, 0, 0, NULL);
+			continue;
+		}
+		put_rec(UX_DUMP_INODE, ino, 0, 0, (char *)di);
+		nfull++;
+		for (i = 0; i < UX_DIRECT_BLOCKS; i++) {
+			if (di->i_addr[i])
+				add_owner(di->i_addr[i], ino, i, nblocks);
+		}
+		xh = (struct ux_xattr_header *)((char *)di + UX_XATTR_OFFSET);
+		if (xh->x_magic == UX_XATTR_MAGIC && xh->x_spill)
+			add_owner(xh->x_spill, ino, UX_DIRECT_BLOCKS, nblocks);
+	}
+
+	/* Then the blocks, in one pass over the data area. */
+	qsort(owners, nowners, sizeof(owners[0]), owner_cmp);
+	for (o = 0; o < nowners; ) {
+		start = owners[o].blk;
+		n = UX_FIRST_DATA_BLOCK + nblocks - start;
+		if (n > UX_DUMP_BATCH)
+			n = UX_DUMP_BATCH;
+		if (pread(fd, buf, n * UX_BSIZE, (off_t)start * UX_BSIZE) !=
+		    n * UX_BSIZE)
+			goto ioerr;
+		for (; o < nowners && owners[o].blk < start + n; o++) {
+			blk = owners[o].blk;
+			if (owners[o].index == UX_DIRECT_BLOCKS)
+				put_rec(UX_DUMP_SPILL, owners[o].ino, 0, blk,
+					buf + (blk - start) * UX_BSIZE);
+			else if (blk == last)
+				put_rec(UX_DUMP_SHARE, owners[o].ino,
+					owners[o].index, blk, NULL);
+			else
+				put_rec(UX_DUMP_DATA, owners[o].ino,
+					owners[o].index, blk,
+					buf + (blk - start) * UX_BSIZE);
+			if (blk != last)
+				nsent++;
+			last = blk;
+		}
+	}
+	put_rec(UX_DUMP_END, 0, 0, 0, NULL);
+	if (fflush(out) || (outname && fclose(out))) {
+		fprintf(stderr, "uxdump: write: %s\n", strerror(errno));
+		exit(1);
+	}
+	fprintf(stderr, "uxdump: %s: %ld inodes, %ld dumped, %ld blocks\n",
+		devname, ninodes, nfull, nsent);
+	return 0;
+
+ioerr:
+	fprintf(stderr, "uxdump: %s: read error\n", devname);
+	exit(1);
+
+usage:
+	fprintf(stderr, "usage: uxdump [-f file] [-i earlier-dump] device\n");
+	exit(1);
+}
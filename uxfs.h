@@ -2,23 +2,82 @@
 #define __UXFS_H__
 
 #include <linux/fs.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/mutex.h>
 #include "ux_fs.h"
 
+/*
+ * For directories, i_dfree has a bit set for each free slot in the
+ * corresponding directory block and i_dlive counts the used slots,
+ * "." and ".." included. Both are built by one scan of the directory
+ * the first time they are needed (i_dvalid) and kept up to date by
+ * namei.c under the directory's i_mutex.
+ *
+ * The block map of a regular file, i_data[] together with i_blocks
+ * and i_cmap, is only changed under i_map_mutex, and each change is
+ * published inside a write section of i_map_seq. Readers take
+ * neither: a single slot is read as it is, and anything spanning
+ * several fields is copied under read_seqbegin()/read_seqretry().
+ * Directories change their maps under i_mutex only.
+ */
 struct ux_inode_info {
 	__u32	i_data[UX_DIRECT_BLOCKS];
+	__u32	i_dfree[UX_DIRECT_BLOCKS];
+	__u32	i_dlive;
+	int	i_dvalid;
+	struct list_head i_lazy;	/* on s_lazy, times not yet written */
+	unsigned long i_lazy_since;
+	__u32	i_flags;
+	__u32	i_cmap;
+	struct mutex i_map_mutex;	/* serialises block map writers */
+	seqlock_t i_map_seq;
+	char	*i_xattr;		/* inline xattr area, NULL if unused */
+	struct rw_semaphore i_xattr_sem;
 	struct inode vfs_inode;
 };
 
+/*
+ * The allocation maps s_inode and s_block are used in place in the
+ * superblock buffer, which stays pinned for the life of the mount,
+ * so mounting copies nothing. They, the free counts, s_rfree,
+ * s_inoinit and s_orphan are changed under s_alloc_lock.
+ */
 struct ux_sb_info {
 	__u32	s_nifree;
 	__u32	s_nbfree;
-	__u32	s_inode[UX_MAXFILES];
-	__u32	s_block[UX_MAXBLOCKS];
+	__u32	s_nblocks;
+	__u32	s_inoinit;
+	__u32	s_orphan;
+	__u32	s_features;
+	__u32	s_rfree[UX_NREGIONS];	/* free blocks per region */
+	__u8	*s_inode;		/* the superblock's s_inode[] */
+	__u8	*s_block;		/* the superblock's s_block[] */
+	spinlock_t s_alloc_lock;
+	struct mutex s_resize_lock;	/* one uxfs_resize at a time */
 	unsigned short s_mount_state;
+	unsigned long s_mount_opt;
+	struct mutex s_lazy_lock;
+	struct list_head s_lazy;
+	struct delayed_work s_lazy_work;
+	struct mutex s_zlock;		/* compression state below */
+	void	*s_zwork;		/* zlib workspace, allocated on first use */
+	char	*s_zbuf;		/* one compressed cluster */
 	struct ux_superblock * s_ms;
 	struct buffer_head *s_sbh;
+	struct super_block *s_sb;
 };
 
+/*
+ * Mount options
+ */
+
+#define UX_MOUNT_PREFETCH	0x0001	/* readdir reads ahead inode blocks */
+#define UX_MOUNT_LAZYTIME	0x0002	/* keep timestamp-only updates in core */
+
+/* Longest a lazytime timestamp update is held before being written. */
+#define UX_LAZYTIME_EXPIRE	(12 * 60 * 60 * HZ)
+
 extern struct file_operations ux_dir_operations;
 extern struct inode_operations ux_dir_inode_operations;
 extern struct file_operations ux_file_operations;
@@ -35,11 +94,60 @@ static inline struct ux_inode_info *uxfs_i(struct inode *inode)
 	return list_entry(inode, struct ux_inode_info, vfs_inode);
 }
 
+/*
+ * Point slot i of a file at blk and adjust i_blocks by delta sectors.
+ * Called with i_map_mutex held.
+ */
+static inline void uxfs_map_set(struct inode *inode, int i, __u32 blk,
+				int delta)
+{
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+
+	write_seqlock(&ux_inode->i_map_seq);
+	ux_inode->i_data[i] = blk;
+	inode->i_blocks += delta;
+	write_sequnlock(&ux_inode->i_map_seq);
+}
+
+static inline int uxfs_immutable(struct super_block *sb)
+{
+	return uxfs_sb(sb)->s_features & UX_FEATURE_IMMUTABLE;
+}
+
+static inline int uxfs_compressed(struct inode *inode)
+{
+	return S_ISREG(inode->i_mode) && (uxfs_i(inode)->i_flags & UX_COMPR_FL);
+}
+
+extern struct ux_inode *uxfs_raw_inode(struct super_block *sb, ino_t ino,
+				       struct buffer_head **bh);
 extern struct inode * uxfs_new_inode(struct super_block *sb, int *error);
 extern int uxfs_new_block(struct super_block *sb, int *error);
+extern int uxfs_new_run(struct super_block *sb, int n, int *error);
+extern void uxfs_free_block(struct super_block *sb, __u32 blk);
+extern int uxfs_ref_block(struct super_block *sb, __u32 blk);
+extern void uxfs_orphan_add(struct inode *inode);
+extern void uxfs_orphan_del(struct inode *inode);
+extern int uxfs_dir_compact(struct inode *dir);
+extern void uxfs_dir_readahead(struct inode *dir);
 extern void uxfs_set_inode(struct inode *inode);
 extern struct inode * uxfs_iget(struct super_block *sb, unsigned long ino);
 extern void uxfs_truncate(struct inode * inode);
 extern int uxfs_sync_inode(struct inode * inode);
+extern int uxfs_resize(struct super_block *sb, __u32 *nblocks);
+extern int uxfs_flags_ioctl(struct inode *inode, unsigned int cmd,
+			    unsigned long arg);
+extern int uxfs_zreadpage(struct file *file, struct page *page);
+extern int uxfs_zwritepage(struct page *page, struct writeback_control *wbc);
+extern int uxfs_zwrite_begin(struct file *file, struct address_space *mapping,
+			     loff_t pos, unsigned len, unsigned flags,
+			     struct page **pagep, void **fsdata);
+extern int uxfs_ztruncate_page(struct inode *inode);
+extern void uxfs_zexit(struct ux_sb_info *sbi);
+extern struct xattr_handler *uxfs_xattr_handlers[];
+extern ssize_t uxfs_listxattr(struct dentry *dentry, char *buffer, size_t size);
+extern int uxfs_xattr_load(struct inode *inode, char *area);
+extern void uxfs_xattr_clear(struct super_block *sb, char *area);
+extern int uxfs_init_security(struct inode *inode, struct inode *dir);
 
 #endif /* __UXFS_H__ */
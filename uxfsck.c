@@ -0,0 +1,881 @@
+/*
+ * uxfsck - check and repair a uxfs filesystem.
+ *
+ * The superblock and the whole inode table are read with a single
+ * pread, and directory blocks are read in coalesced runs in physical
+ * order. Inodes and directories are then checked in parallel. The
+ * steps that decide block ownership and reachability run serially in
+ * inode order, so the repairs made never depend on thread scheduling.
+ *
+ * Exit status follows fsck(8): 0 clean, 1 errors corrected, 4 errors
+ * left uncorrected, 8 operational error.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ux_fs.h"
+
+#define UX_MAXSIZE	(UX_DIRECT_BLOCKS * UX_BSIZE)
+#define FSCK_MAXTHREADS	64
+#define FSCK_GAP	8	/* free blocks worth reading through */
+
+static int			devfd;
+static __u32			nblocks;
+static int			nflag;
+static int			nthreads;
+static int			problems;
+static int			unfixed;
+static pthread_mutex_t		report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Superblock and inode table, blocks 0 to UX_FIRST_DATA_BLOCK - 1. */
+static char			meta[UX_FIRST_DATA_BLOCK * UX_BSIZE];
+static char			meta_dirty[UX_FIRST_DATA_BLOCK];
+static struct ux_superblock	*usb = (struct ux_superblock *)meta;
+
+/* Directory block contents, indexed by data block number. */
+static char			*dblock[UX_MAXBLOCKS];
+static char			dblock_dirty[UX_MAXBLOCKS];
+static __u32			owner[UX_MAXBLOCKS];	/* first claimant */
+static __u32			nrefs[UX_MAXBLOCKS];
+static char			spill[UX_MAXBLOCKS];	/* an xattr block */
+
+static char			allocated[UX_NINODES];
+static char			reachable[UX_NINODES];
+static __u32			parent[UX_NINODES];
+static __u32			refs[UX_NINODES];
+
+static void report(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&report_lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	problems++;
+	pthread_mutex_unlock(&report_lock);
+}
+
+static struct ux_inode *ux_ino(__u32 ino)
+{
+	return (struct ux_inode *)(meta + (UX_INODE_BLOCK + ino) * UX_BSIZE);
+}
+
+static struct ux_xattr_header *ux_xattr(__u32 ino)
+{
+	return (struct ux_xattr_header *)((char *)ux_ino(ino) +
+					  UX_XATTR_OFFSET);
+}
+
+static void ino_dirty(__u32 ino)
+{
+	meta_dirty[UX_INODE_BLOCK + ino] = 1;
+}
+
+static int is_dir(__u32 ino)
+{
+	return allocated[ino] && S_ISDIR(ux_ino(ino)->i_mode);
+}
+
+static struct ux_dirent *dir_slot(struct ux_inode *ip, __u32 slot)
+{
+	__u32 blk = ip->i_addr[slot / UX_DIR_PER_BLK] - UX_FIRST_DATA_BLOCK;
+
+	return (struct ux_dirent *)dblock[blk] + slot % UX_DIR_PER_BLK;
+}
+
+static void slot_dirty(struct ux_inode *ip, __u32 slot)
+{
+	dblock_dirty[ip->i_addr[slot / UX_DIR_PER_BLK] - UX_FIRST_DATA_BLOCK] = 1;
+}
+
+static void clear_slot(struct ux_inode *ip, __u32 slot)
+{
+	memset(dir_slot(ip, slot), 0, sizeof(struct ux_dirent));
+	slot_dirty(ip, slot);
+}
+
+static int is_dot(const struct ux_dirent *de)
+{
+	return !strncmp(de->d_name, ".", UX_NAMELEN);
+}
+
+static int is_dotdot(const struct ux_dirent *de)
+{
+	return !strncmp(de->d_name, "..", UX_NAMELEN);
+}
+
+/*
+ * Run fn(0) .. fn(n - 1) across the worker threads.
+ */
+struct fsck_work {
+	void	(*fn)(__u32);
+	__u32	n;
+	__u32	next;
+};
+
+static void *fsck_worker(void *arg)
+{
+	struct fsck_work *w = arg;
+	__u32 i;
+
+	while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->n)
+		w->fn(i);
+	return NULL;
+}
+
+static void run_parallel(void (*fn)(__u32), __u32 n)
+{
+	pthread_t tid[FSCK_MAXTHREADS];
+	struct fsck_work w = { fn, n, 0 };
+	int i, started = 0;
+
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&tid[started], NULL, fsck_worker, &w))
+			break;
+		started++;
+	}
+	fsck_worker(&w);
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+}
+
+static void release_block(__u32 a)
+{
+	__u32 i = a - UX_FIRST_DATA_BLOCK;
+
+	if (nrefs[i] && --nrefs[i] == 0) {
+		owner[i] = 0;
+		spill[i] = 0;
+	}
+}
+
+static void free_inode(__u32 ino)
+{
+	struct ux_inode *ip = ux_ino(ino);
+	int b;
+
+	for (b = 0; b < UX_DIRECT_BLOCKS; b++) {
+		if (ip->i_addr[b])
+			release_block(ip->i_addr[b]);
+	}
+	if (ux_xattr(ino)->x_magic == UX_XATTR_MAGIC && ux_xattr(ino)->x_spill &&
+	    owner[ux_xattr(ino)->x_spill - UX_FIRST_DATA_BLOCK] == ino)
+		release_block(ux_xattr(ino)->x_spill);
+	memset(ux_xattr(ino), 0, UX_XATTR_INLINE);
+	memset(ip, 0, sizeof(*ip));
+	ino_dirty(ino);
+	allocated[ino] = 0;
+}
+
+/*
+ * Check that the xattr entries between p and end are well formed.
+ */
+static int xattr_valid(char *p, char *end)
+{
+	struct ux_xattr_entry *e;
+	size_t size;
+
+	while (p + sizeof(*e) <= end) {
+		e = (struct ux_xattr_entry *)p;
+		if (!e->e_name_len)
+			break;
+		size = UX_XATTR_SIZE(e->e_name_len, e->e_value_len);
+		if (p + size > end || e->e_index < UX_XATTR_INDEX_USER ||
+		    e->e_index > UX_XATTR_INDEX_SECURITY)
+			return 0;
+		p += size;
+	}
+	return 1;
+}
+
+static void pass1_xattr(__u32 ino)
+{
+	struct ux_xattr_header *xh = ux_xattr(ino);
+	char buf[UX_BSIZE];
+	__u32 a = xh->x_spill;
+
+	if (xh->x_magic != UX_XATTR_MAGIC)
+		return;
+	if (!xattr_valid((char *)(xh + 1), (char *)xh + UX_XATTR_INLINE)) {
+		report("Inode %u: bad inline xattrs, cleared\n", ino);
+		memset(xh, 0, UX_XATTR_INLINE);
+		ino_dirty(ino);
+		return;
+	}
+	if (!a)
+		return;
+	if (a < UX_FIRST_DATA_BLOCK || a >= UX_FIRST_DATA_BLOCK + nblocks ||
+	    pread(devfd, buf, UX_BSIZE, (off_t)a * UX_BSIZE) != UX_BSIZE ||
+	    !xattr_valid(buf, buf + UX_BSIZE)) {
+		report("Inode %u: bad xattr block %u, dropped\n", ino, a);
+		xh->x_spill = 0;
+		ino_dirty(ino);
+	}
+}
+
+/*
+ * Pass 1: validate each inode on its own.
+ */
+static void pass1_inode(__u32 ino)
+{
+	struct ux_inode *ip = ux_ino(ino);
+	__u32 a, end;
+	int b;
+
+	if (ino < UX_ROOT_INO)
+		return;
+	if (usb->s_inode[ino] != UX_INODE_INUSE || !ip->i_mode) {
+		if (ux_xattr(ino)->x_magic == UX_XATTR_MAGIC) {
+			report("Inode %u: xattrs on a free inode, cleared\n",
+			       ino);
+			memset(ux_xattr(ino), 0, UX_XATTR_INLINE);
+			ino_dirty(ino);
+		}
+		return;
+	}
+	if (!S_ISREG(ip->i_mode) && !S_ISDIR(ip->i_mode)) {
+		report("Inode %u: bad mode 0%o, cleared\n", ino, ip->i_mode);
+		memset(ip, 0, sizeof(*ip));
+		memset(ux_xattr(ino), 0, UX_XATTR_INLINE);
+		ino_dirty(ino);
+		return;
+	}
+	allocated[ino] = 1;
+	if (ip->i_size > UX_MAXSIZE) {
+		report("Inode %u: size %u too large, set to %u\n", ino,
+		       ip->i_size, UX_MAXSIZE);
+		ip->i_size = UX_MAXSIZE;
+		ino_dirty(ino);
+	}
+	pass1_xattr(ino);
+	if (ip->i_atime_ns >= 1000000000 || ip->i_mtime_ns >= 1000000000 ||
+	    ip->i_ctime_ns >= 1000000000) {
+		report("Inode %u: bad timestamp nanoseconds, cleared\n", ino);
+		if (ip->i_atime_ns >= 1000000000)
+			ip->i_atime_ns = 0;
+		if (ip->i_mtime_ns >= 1000000000)
+			ip->i_mtime_ns = 0;
+		if (ip->i_ctime_ns >= 1000000000)
+			ip->i_ctime_ns = 0;
+		ino_dirty(ino);
+	}
+	if (ip->i_flags & ~UX_FL_USER_MODIFIABLE) {
+		report("Inode %u: unknown flags 0x%x, cleared\n", ino,
+		       ip->i_flags & ~UX_FL_USER_MODIFIABLE);
+		ip->i_flags &= UX_FL_USER_MODIFIABLE;
+		ino_dirty(ino);
+	}
+	/* Compressed clusters stay allocated up to the end of the last. */
+	end = ip->i_size;
+	if (S_ISREG(ip->i_mode) && (ip->i_flags & UX_COMPR_FL))
+		end = (end + UX_CLUSTER_SIZE - 1) / UX_CLUSTER_SIZE *
+		      UX_CLUSTER_SIZE;
+	if (ip->i_cmap && (!S_ISREG(ip->i_mode) ||
+			   !(ip->i_flags & UX_COMPR_FL) ||
+			   ip->i_cmap >> (end / UX_CLUSTER_SIZE))) {
+		report("Inode %u: bad compressed cluster map 0x%x, "
+		       "cleared\n", ino, ip->i_cmap);
+		ip->i_cmap = 0;
+		ino_dirty(ino);
+	}
+	for (b = 0; b < UX_DIRECT_BLOCKS; b++) {
+		a = ip->i_addr[b];
+		if (!a)
+			continue;
+		if (a < UX_FIRST_DATA_BLOCK ||
+		    a >= UX_FIRST_DATA_BLOCK + nblocks) {
+			report("Inode %u: bad block %u, cleared\n", ino, a);
+			ip->i_addr[b] = 0;
+			ino_dirty(ino);
+		} else if (S_ISREG(ip->i_mode) && (__u32)b * UX_BSIZE >= end) {
+			report("Inode %u: block %u past end of file, "
+			       "released\n", ino, a);
+			ip->i_addr[b] = 0;
+			ino_dirty(ino);
+		}
+	}
+}
+
+/*
+ * Cloned regular files may share a block, each mapping holding one
+ * reference. Directory and xattr spill blocks have a single owner.
+ */
+static int may_share(__u32 a, __u32 ino)
+{
+	__u32 i = a - UX_FIRST_DATA_BLOCK;
+
+	return !spill[i] && S_ISREG(ux_ino(ino)->i_mode) &&
+	       S_ISREG(ux_ino(owner[i])->i_mode) &&
+	       nrefs[i] < UX_BLOCK_MAXREF;
+}
+
+/*
+ * Hand each block to the inodes that reference it and fix up
+ * block counts. Directories must map a contiguous prefix of i_addr[].
+ */
+static void pass1_owners(void)
+{
+	struct ux_inode *ip;
+	__u32 ino, a, n, size;
+	int b;
+
+	for (ino = UX_ROOT_INO; ino < UX_NINODES; ino++) {
+		if (!allocated[ino])
+			continue;
+		ip = ux_ino(ino);
+		for (b = 0; b < UX_DIRECT_BLOCKS; b++) {
+			a = ip->i_addr[b];
+			if (!a)
+				continue;
+			if (owner[a - UX_FIRST_DATA_BLOCK] &&
+			    !may_share(a, ino)) {
+				report("Inode %u: block %u already claimed "
+				       "by inode %u, cleared\n", ino, a,
+				       owner[a - UX_FIRST_DATA_BLOCK]);
+				ip->i_addr[b] = 0;
+				ino_dirty(ino);
+				continue;
+			}
+			if (!owner[a - UX_FIRST_DATA_BLOCK])
+				owner[a - UX_FIRST_DATA_BLOCK] = ino;
+			nrefs[a - UX_FIRST_DATA_BLOCK]++;
+		}
+
+		/* An xattr spill block is never shared. */
+		a = ux_xattr(ino)->x_magic == UX_XATTR_MAGIC ?
+		    ux_xattr(ino)->x_spill : 0;
+		if (a && owner[a - UX_FIRST_DATA_BLOCK]) {
+			report("Inode %u: xattr block %u already claimed by "
+			       "inode %u, dropped\n", ino, a,
+			       owner[a - UX_FIRST_DATA_BLOCK]);
+			ux_xattr(ino)->x_spill = 0;
+			ino_dirty(ino);
+		} else if (a) {
+			owner[a - UX_FIRST_DATA_BLOCK] = ino;
+			nrefs[a - UX_FIRST_DATA_BLOCK] = 1;
+			spill[a - UX_FIRST_DATA_BLOCK] = 1;
+		}
+
+		if (S_ISREG(ip->i_mode)) {
+			for (n = 0, b = 0; b < UX_DIRECT_BLOCKS; b++)
+				n += ip->i_addr[b] != 0;
+			if (ip->i_blocks != n * (UX_BSIZE / 512)) {
+				report("Inode %u: i_blocks %u, should be %u\n",
+				       ino, ip->i_blocks, n * (UX_BSIZE / 512));
+				ip->i_blocks = n * (UX_BSIZE / 512);
+				ino_dirty(ino);
+			}
+			continue;
+		}
+
+		for (n = 0; n < UX_DIRECT_BLOCKS && ip->i_addr[n]; n++)
+			;
+		for (b = n; b < UX_DIRECT_BLOCKS; b++) {
+			a = ip->i_addr[b];
+			if (!a)
+				continue;
+			report("Directory %u: block %u after a hole, "
+			       "released\n", ino, a);
+			release_block(a);
+			ip->i_addr[b] = 0;
+			ino_dirty(ino);
+		}
+		if (n == 0) {
+			report("Directory %u: no blocks, cleared\n", ino);
+			free_inode(ino);
+			continue;
+		}
+		if (ip->i_blocks != n) {
+			report("Directory %u: i_blocks %u, should be %u\n",
+			       ino, ip->i_blocks, n);
+			ip->i_blocks = n;
+			ino_dirty(ino);
+		}
+		size = ip->i_size - ip->i_size % sizeof(struct ux_dirent);
+		if (size > n * UX_BSIZE)
+			size = n * UX_BSIZE;
+		if (ip->i_size != size) {
+			report("Directory %u: size %u, should be %u\n",
+			       ino, ip->i_size, size);
+			ip->i_size = size;
+			ino_dirty(ino);
+		}
+	}
+}
+
+/*
+ * Read every directory block, coalescing nearby blocks into one read.
+ */
+struct fsck_span {
+	__u32	start;
+	__u32	count;
+	char	*buf;
+};
+
+static struct fsck_span	spans[UX_MAXBLOCKS];
+static __u32		nspans;
+
+static void read_span(__u32 i)
+{
+	struct fsck_span *sp = &spans[i];
+	size_t len = (size_t)sp->count * UX_BSIZE;
+
+	if (pread(devfd, sp->buf, len, (off_t)(sp->start + UX_FIRST_DATA_BLOCK) *
+		  UX_BSIZE) != len) {
+		fprintf(stderr, "uxfsck: read error at block %u\n",
+			sp->start + UX_FIRST_DATA_BLOCK);
+		exit(8);
+	}
+}
+
+static void read_dir_blocks(void)
+{
+	struct fsck_span *sp = NULL;
+	__u32 i, j;
+
+	for (i = 0; i < UX_MAXBLOCKS; i++) {
+		if (!owner[i] || !S_ISDIR(ux_ino(owner[i])->i_mode))
+			continue;
+		if (sp && i - (sp->start + sp->count) <= FSCK_GAP) {
+			sp->count = i - sp->start + 1;
+			continue;
+		}
+		sp = &spans[nspans++];
+		sp->start = i;
+		sp->count = 1;
+	}
+	for (i = 0; i < nspans; i++) {
+		sp = &spans[i];
+		sp->buf = malloc((size_t)sp->count * UX_BSIZE);
+		if (!sp->buf) {
+			fprintf(stderr, "uxfsck: out of memory\n");
+			exit(8);
+		}
+		for (j = 0; j < sp->count; j++)
+			dblock[sp->start + j] = sp->buf + j * UX_BSIZE;
+	}
+	run_parallel(read_span, nspans);
+}
+
+/*
+ * Pass 2: check the entries of each directory on their own.
+ */
+static void pass2_dir(__u32 ino)
+{
+	struct ux_inode *ip = ux_ino(ino);
+	struct ux_dirent *de, *de2;
+	__u32 slot, s2, nslots;
+	const char *bad;
+	size_t len;
+
+	if (!is_dir(ino))
+		return;
+	nslots = ip->i_size / sizeof(struct ux_dirent);
+	for (slot = 0; slot < nslots; slot++) {
+		de = dir_slot(ip, slot);
+		if (!de->d_ino)
+			continue;
+		len = strnlen(de->d_name, UX_NAMELEN);
+		bad = NULL;
+		if (de->d_ino >= UX_NINODES || !allocated[de->d_ino])
+			bad = "unallocated inode";
+		else if (len == 0 || memchr(de->d_name, '/', len))
+			bad = "bad name";
+		if (bad) {
+			report("Directory %u: entry '%.*s' -> %u: %s, "
+			       "cleared\n", ino, (int)len, de->d_name,
+			       de->d_ino, bad);
+			clear_slot(ip, slot);
+			continue;
+		}
+		if (is_dot(de)) {
+			if (de->d_ino != ino) {
+				report("Directory %u: '.' -> %u, fixed\n",
+				       ino, de->d_ino);
+				de->d_ino = ino;
+				slot_dirty(ip, slot);
+			}
+			continue;
+		}
+		for (s2 = 0; s2 < slot; s2++) {
+			de2 = dir_slot(ip, s2);
+			if (de2->d_ino && !strncmp(de->d_name, de2->d_name,
+						   UX_NAMELEN))
+				break;
+		}
+		if (s2 < slot) {
+			report("Directory %u: duplicate entry '%.*s', "
+			       "cleared\n", ino, (int)len, de->d_name);
+			clear_slot(ip, slot);
+		}
+	}
+}
+
+static struct ux_dirent *dir_lookup(__u32 ino, const char *name, __u32 *slotp)
+{
+	struct ux_inode *ip = ux_ino(ino);
+	struct ux_dirent *de;
+	__u32 slot;
+
+	for (slot = 0; slot < ip->i_size / sizeof(struct ux_dirent); slot++) {
+		de = dir_slot(ip, slot);
+		if (de->d_ino && !strncmp(de->d_name, name, UX_NAMELEN)) {
+			if (slotp)
+				*slotp = slot;
+			return de;
+		}
+	}
+	return NULL;
+}
+
+static int dir_add(__u32 ino, const char *name, __u32 child)
+{
+	struct ux_inode *ip = ux_ino(ino);
+	struct ux_dirent *de;
+	__u32 slot, nslots = ip->i_size / sizeof(struct ux_dirent);
+	__u32 i, n = ip->i_blocks;
+
+	for (slot = 0; slot < nslots; slot++) {
+		if (!dir_slot(ip, slot)->d_ino)
+			goto found;
+	}
+	if (slot == n * UX_DIR_PER_BLK) {
+		if (n == UX_DIRECT_BLOCKS)
+			return -1;
+		for (i = 0; i < nblocks && owner[i]; i++)
+			;
+		if (i == nblocks)
+			return -1;
+		dblock[i] = calloc(1, UX_BSIZE);
+		if (!dblock[i])
+			return -1;
+		owner[i] = ino;
+		nrefs[i] = 1;
+		ip->i_addr[n] = i + UX_FIRST_DATA_BLOCK;
+		ip->i_blocks++;
+	}
+	ip->i_size += sizeof(struct ux_dirent);
+	ino_dirty(ino);
+found:
+	de = dir_slot(ip, slot);
+	memset(de, 0, sizeof(*de));
+	de->d_ino = child;
+	memcpy(de->d_name, name, strnlen(name, UX_NAMELEN));
+	slot_dirty(ip, slot);
+	return 0;
+}
+
+/*
+ * Pass 3: walk the tree from the root. Every directory keeps only its
+ * first link; later ones are cleared.
+ */
+static void walk(__u32 top)
+{
+	static __u32 stack[UX_NINODES];
+	struct ux_inode *ip;
+	struct ux_dirent *de;
+	__u32 dir, slot, sp = 0;
+
+	reachable[top] = 1;
+	stack[sp++] = top;
+	while (sp) {
+		dir = stack[--sp];
+		ip = ux_ino(dir);
+		for (slot = 0; slot < ip->i_size / sizeof(*de); slot++) {
+			de = dir_slot(ip, slot);
+			if (!de->d_ino || is_dot(de) || is_dotdot(de))
+				continue;
+			if (!is_dir(de->d_ino)) {
+				reachable[de->d_ino] = 1;
+				continue;
+			}
+			if (reachable[de->d_ino]) {
+				report("Directory %u: extra link '%.*s' to "
+				       "directory %u, cleared\n", dir,
+				       UX_NAMELEN, de->d_name, de->d_ino);
+				clear_slot(ip, slot);
+				continue;
+			}
+			reachable[de->d_ino] = 1;
+			parent[de->d_ino] = dir;
+			stack[sp++] = de->d_ino;
+		}
+	}
+}
+
+static void reconnect(__u32 lf, __u32 ino)
+{
+	struct ux_inode *ip = ux_ino(ino);
+	char name[UX_NAMELEN];
+
+	if (ip->i_nlink == 0) {
+		report("Inode %u: unlinked and unreferenced, freed\n", ino);
+		free_inode(ino);
+		return;
+	}
+	snprintf(name, sizeof(name), "#%u", ino);
+	if (!lf || dir_add(lf, name, ino)) {
+		report("Inode %u: unreferenced, cannot reconnect\n", ino);
+		unfixed++;
+		return;
+	}
+	report("Inode %u: unreferenced, moved to lost+found\n", ino);
+	if (S_ISDIR(ip->i_mode)) {
+		parent[ino] = lf;
+		walk(ino);
+	} else {
+		reachable[ino] = 1;
+	}
+}
+
+static void pass3(void)
+{
+	struct ux_dirent *de;
+	__u32 ino, slot, lf = 0;
+
+	parent[UX_ROOT_INO] = UX_ROOT_INO;
+	walk(UX_ROOT_INO);
+
+	de = dir_lookup(UX_ROOT_INO, "lost+found", NULL);
+	if (de && is_dir(de->d_ino))
+		lf = de->d_ino;
+	for (ino = UX_ROOT_INO; ino < UX_NINODES; ino++) {
+		if (is_dir(ino) && !reachable[ino])
+			reconnect(lf, ino);
+	}
+	for (ino = UX_ROOT_INO; ino < UX_NINODES; ino++) {
+		if (allocated[ino] && !reachable[ino])
+			reconnect(lf, ino);
+	}
+
+	for (ino = UX_ROOT_INO; ino < UX_NINODES; ino++) {
+		if (!is_dir(ino) || !reachable[ino])
+			continue;
+		if (!dir_lookup(ino, ".", NULL)) {
+			report("Directory %u: missing '.', added\n", ino);
+			if (dir_add(ino, ".", ino))
+				unfixed++;
+		}
+		de = dir_lookup(ino, "..", &slot);
+		if (!de) {
+			report("Directory %u: missing '..', added\n", ino);
+			if (dir_add(ino, "..", parent[ino]))
+				unfixed++;
+		} else if (de->d_ino != parent[ino]) {
+			report("Directory %u: '..' -> %u, should be %u\n",
+			       ino, de->d_ino, parent[ino]);
+			de->d_ino = parent[ino];
+			slot_dirty(ux_ino(ino), slot);
+		}
+	}
+}
+
+/*
+ * Pass 4: count the links to every inode and fix i_nlink.
+ */
+static void pass4_dir(__u32 ino)
+{
+	struct ux_inode *ip = ux_ino(ino);
+	struct ux_dirent *de;
+	__u32 slot;
+
+	if (!is_dir(ino) || !reachable[ino])
+		return;
+	for (slot = 0; slot < ip->i_size / sizeof(*de); slot++) {
+		de = dir_slot(ip, slot);
+		if (de->d_ino)
+			__atomic_add_fetch(&refs[de->d_ino], 1,
+					   __ATOMIC_RELAXED);
+	}
+}
+
+static void pass4(void)
+{
+	struct ux_inode *ip;
+	__u32 ino;
+
+	run_parallel(pass4_dir, UX_NINODES);
+	for (ino = UX_ROOT_INO; ino < UX_NINODES; ino++) {
+		ip = ux_ino(ino);
+		if (!allocated[ino] || ip->i_nlink == refs[ino])
+			continue;
+		report("Inode %u: link count %u, should be %u\n", ino,
+		       ip->i_nlink, refs[ino]);
+		ip->i_nlink = refs[ino];
+		ino_dirty(ino);
+	}
+}
+
+/*
+ * Pass 5: rebuild the allocation maps from what was found.
+ */
+static void pass5(void)
+{
+	__u32 i, nfree = 0, ndiff = 0, had = usb->s_features & UX_FEATURE_RFREE;
+	__u16 rfree[UX_NREGIONS];
+	__u8 want;
+
+	for (i = 0; i < UX_MAXFILES; i++) {
+		if (i < UX_ROOT_INO || i >= UX_NINODES || allocated[i])
+			want = UX_INODE_INUSE;
+		else
+			want = UX_INODE_FREE;
+		if (usb->s_inode[i] != want) {
+			usb->s_inode[i] = want;
+			ndiff++;
+		}
+		nfree += want == UX_INODE_FREE;
+	}
+	if (ndiff)
+		report("Inode map: %u entries wrong, fixed\n", ndiff);
+	for (i = 0; i < UX_NINODES; i++) {
+		if (allocated[i] && !(usb->s_inoinit & (1U << i))) {
+			report("Inode %u: table block not marked "
+			       "initialised, fixed\n", i);
+			usb->s_inoinit |= 1U << i;
+		}
+	}
+	/* Orphans have been freed or trimmed by the passes above. */
+	if (usb->s_orphan) {
+		report("Orphan list 0x%x processed, cleared\n", usb->s_orphan);
+		usb->s_orphan = 0;
+	}
+	if (usb->s_nifree != nfree) {
+		report("Free inode count %u, should be %u\n", usb->s_nifree,
+		       nfree);
+		usb->s_nifree = nfree;
+	}
+
+	nfree = ndiff = 0;
+	for (i = 0; i < UX_MAXBLOCKS; i++) {
+		if (i >= nblocks)
+			want = UX_BLOCK_INUSE;
+		else
+			want = nrefs[i];
+		if (usb->s_block[i] != want) {
+			usb->s_block[i] = want;
+			ndiff++;
+		}
+		nfree += want == UX_BLOCK_FREE;
+	}
+	if (ndiff)
+		report("Block map: %u entries wrong, fixed\n", ndiff);
+	if (usb->s_nbfree != nfree) {
+		report("Free block count %u, should be %u\n", usb->s_nbfree,
+		       nfree);
+		usb->s_nbfree = nfree;
+	}
+	memcpy(rfree, usb->s_rfree, sizeof(rfree));
+	ux_count_regions(usb);
+	/* Older images have no counts yet; they are just added. */
+	if (had && memcmp(rfree, usb->s_rfree, sizeof(rfree)))
+		report("Region free counts wrong, fixed\n");
+}
+
+static void write_back(void)
+{
+	__u32 i;
+
+	usb->s_mod = UX_FSCLEAN;
+	meta_dirty[0] = 1;
+	for (i = 0; i < UX_FIRST_DATA_BLOCK; i++) {
+		if (meta_dirty[i] && pwrite(devfd, meta + i * UX_BSIZE,
+					    UX_BSIZE, (off_t)i * UX_BSIZE) !=
+		    UX_BSIZE)
+			goto fail;
+	}
+	for (i = 0; i < UX_MAXBLOCKS; i++) {
+		if (dblock_dirty[i] && pwrite(devfd, dblock[i], UX_BSIZE,
+					      (off_t)(i + UX_FIRST_DATA_BLOCK) *
+					      UX_BSIZE) != UX_BSIZE)
+			goto fail;
+	}
+	if (fsync(devfd) == 0)
+		return;
+fail:
+	fprintf(stderr, "uxfsck: write error\n");
+	exit(8);
+}
+
+int main(int argc, char **argv)
+{
+	__u32 i, ninodes = 0, nused = 0;
+	int c;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "nj:")) != -1) {
+		switch (c) {
+		case 'n':
+			nflag = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > FSCK_MAXTHREADS)
+		nthreads = FSCK_MAXTHREADS;
+
+	devfd = open(argv[optind], nflag ? O_RDONLY : O_RDWR);
+	if (devfd < 0) {
+		fprintf(stderr, "uxfsck: Failed to open device\n");
+		exit(8);
+	}
+	if (pread(devfd, meta, sizeof(meta), 0) != sizeof(meta)) {
+		fprintf(stderr, "uxfsck: Unable to read inode table\n");
+		exit(8);
+	}
+	if (usb->s_magic != UX_MAGIC) {
+		fprintf(stderr, "uxfsck: Not a uxfs filesystem\n");
+		exit(8);
+	}
+	nblocks = ux_nblocks(usb);
+	if (usb->s_inode[UX_ROOT_INO] != UX_INODE_INUSE ||
+	    !S_ISDIR(ux_ino(UX_ROOT_INO)->i_mode)) {
+		fprintf(stderr, "uxfsck: Root inode is not a directory, "
+			"cannot repair\n");
+		exit(4);
+	}
+
+	run_parallel(pass1_inode, UX_NINODES);
+	pass1_owners();
+	read_dir_blocks();
+	run_parallel(pass2_dir, UX_NINODES);
+	pass3();
+	pass4();
+	pass5();
+
+	for (i = 0; i < UX_NINODES; i++)
+		ninodes += allocated[i];
+	for (i = 0; i < UX_MAXBLOCKS; i++)
+		nused += owner[i] != 0;
+	printf("%s: %u/%u inodes, %u/%u blocks\n", argv[optind],
+	       ninodes, UX_NINODES - UX_ROOT_INO, nused, nblocks);
+
+	if (nflag)
+		return problems ? 4 : 0;
+	if (problems || usb->s_mod != UX_FSCLEAN)
+		write_back();
+	if (unfixed)
+		return 4;
+	return problems ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: uxfsck [-n] [-j threads] device\n");
+	exit(8);
+}
@@ -0,0 +1,1916 @@
+/*
+ * uxfuse - serve a uxfs image through FUSE.
+ *
+ * The daemon runs on the multithreaded FUSE loop. The allocation maps
+ * in the superblock are protected by their own mutexes and every inode
+ * carries a read/write lock, so operations on different files never
+ * contend. Written data moves from /dev/fuse to the image with splice
+ * wherever the kernel supports it; reads are copied under the inode
+ * lock (see uxf_read_buf).
+ *
+ * Lock order: directory inode, then the inode it names, then the
+ * inode or block allocation mutex. The superblock writeback mutex is
+ * only ever taken with no inode locks held. Renames are serialised by
+ * their own mutex, taken first, and lock an ancestor directory before
+ * its descendant.
+ */
+
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <zlib.h>
+#include "ux_fs.h"
+
+#define UX_MAXSIZE	(UX_DIRECT_BLOCKS * UX_BSIZE)
+
+struct uxf_inode {
+	pthread_rwlock_t	lock;
+	int			nopen;
+	struct ux_inode		di;
+};
+
+struct uxf_fs {
+	int			fd;
+	pthread_mutex_t		sb_lock;	/* superblock writeback */
+	pthread_mutex_t		rename_lock;	/* the shape of the tree */
+	pthread_mutex_t		ialloc_lock;	/* s_inode[], s_nifree */
+	pthread_mutex_t		balloc_lock;	/* s_block[], s_nbfree, hint */
+	int			sb_dirty;
+	int			rdonly;		/* immutable image */
+	int			nblocks;
+	int			bhint;		/* no free block below this */
+	struct ux_superblock	sb;
+	struct uxf_inode	inodes[UX_NINODES];
+};
+
+static struct uxf_fs uxf;
+static const char uxf_zero[UX_BSIZE];
+
+#define UXF_ATIME	1
+#define UXF_MTIME	2
+#define UXF_CTIME	4
+
+/* Set the chosen timestamps of an inode to now, to the nanosecond. */
+static void uxf_touch(struct ux_inode *di, int which)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (which & UXF_ATIME) {
+		di->i_atime = ts.tv_sec;
+		di->i_atime_ns = ts.tv_nsec;
+	}
+	if (which & UXF_MTIME) {
+		di->i_mtime = ts.tv_sec;
+		di->i_mtime_ns = ts.tv_nsec;
+	}
+	if (which & UXF_CTIME) {
+		di->i_ctime = ts.tv_sec;
+		di->i_ctime_ns = ts.tv_nsec;
+	}
+}
+
+static int uxf_bwrite(__u32 blk, const void *buf, size_t len, off_t off)
+{
+	if (pwrite(uxf.fd, buf, len, (off_t)blk * UX_BSIZE + off) != len)
+		return -EIO;
+	return 0;
+}
+
+static int uxf_bread(__u32 blk, void *buf)
+{
+	if (pread(uxf.fd, buf, UX_BSIZE, (off_t)blk * UX_BSIZE) != UX_BSIZE)
+		return -EIO;
+	return 0;
+}
+
+static int uxf_write_inode(__u32 ino)
+{
+	return uxf_bwrite(UX_INODE_BLOCK + ino, &uxf.inodes[ino].di,
+			  sizeof(struct ux_inode), 0);
+}
+
+static int uxf_write_super(int state)
+{
+	struct ux_superblock sb;
+	int err = 0;
+
+	pthread_mutex_lock(&uxf.sb_lock);
+	pthread_mutex_lock(&uxf.ialloc_lock);
+	pthread_mutex_lock(&uxf.balloc_lock);
+	sb = uxf.sb;
+	uxf.sb_dirty = 0;
+	pthread_mutex_unlock(&uxf.balloc_lock);
+	pthread_mutex_unlock(&uxf.ialloc_lock);
+	sb.s_mod = state;
+	ux_count_regions(&sb);
+	if (pwrite(uxf.fd, &sb, sizeof(sb), 0) != sizeof(sb))
+		err = -EIO;
+	pthread_mutex_unlock(&uxf.sb_lock);
+	return err;
+}
+
+/*
+ * Block allocation is first-fit, as in the kernel. bhint only skips
+ * the prefix of the map that is known to be full.
+ */
+static int uxf_new_block(__u32 *blkp)
+{
+	int i;
+
+	pthread_mutex_lock(&uxf.balloc_lock);
+	for (i = uxf.bhint; i < uxf.nblocks; i++) {
+		if (uxf.sb.s_block[i] == UX_BLOCK_FREE)
+			break;
+	}
+	uxf.bhint = i;
+	if (i == uxf.nblocks) {
+		pthread_mutex_unlock(&uxf.balloc_lock);
+		return -ENOSPC;
+	}
+	uxf.sb.s_block[i] = UX_BLOCK_INUSE;
+	uxf.sb.s_nbfree--;
+	uxf.sb_dirty = 1;
+	pthread_mutex_unlock(&uxf.balloc_lock);
+	*blkp = i + UX_FIRST_DATA_BLOCK;
+	return 0;
+}
+
+/*
+ * s_block[] counts the files sharing each block since clones were
+ * added; the block is freed when its last reference goes.
+ */
+static void uxf_free_block(__u32 blk)
+{
+	int i = blk - UX_FIRST_DATA_BLOCK;
+
+	if (blk < UX_FIRST_DATA_BLOCK || i >= uxf.nblocks)
+		return;
+	pthread_mutex_lock(&uxf.balloc_lock);
+	if (uxf.sb.s_block[i] > UX_BLOCK_INUSE) {
+		uxf.sb.s_block[i]--;
+		uxf.sb_dirty = 1;
+	} else if (uxf.sb.s_block[i] == UX_BLOCK_INUSE) {
+		uxf.sb.s_block[i] = UX_BLOCK_FREE;
+		uxf.sb.s_nbfree++;
+		uxf.sb_dirty = 1;
+		if (i < uxf.bhint)
+			uxf.bhint = i;
+	}
+	pthread_mutex_unlock(&uxf.balloc_lock);
+}
+
+/*
+ * Give ip a private copy of block b if it shares it with a clone
+ * made by the kernel driver. Called with ip write-locked.
+ */
+static int uxf_unshare_block(struct uxf_inode *ip, int b)
+{
+	char data[UX_BSIZE];
+	__u32 old = ip->di.i_addr[b], blk;
+	int shared, err;
+
+	if (old < UX_FIRST_DATA_BLOCK || old - UX_FIRST_DATA_BLOCK >= uxf.nblocks)
+		return 0;
+	pthread_mutex_lock(&uxf.balloc_lock);
+	shared = uxf.sb.s_block[old - UX_FIRST_DATA_BLOCK] > UX_BLOCK_INUSE;
+	pthread_mutex_unlock(&uxf.balloc_lock);
+	if (!shared)
+		return 0;
+	err = uxf_new_block(&blk);
+	if (err)
+		return err;
+	err = uxf_bread(old, data);
+	if (!err)
+		err = uxf_bwrite(blk, data, UX_BSIZE, 0);
+	if (err) {
+		uxf_free_block(blk);
+		return err;
+	}
+	uxf_free_block(old);
+	ip->di.i_addr[b] = blk;
+	return 0;
+}
+
+/*
+ * Read compressed cluster c of ip into out, UX_CLUSTER_SIZE bytes.
+ * Called with ip locked.
+ */
+static int uxf_read_cluster(struct uxf_inode *ip, int c, char *out)
+{
+	char zbuf[UX_CLUSTER_SIZE];
+	__u32 *slot = ip->di.i_addr + c * UX_CLUSTER_BLOCKS, clen;
+	uLongf olen = UX_CLUSTER_SIZE;
+	int n;
+
+	memset(out, 0, UX_CLUSTER_SIZE);
+	for (n = 0; n < UX_CLUSTER_BLOCKS - 1 && slot[n]; n++) {
+		if (uxf_bread(slot[n], zbuf + n * UX_BSIZE))
+			return -EIO;
+	}
+	memcpy(&clen, zbuf, sizeof(clen));
+	if (!n || clen > n * UX_BSIZE - sizeof(clen) ||
+	    uncompress((Bytef *)out, &olen, (Bytef *)zbuf + sizeof(clen),
+		       clen) != Z_OK)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Store compressed cluster c of ip uncompressed, so that it can be
+ * written in place; the kernel driver compresses it again at its next
+ * writeback. New blocks are written before the old ones are reused.
+ * Called with ip write-locked.
+ */
+static int uxf_expand_cluster(struct uxf_inode *ip, int c)
+{
+	char data[UX_CLUSTER_SIZE];
+	__u32 *slot = ip->di.i_addr + c * UX_CLUSTER_BLOCKS, blk;
+	off_t left = ip->di.i_size - (off_t)c * UX_CLUSTER_SIZE;
+	int i, n, fresh = 0, err;
+
+	err = uxf_read_cluster(ip, c, data);
+	if (err)
+		return err;
+	if (left > UX_CLUSTER_SIZE)
+		left = UX_CLUSTER_SIZE;
+	n = (left + UX_BSIZE - 1) / UX_BSIZE;
+	for (i = 0; i < n && !err; i++) {
+		if (slot[i])
+			continue;
+		err = uxf_new_block(&blk);
+		if (!err) {
+			slot[i] = blk;
+			fresh |= 1 << i;
+		}
+	}
+	for (i = n - 1; i >= 0 && !err; i--)
+		err = uxf_bwrite(slot[i], data + i * UX_BSIZE, UX_BSIZE, 0);
+	for (i = 0; i < n; i++) {
+		if (!(fresh & (1 << i)))
+			continue;
+		if (err) {
+			uxf_free_block(slot[i]);
+			slot[i] = 0;
+		} else {
+			ip->di.i_blocks += UX_BSIZE / 512;
+		}
+	}
+	if (!err)
+		ip->di.i_cmap &= ~(1U << c);
+	return err;
+}
+
+/*
+ * Allocate an inode and return it write-locked and initialised, but
+ * not yet written to disk.
+ */
+static int uxf_new_inode(mode_t mode, __u32 *inop)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	struct uxf_inode *ip;
+	__u32 ino;
+	int zero;
+
+	pthread_mutex_lock(&uxf.ialloc_lock);
+	for (ino = 3; ino < UX_NINODES; ino++) {
+		if (uxf.sb.s_inode[ino] == UX_INODE_FREE)
+			break;
+	}
+	if (ino == UX_NINODES) {
+		pthread_mutex_unlock(&uxf.ialloc_lock);
+		return -ENOSPC;
+	}
+	uxf.sb.s_inode[ino] = UX_INODE_INUSE;
+	uxf.sb.s_nifree--;
+	zero = !(uxf.sb.s_inoinit & (1U << ino));
+	uxf.sb.s_inoinit |= 1U << ino;
+	uxf.sb_dirty = 1;
+	pthread_mutex_unlock(&uxf.ialloc_lock);
+
+	/* The table block is zeroed the first time the inode is used. */
+	if (zero && uxf_bwrite(UX_INODE_BLOCK + ino, uxf_zero, UX_BSIZE, 0)) {
+		pthread_mutex_lock(&uxf.ialloc_lock);
+		uxf.sb.s_inode[ino] = UX_INODE_FREE;
+		uxf.sb.s_nifree++;
+		uxf.sb.s_inoinit &= ~(1U << ino);
+		pthread_mutex_unlock(&uxf.ialloc_lock);
+		return -EIO;
+	}
+
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	memset(&ip->di, 0, sizeof(ip->di));
+	ip->di.i_mode = mode;
+	ip->di.i_nlink = 1;
+	ip->di.i_uid = ctx->uid;
+	ip->di.i_gid = ctx->gid;
+	uxf_touch(&ip->di, UXF_ATIME | UXF_MTIME | UXF_CTIME);
+	ip->nopen = 0;
+	*inop = ino;
+	return 0;
+}
+
+/*
+ * Release blocks past size and zero the tail of the new last block so
+ * that a later extension reads back zeroes. Called with ip write-locked.
+ */
+static int uxf_truncate_blocks(struct uxf_inode *ip, off_t size)
+{
+	int c, i, err, first = (size + UX_BSIZE - 1) / UX_BSIZE;
+
+	if (size > UX_MAXSIZE)
+		return -EFBIG;
+	/* A compressed cluster cut in two is expanded first. */
+	c = size / UX_CLUSTER_SIZE;
+	if (size % UX_CLUSTER_SIZE && size < ip->di.i_size &&
+	    (ip->di.i_cmap & (1U << c))) {
+		err = uxf_expand_cluster(ip, c);
+		if (err)
+			return err;
+	}
+	ip->di.i_cmap &= (1U << (size + UX_CLUSTER_SIZE - 1) /
+			  UX_CLUSTER_SIZE) - 1;
+	for (i = first; i < UX_DIRECT_BLOCKS; i++) {
+		if (!ip->di.i_addr[i])
+			continue;
+		uxf_free_block(ip->di.i_addr[i]);
+		ip->di.i_addr[i] = 0;
+		ip->di.i_blocks -= UX_BSIZE / 512;
+	}
+	if (size < ip->di.i_size && size % UX_BSIZE &&
+	    ip->di.i_addr[size / UX_BSIZE]) {
+		err = uxf_unshare_block(ip, size / UX_BSIZE);
+		if (err)
+			return err;
+		return uxf_bwrite(ip->di.i_addr[size / UX_BSIZE], uxf_zero,
+				  UX_BSIZE - size % UX_BSIZE, size % UX_BSIZE);
+	}
+	return 0;
+}
+
+/*
+ * Extended attributes, in the layout the kernel driver uses: an area
+ * at the end of the inode's table block, spilling into one data block.
+ * Both are read and written with the inode locked.
+ */
+static struct ux_xattr_entry *uxf_xattr_entry(char *p, char *end)
+{
+	struct ux_xattr_entry *e = (struct ux_xattr_entry *)p;
+
+	if (p + sizeof(*e) > end || !e->e_name_len ||
+	    p + UX_XATTR_SIZE(e->e_name_len, e->e_value_len) > end)
+		return NULL;
+	return e;
+}
+
+#define UXF_XATTR_NEXT(p, e) \
+	((p) += UX_XATTR_SIZE((e)->e_name_len, (e)->e_value_len))
+
+/*
+ * Read the inline area, and the spill block into spill if there is
+ * one. Returns the spill block number, 0 or a negative error.
+ */
+static int uxf_xattr_read(__u32 ino, char *area, char *spill)
+{
+	struct ux_xattr_header *xh = (struct ux_xattr_header *)area;
+
+	memset(spill, 0, UX_BSIZE);
+	if (pread(uxf.fd, area, UX_XATTR_INLINE,
+		  (off_t)(UX_INODE_BLOCK + ino) * UX_BSIZE + UX_XATTR_OFFSET) !=
+	    UX_XATTR_INLINE)
+		return -EIO;
+	if (xh->x_magic != UX_XATTR_MAGIC) {
+		memset(area, 0, UX_XATTR_INLINE);
+		return 0;
+	}
+	if (!xh->x_spill)
+		return 0;
+	if (xh->x_spill < UX_FIRST_DATA_BLOCK ||
+	    xh->x_spill >= UX_FIRST_DATA_BLOCK + uxf.nblocks ||
+	    uxf_bread(xh->x_spill, spill))
+		return -EIO;
+	return xh->x_spill;
+}
+
+/* Drop the attributes of an inode being freed. */
+static void uxf_xattr_clear(__u32 ino)
+{
+	char area[UX_XATTR_INLINE], spill[UX_BSIZE];
+	int blk;
+
+	blk = uxf_xattr_read(ino, area, spill);
+	if (blk > 0)
+		uxf_free_block(blk);
+	uxf_bwrite(UX_INODE_BLOCK + ino, uxf_zero, UX_XATTR_INLINE,
+		   UX_XATTR_OFFSET);
+}
+
+/*
+ * Free an inode whose last link and last open reference are gone.
+ * Called with ip write-locked.
+ */
+static void uxf_evict(__u32 ino)
+{
+	struct uxf_inode *ip = &uxf.inodes[ino];
+	int i;
+
+	for (i = 0; i < UX_DIRECT_BLOCKS; i++) {
+		if (ip->di.i_addr[i])
+			uxf_free_block(ip->di.i_addr[i]);
+	}
+	uxf_xattr_clear(ino);
+	memset(&ip->di, 0, sizeof(ip->di));
+	uxf_write_inode(ino);
+
+	pthread_mutex_lock(&uxf.ialloc_lock);
+	uxf.sb.s_inode[ino] = UX_INODE_FREE;
+	uxf.sb.s_nifree++;
+	uxf.sb.s_orphan &= ~(1U << ino);
+	uxf.sb_dirty = 1;
+	pthread_mutex_unlock(&uxf.ialloc_lock);
+}
+
+/*
+ * Record an inode that has lost its last link while still open, so
+ * that it is freed at the next mount if we never get to evict it.
+ */
+static void uxf_orphan(__u32 ino)
+{
+	pthread_mutex_lock(&uxf.ialloc_lock);
+	uxf.sb.s_orphan |= 1U << ino;
+	uxf.sb_dirty = 1;
+	pthread_mutex_unlock(&uxf.ialloc_lock);
+}
+
+/*
+ * Free the unlinked inodes and trim the truncated ones left on the
+ * orphan list by the last mount. Runs before the daemon starts.
+ */
+static void uxf_recover_orphans(void)
+{
+	struct uxf_inode *ip;
+	__u32 ino;
+
+	uxf.sb.s_orphan &= (1U << UX_NINODES) - 1;
+	while (uxf.sb.s_orphan) {
+		ino = ffs(uxf.sb.s_orphan) - 1;
+		uxf.sb.s_orphan &= ~(1U << ino);
+		uxf.sb_dirty = 1;
+		ip = &uxf.inodes[ino];
+		if (uxf.sb.s_inode[ino] != UX_INODE_INUSE)
+			continue;
+		if (ip->di.i_nlink == 0) {
+			uxf_evict(ino);
+		} else if (!S_ISDIR(ip->di.i_mode)) {
+			uxf_truncate_blocks(ip, ip->di.i_size);
+			uxf_write_inode(ino);
+		}
+	}
+}
+
+/*
+ * Directory helpers. A directory's i_size covers every slot up to the
+ * last live one; empty slots have d_ino == 0. Directories count
+ * i_blocks in filesystem blocks, matching the kernel.
+ */
+static int uxf_dir_find(struct uxf_inode *dir, const char *name, size_t len,
+			__u32 *inop, __u32 *slotp)
+{
+	struct ux_dirent de[UX_DIR_PER_BLK], *d;
+	__u32 nslots = dir->di.i_size / sizeof(struct ux_dirent);
+	__u32 slot;
+
+	for (slot = 0; slot < nslots; slot++) {
+		if (slot % UX_DIR_PER_BLK == 0 &&
+		    uxf_bread(dir->di.i_addr[slot / UX_DIR_PER_BLK], de))
+			return -EIO;
+		d = &de[slot % UX_DIR_PER_BLK];
+		if (d->d_ino && strnlen(d->d_name, UX_NAMELEN) == len &&
+		    memcmp(d->d_name, name, len) == 0) {
+			if (d->d_ino >= UX_NINODES)
+				return -EIO;
+			*inop = d->d_ino;
+			if (slotp)
+				*slotp = slot;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+static int uxf_dir_write(struct uxf_inode *dir, __u32 slot,
+			 const char *name, size_t len, __u32 ino)
+{
+	struct ux_dirent de;
+
+	memset(&de, 0, sizeof(de));
+	de.d_ino = ino;
+	memcpy(de.d_name, name, len);
+	return uxf_bwrite(dir->di.i_addr[slot / UX_DIR_PER_BLK], &de,
+			  sizeof(de), (slot % UX_DIR_PER_BLK) * sizeof(de));
+}
+
+static int uxf_dir_add(__u32 dino, const char *name, size_t len, __u32 ino)
+{
+	struct uxf_inode *dir = &uxf.inodes[dino];
+	struct ux_dirent de[UX_DIR_PER_BLK];
+	__u32 nslots = dir->di.i_size / sizeof(struct ux_dirent);
+	__u32 slot, blk;
+	int err;
+
+	for (slot = 0; slot < nslots; slot++) {
+		if (slot % UX_DIR_PER_BLK == 0 &&
+		    uxf_bread(dir->di.i_addr[slot / UX_DIR_PER_BLK], de))
+			return -EIO;
+		if (de[slot % UX_DIR_PER_BLK].d_ino == 0)
+			goto found;
+	}
+
+	if (slot % UX_DIR_PER_BLK == 0) {
+		if (slot / UX_DIR_PER_BLK >= UX_DIRECT_BLOCKS)
+			return -ENOSPC;
+		err = uxf_new_block(&blk);
+		if (err)
+			return err;
+		err = uxf_bwrite(blk, uxf_zero, UX_BSIZE, 0);
+		if (err) {
+			uxf_free_block(blk);
+			return err;
+		}
+		dir->di.i_addr[slot / UX_DIR_PER_BLK] = blk;
+		dir->di.i_blocks++;
+	}
+	dir->di.i_size += sizeof(struct ux_dirent);
+
+found:
+	err = uxf_dir_write(dir, slot, name, len, ino);
+	if (err)
+		return err;
+	uxf_touch(&dir->di, UXF_MTIME | UXF_CTIME);
+	return uxf_write_inode(dino);
+}
+
+/*
+ * Shrink a directory to end at its last live entry and free the blocks
+ * past it. Only empty tail slots go, so readdir offsets stay valid.
+ */
+static int uxf_dir_trim(struct uxf_inode *dir)
+{
+	struct ux_dirent de[UX_DIR_PER_BLK];
+	__u32 nslots = dir->di.i_size / sizeof(struct ux_dirent);
+	int b, nblks;
+
+	while (nslots > 0) {
+		if (nslots == dir->di.i_size / sizeof(struct ux_dirent) ||
+		    nslots % UX_DIR_PER_BLK == 0) {
+			if (uxf_bread(dir->di.i_addr[(nslots - 1) /
+					UX_DIR_PER_BLK], de))
+				return -EIO;
+		}
+		if (de[(nslots - 1) % UX_DIR_PER_BLK].d_ino)
+			break;
+		nslots--;
+	}
+	nblks = (nslots + UX_DIR_PER_BLK - 1) / UX_DIR_PER_BLK;
+	if (nblks < 1)
+		nblks = 1;
+	for (b = nblks; b < UX_DIRECT_BLOCKS; b++) {
+		if (!dir->di.i_addr[b])
+			continue;
+		uxf_free_block(dir->di.i_addr[b]);
+		dir->di.i_addr[b] = 0;
+		dir->di.i_blocks--;
+	}
+	dir->di.i_size = nslots * sizeof(struct ux_dirent);
+	return 0;
+}
+
+static int uxf_dir_remove(__u32 dino, __u32 slot)
+{
+	struct uxf_inode *dir = &uxf.inodes[dino];
+	int err;
+
+	err = uxf_dir_write(dir, slot, "", 0, 0);
+	if (err)
+		return err;
+	if ((slot + 1) * sizeof(struct ux_dirent) >= dir->di.i_size) {
+		err = uxf_dir_trim(dir);
+		if (err)
+			return err;
+	}
+	uxf_touch(&dir->di, UXF_MTIME | UXF_CTIME);
+	return uxf_write_inode(dino);
+}
+
+static int uxf_dir_empty(struct uxf_inode *dir)
+{
+	struct ux_dirent de[UX_DIR_PER_BLK], *d;
+	__u32 nslots = dir->di.i_size / sizeof(struct ux_dirent);
+	__u32 slot;
+
+	for (slot = 0; slot < nslots; slot++) {
+		if (slot % UX_DIR_PER_BLK == 0 &&
+		    uxf_bread(dir->di.i_addr[slot / UX_DIR_PER_BLK], de))
+			return -EIO;
+		d = &de[slot % UX_DIR_PER_BLK];
+		if (d->d_ino && strcmp(d->d_name, ".") &&
+		    strcmp(d->d_name, ".."))
+			return -ENOTEMPTY;
+	}
+	return 0;
+}
+
+/*
+ * Resolve the first len bytes of path. Each directory on the way is
+ * read-locked only while it is searched.
+ */
+static int uxf_namei(const char *path, size_t plen, __u32 *inop)
+{
+	const char *p = path, *end = path + plen, *next;
+	struct uxf_inode *dir;
+	__u32 ino = UX_ROOT_INO;
+	int err;
+
+	while (p < end) {
+		if (*p == '/') {
+			p++;
+			continue;
+		}
+		next = memchr(p, '/', end - p);
+		if (!next)
+			next = end;
+		if (next - p > UX_NAMELEN)
+			return -ENAMETOOLONG;
+		dir = &uxf.inodes[ino];
+		pthread_rwlock_rdlock(&dir->lock);
+		if (!S_ISDIR(dir->di.i_mode))
+			err = -ENOTDIR;
+		else
+			err = uxf_dir_find(dir, p, next - p, &ino, NULL);
+		pthread_rwlock_unlock(&dir->lock);
+		if (err)
+			return err;
+		p = next;
+	}
+	*inop = ino;
+	return 0;
+}
+
+static int uxf_lookup(const char *path, struct fuse_file_info *fi, __u32 *inop)
+{
+	if (fi && fi->fh) {
+		*inop = fi->fh;
+		return 0;
+	}
+	return uxf_namei(path, strlen(path), inop);
+}
+
+/*
+ * Split path into its parent directory and final component.
+ */
+static int uxf_parent(const char *path, __u32 *dinop, const char **namep,
+		      size_t *lenp)
+{
+	const char *slash = strrchr(path, '/');
+	int err;
+
+	if (!slash || !slash[1])
+		return -EINVAL;
+	*namep = slash + 1;
+	*lenp = strlen(slash + 1);
+	if (*lenp > UX_NAMELEN)
+		return -ENAMETOOLONG;
+	err = uxf_namei(path, slash - path, dinop);
+	if (!err && !S_ISDIR(uxf.inodes[*dinop].di.i_mode))
+		err = -ENOTDIR;
+	return err;
+}
+
+static void uxf_fill_stat(__u32 ino, const struct ux_inode *di, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_mode = di->i_mode;
+	st->st_nlink = di->i_nlink;
+	st->st_uid = di->i_uid;
+	st->st_gid = di->i_gid;
+	st->st_size = di->i_size;
+	st->st_blksize = UX_BSIZE;
+	if (S_ISDIR(di->i_mode))
+		st->st_blocks = di->i_blocks * (UX_BSIZE / 512);
+	else
+		st->st_blocks = di->i_blocks;
+	st->st_atim.tv_sec = di->i_atime;
+	st->st_atim.tv_nsec = di->i_atime_ns % 1000000000;
+	st->st_mtim.tv_sec = di->i_mtime;
+	st->st_mtim.tv_nsec = di->i_mtime_ns % 1000000000;
+	st->st_ctim.tv_sec = di->i_ctime;
+	st->st_ctim.tv_nsec = di->i_ctime_ns % 1000000000;
+}
+
+static int uxf_getattr(const char *path, struct stat *st,
+		       struct fuse_file_info *fi)
+{
+	struct uxf_inode *ip;
+	__u32 ino;
+	int err;
+
+	err = uxf_lookup(path, fi, &ino);
+	if (err)
+		return err;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_rdlock(&ip->lock);
+	if (ip->di.i_mode)
+		uxf_fill_stat(ino, &ip->di, st);
+	else
+		err = -ENOENT;
+	pthread_rwlock_unlock(&ip->lock);
+	return err;
+}
+
+static int uxf_opendir(const char *path, struct fuse_file_info *fi)
+{
+	__u32 ino;
+	int err;
+
+	err = uxf_namei(path, strlen(path), &ino);
+	if (err)
+		return err;
+	if (!S_ISDIR(uxf.inodes[ino].di.i_mode))
+		return -ENOTDIR;
+	fi->fh = ino;
+	return 0;
+}
+
+/*
+ * Directory offsets are slot numbers, so a reader can resume from any
+ * entry it was handed.
+ */
+static int uxf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t off, struct fuse_file_info *fi,
+		       enum fuse_readdir_flags flags)
+{
+	struct ux_dirent de[UX_DIR_PER_BLK], *d;
+	struct uxf_inode *dir;
+	char name[UX_NAMELEN + 1];
+	struct stat st;
+	__u32 ino, slot, nslots;
+	int err;
+
+	err = uxf_lookup(path, fi, &ino);
+	if (err)
+		return err;
+	dir = &uxf.inodes[ino];
+	pthread_rwlock_rdlock(&dir->lock);
+	nslots = dir->di.i_size / sizeof(struct ux_dirent);
+	for (slot = off; slot < nslots; slot++) {
+		if ((slot % UX_DIR_PER_BLK == 0 || slot == off) &&
+		    uxf_bread(dir->di.i_addr[slot / UX_DIR_PER_BLK], de)) {
+			err = -EIO;
+			break;
+		}
+		d = &de[slot % UX_DIR_PER_BLK];
+		if (!d->d_ino)
+			continue;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = d->d_ino;
+		memcpy(name, d->d_name, UX_NAMELEN);
+		name[UX_NAMELEN] = '\0';
+		if (filler(buf, name, &st, slot + 1, 0))
+			break;
+	}
+	pthread_rwlock_unlock(&dir->lock);
+	return err;
+}
+
+static int uxf_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	struct uxf_inode *dir;
+	const char *name;
+	size_t len;
+	__u32 dino, ino;
+	int err;
+
+	err = uxf_parent(path, &dino, &name, &len);
+	if (err)
+		return err;
+	dir = &uxf.inodes[dino];
+	pthread_rwlock_wrlock(&dir->lock);
+	if (uxf_dir_find(dir, name, len, &ino, NULL) == 0) {
+		err = -EEXIST;
+		goto out;
+	}
+	err = uxf_new_inode(S_IFREG | (mode & 07777), &ino);
+	if (err)
+		goto out;
+	uxf.inodes[ino].di.i_flags = dir->di.i_flags & UX_COMPR_FL;
+	err = uxf_write_inode(ino);
+	if (!err)
+		err = uxf_dir_add(dino, name, len, ino);
+	if (err) {
+		uxf_evict(ino);
+	} else {
+		uxf.inodes[ino].nopen = 1;
+		fi->fh = ino;
+	}
+	pthread_rwlock_unlock(&uxf.inodes[ino].lock);
+out:
+	pthread_rwlock_unlock(&dir->lock);
+	return err;
+}
+
+static int uxf_mkdir(const char *path, mode_t mode)
+{
+	struct ux_dirent de[UX_DIR_PER_BLK];
+	struct uxf_inode *dir, *ip;
+	const char *name;
+	size_t len;
+	__u32 dino, ino, blk;
+	int err;
+
+	err = uxf_parent(path, &dino, &name, &len);
+	if (err)
+		return err;
+	dir = &uxf.inodes[dino];
+	pthread_rwlock_wrlock(&dir->lock);
+	if (uxf_dir_find(dir, name, len, &ino, NULL) == 0) {
+		err = -EEXIST;
+		goto out;
+	}
+	mode = S_IFDIR | (mode & 07777);
+	if (dir->di.i_mode & S_ISGID)
+		mode |= S_ISGID;
+	err = uxf_new_inode(mode, &ino);
+	if (err)
+		goto out;
+	ip = &uxf.inodes[ino];
+	ip->di.i_flags = dir->di.i_flags & UX_COMPR_FL;
+	err = uxf_new_block(&blk);
+	if (err)
+		goto out_evict;
+	ip->di.i_addr[0] = blk;
+	ip->di.i_blocks = 1;
+	ip->di.i_nlink = 2;
+	ip->di.i_size = 2 * sizeof(struct ux_dirent);
+
+	memset(de, 0, sizeof(de));
+	de[0].d_ino = ino;
+	strcpy(de[0].d_name, ".");
+	de[1].d_ino = dino;
+	strcpy(de[1].d_name, "..");
+	err = uxf_bwrite(blk, de, UX_BSIZE, 0);
+	if (!err)
+		err = uxf_write_inode(ino);
+	if (!err)
+		err = uxf_dir_add(dino, name, len, ino);
+	if (err)
+		goto out_evict;
+	dir->di.i_nlink++;
+	err = uxf_write_inode(dino);
+	pthread_rwlock_unlock(&ip->lock);
+out:
+	pthread_rwlock_unlock(&dir->lock);
+	return err;
+
+out_evict:
+	uxf_evict(ino);
+	pthread_rwlock_unlock(&ip->lock);
+	goto out;
+}
+
+static int uxf_unlink(const char *path)
+{
+	struct uxf_inode *dir, *ip;
+	const char *name;
+	size_t len;
+	__u32 dino, ino, slot;
+	int err;
+
+	err = uxf_parent(path, &dino, &name, &len);
+	if (err)
+		return err;
+	dir = &uxf.inodes[dino];
+	pthread_rwlock_wrlock(&dir->lock);
+	err = uxf_dir_find(dir, name, len, &ino, &slot);
+	if (err)
+		goto out;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	if (S_ISDIR(ip->di.i_mode)) {
+		err = -EISDIR;
+		goto out_unlock;
+	}
+	err = uxf_dir_remove(dino, slot);
+	if (err)
+		goto out_unlock;
+	ip->di.i_nlink--;
+	uxf_touch(&ip->di, UXF_CTIME);
+	if (ip->di.i_nlink == 0 && ip->nopen == 0) {
+		uxf_evict(ino);
+	} else {
+		if (ip->di.i_nlink == 0)
+			uxf_orphan(ino);
+		err = uxf_write_inode(ino);
+	}
+out_unlock:
+	pthread_rwlock_unlock(&ip->lock);
+out:
+	pthread_rwlock_unlock(&dir->lock);
+	return err;
+}
+
+static int uxf_rmdir(const char *path)
+{
+	struct uxf_inode *dir, *ip;
+	const char *name;
+	size_t len;
+	__u32 dino, ino, slot;
+	int err;
+
+	err = uxf_parent(path, &dino, &name, &len);
+	if (err)
+		return err;
+	dir = &uxf.inodes[dino];
+	pthread_rwlock_wrlock(&dir->lock);
+	err = uxf_dir_find(dir, name, len, &ino, &slot);
+	if (err)
+		goto out;
+	if (ino == dino) {
+		err = -EINVAL;
+		goto out;
+	}
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	if (!S_ISDIR(ip->di.i_mode))
+		err = -ENOTDIR;
+	else
+		err = uxf_dir_empty(ip);
+	if (!err)
+		err = uxf_dir_remove(dino, slot);
+	if (!err) {
+		uxf_evict(ino);
+		dir->di.i_nlink--;
+		err = uxf_write_inode(dino);
+	}
+	pthread_rwlock_unlock(&ip->lock);
+out:
+	pthread_rwlock_unlock(&dir->lock);
+	return err;
+}
+
+static int uxf_link(const char *from, const char *to)
+{
+	struct uxf_inode *dir, *ip;
+	const char *name;
+	size_t len;
+	__u32 dino, ino, tino;
+	int err;
+
+	err = uxf_namei(from, strlen(from), &ino);
+	if (err)
+		return err;
+	err = uxf_parent(to, &dino, &name, &len);
+	if (err)
+		return err;
+	dir = &uxf.inodes[dino];
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&dir->lock);
+	if (uxf_dir_find(dir, name, len, &tino, NULL) == 0) {
+		err = -EEXIST;
+		goto out;
+	}
+	pthread_rwlock_wrlock(&ip->lock);
+	if (S_ISDIR(ip->di.i_mode))
+		err = -EPERM;
+	else if (ip->di.i_nlink == 0)
+		err = -ENOENT;
+	else
+		err = uxf_dir_add(dino, name, len, ino);
+	if (!err) {
+		ip->di.i_nlink++;
+		uxf_touch(&ip->di, UXF_CTIME);
+		err = uxf_write_inode(ino);
+	}
+	pthread_rwlock_unlock(&ip->lock);
+out:
+	pthread_rwlock_unlock(&dir->lock);
+	return err;
+}
+
+/*
+ * Is anc the same as ino or one of its ancestors? Walks up through
+ * "..", which only rename changes. Called with rename_lock held and
+ * no inode locks.
+ */
+static int uxf_is_ancestor(__u32 anc, __u32 ino)
+{
+	struct uxf_inode *dir;
+	__u32 parent;
+	int err;
+
+	for (;;) {
+		if (ino == anc)
+			return 1;
+		if (ino == UX_ROOT_INO)
+			return 0;
+		dir = &uxf.inodes[ino];
+		pthread_rwlock_rdlock(&dir->lock);
+		err = uxf_dir_find(dir, "..", 2, &parent, NULL);
+		pthread_rwlock_unlock(&dir->lock);
+		if (err || parent == ino)
+			return 0;
+		ino = parent;
+	}
+}
+
+/*
+ * Drop the link a rename took from the inode it replaced. Called with
+ * both locked.
+ */
+static int uxf_rename_victim(struct uxf_inode *ndir, __u32 ndino, __u32 tino)
+{
+	struct uxf_inode *tp = &uxf.inodes[tino];
+
+	uxf_touch(&tp->di, UXF_CTIME);
+	if (S_ISDIR(tp->di.i_mode)) {
+		ndir->di.i_nlink--;
+		uxf_evict(tino);
+		return uxf_write_inode(ndino);
+	}
+	if (--tp->di.i_nlink == 0 && tp->nopen == 0) {
+		uxf_evict(tino);
+		return 0;
+	}
+	if (tp->di.i_nlink == 0)
+		uxf_orphan(tino);
+	return uxf_write_inode(tino);
+}
+
+/*
+ * A rename within one directory rewrites the entry's name in place.
+ * Otherwise the entry is added to the new directory, or an existing
+ * target entry is pointed at the inode, and the old entry is removed.
+ * A directory that changes parent has its ".." rewritten.
+ */
+static int uxf_rename(const char *from, const char *to, unsigned int flags)
+{
+	struct uxf_inode *odir, *ndir, *ip, *tp = NULL;
+	const char *oname, *nname;
+	size_t olen, nlen;
+	__u32 odino, ndino, ino, tino, oslot, nslot, dslot, x;
+	int err, isdir, have_target;
+
+	if (flags & ~RENAME_NOREPLACE)
+		return -EINVAL;
+	pthread_mutex_lock(&uxf.rename_lock);
+retry:
+	err = uxf_parent(from, &odino, &oname, &olen);
+	if (!err)
+		err = uxf_parent(to, &ndino, &nname, &nlen);
+	if (!err)
+		err = uxf_namei(from, strlen(from), &ino);
+	if (err)
+		goto out;
+	isdir = S_ISDIR(uxf.inodes[ino].di.i_mode);
+	if (isdir && uxf_is_ancestor(ino, ndino)) {
+		err = -EINVAL;
+		goto out;
+	}
+	err = uxf_namei(to, strlen(to), &tino);
+	have_target = !err;
+	if (err && err != -ENOENT)
+		goto out;
+	err = 0;
+	if (have_target) {
+		if (tino == ino)
+			goto out;
+		if (flags & RENAME_NOREPLACE) {
+			err = -EEXIST;
+			goto out;
+		}
+		if (S_ISDIR(uxf.inodes[tino].di.i_mode) &&
+		    uxf_is_ancestor(tino, odino)) {
+			err = -ENOTEMPTY;
+			goto out;
+		}
+	}
+
+	odir = &uxf.inodes[odino];
+	ndir = &uxf.inodes[ndino];
+	if (odino == ndino) {
+		pthread_rwlock_wrlock(&odir->lock);
+	} else if (uxf_is_ancestor(odino, ndino)) {
+		pthread_rwlock_wrlock(&odir->lock);
+		pthread_rwlock_wrlock(&ndir->lock);
+	} else {
+		pthread_rwlock_wrlock(&ndir->lock);
+		pthread_rwlock_wrlock(&odir->lock);
+	}
+
+	/* Start over if a create or unlink got in since the checks. */
+	if (uxf_dir_find(odir, oname, olen, &x, &oslot) || x != ino ||
+	    (uxf_dir_find(ndir, nname, nlen, &x, &nslot) == 0) !=
+	    have_target || (have_target && x != tino)) {
+		pthread_rwlock_unlock(&odir->lock);
+		if (odino != ndino)
+			pthread_rwlock_unlock(&ndir->lock);
+		goto retry;
+	}
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	if (have_target) {
+		tp = &uxf.inodes[tino];
+		pthread_rwlock_wrlock(&tp->lock);
+		if (isdir && !S_ISDIR(tp->di.i_mode))
+			err = -ENOTDIR;
+		else if (!isdir && S_ISDIR(tp->di.i_mode))
+			err = -EISDIR;
+		else if (isdir)
+			err = uxf_dir_empty(tp);
+		if (err)
+			goto out_inodes;
+	}
+
+	if (have_target) {
+		err = uxf_dir_write(ndir, nslot, nname, nlen, ino);
+		if (!err)
+			err = uxf_rename_victim(ndir, ndino, tino);
+		if (!err)
+			err = uxf_dir_remove(odino, oslot);
+	} else if (odino == ndino) {
+		err = uxf_dir_write(odir, oslot, nname, nlen, ino);
+		if (!err) {
+			uxf_touch(&odir->di, UXF_MTIME | UXF_CTIME);
+			err = uxf_write_inode(odino);
+		}
+	} else {
+		err = uxf_dir_add(ndino, nname, nlen, ino);
+		if (!err)
+			err = uxf_dir_remove(odino, oslot);
+	}
+	if (!err && isdir && odino != ndino) {
+		err = uxf_dir_find(ip, "..", 2, &x, &dslot);
+		if (!err)
+			err = uxf_dir_write(ip, dslot, "..", 2, ndino);
+		if (!err) {
+			odir->di.i_nlink--;
+			ndir->di.i_nlink++;
+			err = uxf_write_inode(odino);
+		}
+		if (!err)
+			err = uxf_write_inode(ndino);
+	}
+	if (!err) {
+		uxf_touch(&ip->di, UXF_CTIME);
+		err = uxf_write_inode(ino);
+	}
+
+out_inodes:
+	if (tp)
+		pthread_rwlock_unlock(&tp->lock);
+	pthread_rwlock_unlock(&ip->lock);
+	pthread_rwlock_unlock(&odir->lock);
+	if (odino != ndino)
+		pthread_rwlock_unlock(&ndir->lock);
+out:
+	pthread_mutex_unlock(&uxf.rename_lock);
+	return err;
+}
+
+static int uxf_open(const char *path, struct fuse_file_info *fi)
+{
+	struct uxf_inode *ip;
+	__u32 ino;
+	int err;
+
+	err = uxf_namei(path, strlen(path), &ino);
+	if (err)
+		return err;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	if (!ip->di.i_mode)
+		err = -ENOENT;
+	else if (S_ISDIR(ip->di.i_mode))
+		err = -EISDIR;
+	else
+		ip->nopen++;
+	pthread_rwlock_unlock(&ip->lock);
+	fi->fh = ino;
+	return err;
+}
+
+static int uxf_release(const char *path, struct fuse_file_info *fi)
+{
+	struct uxf_inode *ip = &uxf.inodes[fi->fh];
+
+	pthread_rwlock_wrlock(&ip->lock);
+	if (--ip->nopen == 0 && ip->di.i_nlink == 0)
+		uxf_evict(fi->fh);
+	pthread_rwlock_unlock(&ip->lock);
+	return 0;
+}
+
+/*
+ * Hand FUSE a vector with one entry per physically contiguous run, so
+ * each run is a single pread. The runs are read while the inode lock
+ * is held: FUSE gives no word of when it has finished with a vector,
+ * so one left pointing at the image could be read after a truncate
+ * had freed the blocks and another file had reused them.
+ */
+static int uxf_read_buf(const char *path, struct fuse_bufvec **bufp,
+			size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct uxf_inode *ip = &uxf.inodes[fi->fh];
+	char cluster[UX_CLUSTER_SIZE];
+	struct fuse_bufvec *bv;
+	struct fuse_buf *b = NULL;
+	off_t pos, end, phys;
+	size_t i, len;
+	__u32 blk;
+	int c, err = 0;
+
+	bv = calloc(1, sizeof(*bv) + UX_DIRECT_BLOCKS * sizeof(struct fuse_buf));
+	if (!bv)
+		return -ENOMEM;
+
+	pthread_rwlock_rdlock(&ip->lock);
+	end = off + size;
+	if (end > ip->di.i_size)
+		end = ip->di.i_size;
+	for (pos = off; pos < end && !err; pos += len) {
+		c = pos / UX_CLUSTER_SIZE;
+		if (ip->di.i_cmap & (1U << c)) {
+			len = (off_t)(c + 1) * UX_CLUSTER_SIZE - pos;
+			if ((off_t)len > end - pos)
+				len = end - pos;
+			b = &bv->buf[bv->count++];
+			b->size = len;
+			b->fd = -1;
+			b->mem = malloc(len);
+			if (!b->mem)
+				err = -ENOMEM;
+			else
+				err = uxf_read_cluster(ip, c, cluster);
+			if (!err)
+				memcpy(b->mem, cluster + pos % UX_CLUSTER_SIZE,
+				       len);
+			continue;
+		}
+		len = UX_BSIZE - pos % UX_BSIZE;
+		if ((off_t)len > end - pos)
+			len = end - pos;
+		blk = ip->di.i_addr[pos / UX_BSIZE];
+		phys = (off_t)blk * UX_BSIZE + pos % UX_BSIZE;
+		if (b && blk && (b->flags & FUSE_BUF_IS_FD) &&
+		    b->pos + b->size == phys) {
+			b->size += len;
+			continue;
+		}
+		if (b && !blk && !(b->flags & FUSE_BUF_IS_FD) && !b->mem) {
+			b->size += len;
+			continue;
+		}
+		b = &bv->buf[bv->count++];
+		b->size = len;
+		if (blk) {
+			b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			b->fd = uxf.fd;
+			b->pos = phys;
+		} else {
+			b->fd = -1;
+		}
+	}
+	for (i = 0; i < bv->count && !err; i++) {
+		b = &bv->buf[i];
+		if (!(b->flags & FUSE_BUF_IS_FD))
+			continue;
+		b->flags = 0;
+		b->fd = -1;
+		b->mem = malloc(b->size);
+		if (!b->mem)
+			err = -ENOMEM;
+		else if (pread(uxf.fd, b->mem, b->size, b->pos) !=
+			 (ssize_t)b->size)
+			err = -EIO;
+	}
+	pthread_rwlock_unlock(&ip->lock);
+
+	for (i = 0; i < bv->count && !err; i++) {
+		b = &bv->buf[i];
+		if (b->mem)
+			continue;
+		b->mem = calloc(1, b->size);
+		if (!b->mem)
+			err = -ENOMEM;
+	}
+	if (err) {
+		for (i = 0; i < bv->count; i++)
+			free(bv->buf[i].mem);
+		free(bv);
+		return err;
+	}
+	if (bv->count == 0) {
+		bv->count = 1;
+		bv->buf[0].fd = -1;
+	}
+	*bufp = bv;
+	return 0;
+}
+
+/*
+ * Allocate every missing block in the range first so that the copy
+ * below can splice each physically contiguous run in one go. Blocks
+ * that will only be partly written are zeroed, shared ones are copied
+ * before they are written, and compressed clusters are expanded.
+ */
+static int uxf_write_buf(const char *path, struct fuse_bufvec *buf, off_t off,
+			 struct fuse_file_info *fi)
+{
+	struct uxf_inode *ip = &uxf.inodes[fi->fh];
+	struct fuse_bufvec dst;
+	off_t pos, end, len;
+	ssize_t res;
+	__u32 blk;
+	int b, err = 0;
+
+	if (off >= UX_MAXSIZE)
+		return -EFBIG;
+	end = off + fuse_buf_size(buf);
+	if (end > UX_MAXSIZE)
+		end = UX_MAXSIZE;
+
+	pthread_rwlock_wrlock(&ip->lock);
+	for (b = off / UX_CLUSTER_SIZE; (off_t)b * UX_CLUSTER_SIZE < end; b++) {
+		if (!(ip->di.i_cmap & (1U << b)))
+			continue;
+		err = uxf_expand_cluster(ip, b);
+		if (err) {
+			uxf_write_inode(fi->fh);
+			pthread_rwlock_unlock(&ip->lock);
+			return err;
+		}
+	}
+	for (b = off / UX_BSIZE; (off_t)b * UX_BSIZE < end; b++) {
+		if (ip->di.i_addr[b]) {
+			err = uxf_unshare_block(ip, b);
+			if (err) {
+				end = (off_t)b * UX_BSIZE;
+				break;
+			}
+			continue;
+		}
+		err = uxf_new_block(&blk);
+		if (!err && ((off_t)b * UX_BSIZE < off ||
+			     (off_t)(b + 1) * UX_BSIZE > end))
+			err = uxf_bwrite(blk, uxf_zero, UX_BSIZE, 0);
+		if (err) {
+			end = (off_t)b * UX_BSIZE;
+			break;
+		}
+		ip->di.i_addr[b] = blk;
+		ip->di.i_blocks += UX_BSIZE / 512;
+	}
+
+	for (pos = off; pos < end; pos += res) {
+		len = UX_BSIZE - pos % UX_BSIZE;
+		while (pos + len < end &&
+		       ip->di.i_addr[(pos + len) / UX_BSIZE] ==
+		       ip->di.i_addr[(pos + len) / UX_BSIZE - 1] + 1)
+			len += UX_BSIZE;
+		if (len > end - pos)
+			len = end - pos;
+		dst = FUSE_BUFVEC_INIT(len);
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = uxf.fd;
+		dst.buf[0].pos = (off_t)ip->di.i_addr[pos / UX_BSIZE] *
+				 UX_BSIZE + pos % UX_BSIZE;
+		res = fuse_buf_copy(&dst, buf, 0);
+		if (res <= 0) {
+			err = res ? res : -EIO;
+			break;
+		}
+	}
+
+	if (pos > off) {
+		if (pos > ip->di.i_size)
+			ip->di.i_size = pos;
+		uxf_touch(&ip->di, UXF_MTIME | UXF_CTIME);
+	}
+	if (err)
+		uxf_truncate_blocks(ip, ip->di.i_size);
+	uxf_write_inode(fi->fh);
+	pthread_rwlock_unlock(&ip->lock);
+	if (pos > off)
+		return pos - off;
+	return err ? err : -ENOSPC;
+}
+
+static int uxf_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	struct uxf_inode *ip;
+	__u32 ino;
+	int err;
+
+	err = uxf_lookup(path, fi, &ino);
+	if (err)
+		return err;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	if (S_ISDIR(ip->di.i_mode))
+		err = -EISDIR;
+	else
+		err = uxf_truncate_blocks(ip, size);
+	if (!err) {
+		ip->di.i_size = size;
+		uxf_touch(&ip->di, UXF_MTIME | UXF_CTIME);
+		err = uxf_write_inode(ino);
+	}
+	pthread_rwlock_unlock(&ip->lock);
+	return err;
+}
+
+static int uxf_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	struct uxf_inode *ip;
+	__u32 ino;
+	int err;
+
+	err = uxf_lookup(path, fi, &ino);
+	if (err)
+		return err;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	ip->di.i_mode = (ip->di.i_mode & S_IFMT) | (mode & 07777);
+	uxf_touch(&ip->di, UXF_CTIME);
+	err = uxf_write_inode(ino);
+	pthread_rwlock_unlock(&ip->lock);
+	return err;
+}
+
+static int uxf_chown(const char *path, uid_t uid, gid_t gid,
+		     struct fuse_file_info *fi)
+{
+	struct uxf_inode *ip;
+	__u32 ino;
+	int err;
+
+	err = uxf_lookup(path, fi, &ino);
+	if (err)
+		return err;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	if (uid != (uid_t)-1)
+		ip->di.i_uid = uid;
+	if (gid != (gid_t)-1)
+		ip->di.i_gid = gid;
+	uxf_touch(&ip->di, UXF_CTIME);
+	err = uxf_write_inode(ino);
+	pthread_rwlock_unlock(&ip->lock);
+	return err;
+}
+
+static int uxf_utimens(const char *path, const struct timespec tv[2],
+		       struct fuse_file_info *fi)
+{
+	struct uxf_inode *ip;
+	__u32 ino;
+	int err;
+
+	err = uxf_lookup(path, fi, &ino);
+	if (err)
+		return err;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	if (tv[0].tv_nsec == UTIME_NOW) {
+		uxf_touch(&ip->di, UXF_ATIME);
+	} else if (tv[0].tv_nsec != UTIME_OMIT) {
+		ip->di.i_atime = tv[0].tv_sec;
+		ip->di.i_atime_ns = tv[0].tv_nsec;
+	}
+	if (tv[1].tv_nsec == UTIME_NOW) {
+		uxf_touch(&ip->di, UXF_MTIME);
+	} else if (tv[1].tv_nsec != UTIME_OMIT) {
+		ip->di.i_mtime = tv[1].tv_sec;
+		ip->di.i_mtime_ns = tv[1].tv_nsec;
+	}
+	uxf_touch(&ip->di, UXF_CTIME);
+	err = uxf_write_inode(ino);
+	pthread_rwlock_unlock(&ip->lock);
+	return err;
+}
+
+static const char *uxf_xattr_prefix[] = {
+	[UX_XATTR_INDEX_USER]		= "user.",
+	[UX_XATTR_INDEX_TRUSTED]	= "trusted.",
+	[UX_XATTR_INDEX_SECURITY]	= "security.",
+};
+
+/* Map a full attribute name to its index and the name stored on disk. */
+static int uxf_xattr_index(const char *name, const char **rest)
+{
+	size_t len;
+	int i;
+
+	for (i = UX_XATTR_INDEX_USER; i <= UX_XATTR_INDEX_SECURITY; i++) {
+		len = strlen(uxf_xattr_prefix[i]);
+		if (!strncmp(name, uxf_xattr_prefix[i], len)) {
+			*rest = name + len;
+			if (!**rest)
+				return -EINVAL;
+			return strlen(*rest) > 255 ? -ERANGE : i;
+		}
+	}
+	return -EOPNOTSUPP;
+}
+
+static struct ux_xattr_entry *uxf_xattr_find(char *p, char *end, int index,
+					      const char *name)
+{
+	struct ux_xattr_entry *e;
+	size_t len = strlen(name);
+
+	for (; (e = uxf_xattr_entry(p, end)); UXF_XATTR_NEXT(p, e)) {
+		if (e->e_index == index && e->e_name_len == len &&
+		    !memcmp(e->e_name, name, len))
+			return e;
+	}
+	return NULL;
+}
+
+static int uxf_getxattr(const char *path, const char *name, char *value,
+			size_t size)
+{
+	char area[UX_XATTR_INLINE], spill[UX_BSIZE];
+	struct ux_xattr_entry *e;
+	struct uxf_inode *ip;
+	const char *rest;
+	__u32 ino;
+	int index, err;
+
+	index = uxf_xattr_index(name, &rest);
+	if (index < 0)
+		return index;
+	err = uxf_lookup(path, NULL, &ino);
+	if (err)
+		return err;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_rdlock(&ip->lock);
+	err = uxf_xattr_read(ino, area, spill);
+	pthread_rwlock_unlock(&ip->lock);
+	if (err < 0)
+		return err;
+
+	e = uxf_xattr_find(area + sizeof(struct ux_xattr_header),
+			   area + UX_XATTR_INLINE, index, rest);
+	if (!e)
+		e = uxf_xattr_find(spill, spill + UX_BSIZE, index, rest);
+	if (!e)
+		return -ENODATA;
+	if (size && size < e->e_value_len)
+		return -ERANGE;
+	if (size)
+		memcpy(value, e->e_name + e->e_name_len, e->e_value_len);
+	return e->e_value_len;
+}
+
+static int uxf_listxattr(const char *path, char *list, size_t size)
+{
+	char area[UX_XATTR_INLINE], spill[UX_BSIZE], *p, *end;
+	struct ux_xattr_entry *e;
+	struct uxf_inode *ip;
+	size_t plen, total = 0;
+	__u32 ino;
+	int pass, err;
+
+	err = uxf_lookup(path, NULL, &ino);
+	if (err)
+		return err;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_rdlock(&ip->lock);
+	err = uxf_xattr_read(ino, area, spill);
+	pthread_rwlock_unlock(&ip->lock);
+	if (err < 0)
+		return err;
+
+	for (pass = 0; pass < 2; pass++) {
+		p = pass ? spill : area + sizeof(struct ux_xattr_header);
+		end = pass ? spill + UX_BSIZE : area + UX_XATTR_INLINE;
+		for (; (e = uxf_xattr_entry(p, end)); UXF_XATTR_NEXT(p, e)) {
+			if (e->e_index < UX_XATTR_INDEX_USER ||
+			    e->e_index > UX_XATTR_INDEX_SECURITY)
+				continue;
+			plen = strlen(uxf_xattr_prefix[e->e_index]);
+			if (size && total + plen + e->e_name_len + 1 > size)
+				return -ERANGE;
+			if (size) {
+				memcpy(list + total,
+				       uxf_xattr_prefix[e->e_index], plen);
+				memcpy(list + total + plen, e->e_name,
+				       e->e_name_len);
+				list[total + plen + e->e_name_len] = '\0';
+			}
+			total += plen + e->e_name_len + 1;
+		}
+	}
+	return total;
+}
+
+/*
+ * Set or, with a NULL value, remove an attribute: gather every entry,
+ * edit the list and pack it back, inline first, as the kernel does.
+ */
+static int uxf_xattr_update(const char *path, const char *name,
+			    const char *value, size_t size, int flags)
+{
+	char area[UX_XATTR_INLINE], spill[UX_BSIZE];
+	char list[UX_XATTR_INLINE + 2 * UX_BSIZE];
+	char *end, *p, *ip_end, *sp_end;
+	struct ux_xattr_header *xh = (struct ux_xattr_header *)area;
+	struct ux_xattr_entry *e;
+	struct uxf_inode *ip;
+	const char *rest;
+	size_t esize, len;
+	__u32 ino, blk;
+	int index, old, err;
+
+	index = uxf_xattr_index(name, &rest);
+	if (index < 0)
+		return index;
+	len = strlen(rest);
+	if (value && UX_XATTR_SIZE(len, size) > UX_BSIZE)
+		return -ENOSPC;
+	err = uxf_lookup(path, NULL, &ino);
+	if (err)
+		return err;
+	ip = &uxf.inodes[ino];
+	pthread_rwlock_wrlock(&ip->lock);
+	old = uxf_xattr_read(ino, area, spill);
+	if (old < 0) {
+		err = old;
+		goto out;
+	}
+
+	memset(list, 0, sizeof(list));
+	end = list;
+	for (p = area + sizeof(*xh); (e = uxf_xattr_entry(p, area +
+	     UX_XATTR_INLINE)); UXF_XATTR_NEXT(p, e), end += esize) {
+		esize = UX_XATTR_SIZE(e->e_name_len, e->e_value_len);
+		memcpy(end, e, esize);
+	}
+	for (p = spill; (e = uxf_xattr_entry(p, spill + UX_BSIZE));
+	     UXF_XATTR_NEXT(p, e), end += esize) {
+		esize = UX_XATTR_SIZE(e->e_name_len, e->e_value_len);
+		memcpy(end, e, esize);
+	}
+
+	e = uxf_xattr_find(list, end, index, rest);
+	err = -EEXIST;
+	if (e && (flags & XATTR_CREATE))
+		goto out;
+	err = -ENODATA;
+	if (!e && (!value || (flags & XATTR_REPLACE)))
+		goto out;
+	if (e) {
+		esize = UX_XATTR_SIZE(e->e_name_len, e->e_value_len);
+		memmove(e, (char *)e + esize, end - ((char *)e + esize));
+		end -= esize;
+		memset(end, 0, esize);
+	}
+	if (value) {
+		e = (struct ux_xattr_entry *)end;
+		e->e_index = index;
+		e->e_name_len = len;
+		e->e_value_len = size;
+		memcpy(e->e_name, rest, len);
+		memcpy(e->e_name + len, value, size);
+		end += UX_XATTR_SIZE(len, size);
+	}
+
+	memset(area, 0, sizeof(area));
+	memset(spill, 0, sizeof(spill));
+	ip_end = area + sizeof(*xh);
+	sp_end = spill;
+	err = -ENOSPC;
+	for (p = list; p < end; p += esize) {
+		e = (struct ux_xattr_entry *)p;
+		esize = UX_XATTR_SIZE(e->e_name_len, e->e_value_len);
+		if (ip_end + esize <= area + UX_XATTR_INLINE) {
+			memcpy(ip_end, p, esize);
+			ip_end += esize;
+		} else if (sp_end + esize <= spill + UX_BSIZE) {
+			memcpy(sp_end, p, esize);
+			sp_end += esize;
+		} else {
+			goto out;
+		}
+	}
+	blk = old;
+	err = 0;
+	if (sp_end > spill && !blk)
+		err = uxf_new_block(&blk);
+	if (!err && sp_end > spill)
+		err = uxf_bwrite(blk, spill, UX_BSIZE, 0);
+	if (err) {
+		if (!old && blk)
+			uxf_free_block(blk);
+		goto out;
+	}
+	if (sp_end == spill && blk) {
+		uxf_free_block(blk);
+		blk = 0;
+	}
+	if (ip_end > area + sizeof(*xh) || blk) {
+		xh->x_magic = UX_XATTR_MAGIC;
+		xh->x_spill = blk;
+	}
+	err = uxf_bwrite(UX_INODE_BLOCK + ino, area, UX_XATTR_INLINE,
+			 UX_XATTR_OFFSET);
+	if (!err) {
+		uxf_touch(&ip->di, UXF_CTIME);
+		err = uxf_write_inode(ino);
+	}
+out:
+	pthread_rwlock_unlock(&ip->lock);
+	return err;
+}
+
+static int uxf_setxattr(const char *path, const char *name,
+			const char *value, size_t size, int flags)
+{
+	return uxf_xattr_update(path, name, value ? value : "", size, flags);
+}
+
+static int uxf_removexattr(const char *path, const char *name)
+{
+	return uxf_xattr_update(path, name, NULL, 0, 0);
+}
+
+static int uxf_statfs(const char *path, struct statvfs *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = UX_BSIZE;
+	st->f_frsize = UX_BSIZE;
+	st->f_blocks = uxf.nblocks;
+	st->f_files = UX_MAXFILES;
+	st->f_namemax = UX_NAMELEN;
+	pthread_mutex_lock(&uxf.ialloc_lock);
+	st->f_ffree = st->f_favail = uxf.sb.s_nifree;
+	pthread_mutex_unlock(&uxf.ialloc_lock);
+	pthread_mutex_lock(&uxf.balloc_lock);
+	st->f_bfree = st->f_bavail = uxf.sb.s_nbfree;
+	pthread_mutex_unlock(&uxf.balloc_lock);
+	return 0;
+}
+
+/*
+ * Inodes and data are written through, so only the allocation maps
+ * can be behind the image.
+ */
+static int uxf_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int err = 0;
+
+	if (uxf.sb_dirty)
+		err = uxf_write_super(UX_FSDIRTY);
+	if (fdatasync(uxf.fd) < 0 && !err)
+		err = -errno;
+	return err;
+}
+
+static void *uxf_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	cfg->use_ino = 1;
+	cfg->nullpath_ok = 1;
+	cfg->hard_remove = 1;
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+				       FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE);
+	if (!uxf.rdonly) {
+		uxf_write_super(UX_FSDIRTY);
+		fsync(uxf.fd);
+	}
+	return NULL;
+}
+
+static void uxf_destroy(void *private_data)
+{
+	if (!uxf.rdonly) {
+		uxf_write_super(UX_FSCLEAN);
+		fsync(uxf.fd);
+	}
+	close(uxf.fd);
+}
+
+static const struct fuse_operations uxf_ops = {
+	.init		= uxf_init,
+	.destroy	= uxf_destroy,
+	.getattr	= uxf_getattr,
+	.opendir	= uxf_opendir,
+	.readdir	= uxf_readdir,
+	.create		= uxf_create,
+	.mkdir		= uxf_mkdir,
+	.unlink		= uxf_unlink,
+	.rmdir		= uxf_rmdir,
+	.rename		= uxf_rename,
+	.link		= uxf_link,
+	.open		= uxf_open,
+	.release	= uxf_release,
+	.read_buf	= uxf_read_buf,
+	.write_buf	= uxf_write_buf,
+	.truncate	= uxf_truncate,
+	.chmod		= uxf_chmod,
+	.chown		= uxf_chown,
+	.utimens	= uxf_utimens,
+	.setxattr	= uxf_setxattr,
+	.getxattr	= uxf_getxattr,
+	.listxattr	= uxf_listxattr,
+	.removexattr	= uxf_removexattr,
+	.statfs		= uxf_statfs,
+	.fsync		= uxf_fsync,
+};
+
+/*
+ * An immutable image is opened read-only and mounted with -o ro, so
+ * the kernel turns away every change before it gets here.
+ */
+int main(int argc, char **argv)
+{
+	__u32 ino;
+	int i;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: uxfuse image mountpoint "
+			"[-o default_permissions,...]\n");
+		exit(1);
+	}
+	uxf.fd = open(argv[1], O_RDWR);
+	if (uxf.fd < 0) {
+		fprintf(stderr, "uxfuse: Failed to open %s\n", argv[1]);
+		exit(1);
+	}
+	if (pread(uxf.fd, &uxf.sb, sizeof(uxf.sb), 0) != sizeof(uxf.sb) ||
+	    uxf.sb.s_magic != UX_MAGIC) {
+		fprintf(stderr, "uxfuse: %s is not a uxfs image\n", argv[1]);
+		exit(1);
+	}
+	if (uxf.sb.s_mod == UX_FSDIRTY) {
+		fprintf(stderr, "uxfuse: Filesystem is not clean. "
+			"Run uxfsck!\n");
+		exit(1);
+	}
+
+	uxf.nblocks = ux_nblocks(&uxf.sb);
+	if (uxf.sb.s_features & UX_FEATURE_IMMUTABLE) {
+		uxf.rdonly = 1;
+		close(uxf.fd);
+		uxf.fd = open(argv[1], O_RDONLY);
+		if (uxf.fd < 0) {
+			fprintf(stderr, "uxfuse: Failed to open %s\n", argv[1]);
+			exit(1);
+		}
+	}
+
+	pthread_mutex_init(&uxf.sb_lock, NULL);
+	pthread_mutex_init(&uxf.rename_lock, NULL);
+	pthread_mutex_init(&uxf.ialloc_lock, NULL);
+	pthread_mutex_init(&uxf.balloc_lock, NULL);
+	for (ino = 0; ino < UX_NINODES; ino++) {
+		pthread_rwlock_init(&uxf.inodes[ino].lock, NULL);
+		if (ino < UX_ROOT_INO || uxf.sb.s_inode[ino] != UX_INODE_INUSE)
+			continue;
+		if (pread(uxf.fd, &uxf.inodes[ino].di, sizeof(struct ux_inode),
+			  (off_t)(UX_INODE_BLOCK + ino) * UX_BSIZE) !=
+		    sizeof(struct ux_inode)) {
+			fprintf(stderr, "uxfuse: Unable to read inode %u\n",
+				ino);
+			exit(1);
+		}
+	}
+	if (!S_ISDIR(uxf.inodes[UX_ROOT_INO].di.i_mode)) {
+		fprintf(stderr, "uxfuse: Root inode is not a directory\n");
+		exit(1);
+	}
+	if (!uxf.rdonly)
+		uxf_recover_orphans();
+
+	/* The image argument's slot takes -o ro, or is dropped. */
+	if (uxf.rdonly) {
+		argv[1] = "-oro";
+		return fuse_main(argc, argv, &uxf_ops, NULL);
+	}
+	for (i = 1; i < argc - 1; i++)
+		argv[i] = argv[i + 1];
+	return fuse_main(argc - 1, argv, &uxf_ops, NULL);
+}
@@ -0,0 +1,152 @@
+/*
+ * uxresize - grow a uxfs file system.
+ *
+ * Given a directory of a mounted file system, asks the driver to grow
+ * it online with UX_IOC_RESIZE. Given a device or image file, which
+ * must not be in use, rewrites the superblock directly; an image file
+ * is first extended to the requested size. The size is in blocks of
+ * the whole device, as for uxmkfs, and defaults to all of it.
+ *
+ * Only the data area grows, up to UX_MAXBLOCKS blocks. The inode
+ * table sits in front of it and keeps its size.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "ux_fs.h"
+
+static off_t device_blocks(int fd)
+{
+	struct stat st;
+	__u64 bytes;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if (!S_ISBLK(st.st_mode))
+		return st.st_size / UX_BSIZE;
+	if (ioctl(fd, BLKGETSIZE64, &bytes) < 0)
+		return -1;
+	return bytes / UX_BSIZE;
+}
+
+static int resize_online(const char *path, off_t want)
+{
+	__u32 nblocks = want ? want - UX_FIRST_DATA_BLOCK : 0;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || ioctl(fd, UX_IOC_RESIZE, &nblocks) < 0) {
+		fprintf(stderr, "uxresize: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	close(fd);
+	printf("uxresize: %s: %u data blocks\n", path, nblocks);
+	return 0;
+}
+
+/*
+ * A mounted block device can't be opened with O_EXCL. Nothing stops
+ * an image file being resized under uxfuse or a loop mount, though.
+ */
+static int resize_offline(const char *path, off_t want, int isblk)
+{
+	struct ux_superblock *usb;
+	char buf[UX_BSIZE];
+	off_t devblocks;
+	__u32 i, old, n;
+	int fd;
+
+	fd = open(path, O_RDWR | (isblk ? O_EXCL : 0));
+	if (fd < 0) {
+		fprintf(stderr, "uxresize: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (pread(fd, buf, UX_BSIZE, 0) != UX_BSIZE)
+		goto ioerr;
+	usb = (struct ux_superblock *)buf;
+	if (usb->s_magic != UX_MAGIC) {
+		fprintf(stderr, "uxresize: %s: Not a uxfs file system\n", path);
+		return 1;
+	}
+	if (usb->s_features & UX_FEATURE_IMMUTABLE) {
+		fprintf(stderr, "uxresize: %s: Image is immutable\n", path);
+		return 1;
+	}
+	if (usb->s_mod != UX_FSCLEAN) {
+		fprintf(stderr, "uxresize: %s: Not clean, run uxfsck first\n",
+			path);
+		return 1;
+	}
+
+	devblocks = device_blocks(fd);
+	if (devblocks < 0)
+		goto ioerr;
+	if (want > devblocks) {
+		if (isblk || ftruncate(fd, want * UX_BSIZE) < 0) {
+			fprintf(stderr, "uxresize: %s: Cannot grow to %ld"
+				" blocks\n", path, (long)want);
+			return 1;
+		}
+		devblocks = want;
+	}
+	if (!want)
+		want = devblocks;
+	if (want - UX_FIRST_DATA_BLOCK > UX_MAXBLOCKS)
+		want = UX_FIRST_DATA_BLOCK + UX_MAXBLOCKS;
+
+	old = ux_nblocks(usb);
+	n = want - UX_FIRST_DATA_BLOCK;
+	if (want < UX_FIRST_DATA_BLOCK || n < old) {
+		fprintf(stderr, "uxresize: %s: Cannot shrink below %u data"
+			" blocks\n", path, old);
+		return 1;
+	}
+	for (i = old; i < n; i++)
+		usb->s_block[i] = UX_BLOCK_FREE;
+	usb->s_nbfree += n - old;
+	usb->s_nblocks = n;
+	ux_count_regions(usb);
+	if (pwrite(fd, buf, UX_BSIZE, 0) != UX_BSIZE || fsync(fd) < 0)
+		goto ioerr;
+	close(fd);
+	printf("uxresize: %s: %u data blocks, was %u\n", path, n, old);
+	return 0;
+
+ioerr:
+	fprintf(stderr, "uxresize: %s: %s\n", path, strerror(errno));
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct stat st;
+	off_t want = 0;
+
+	if (argc != 2 && argc != 3)
+		goto usage;
+	if (argc == 3) {
+		want = atol(argv[2]);
+		if (want <= UX_FIRST_DATA_BLOCK)
+			goto usage;
+	}
+	if (stat(argv[1], &st) < 0) {
+		fprintf(stderr, "uxresize: %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	if (S_ISDIR(st.st_mode))
+		return resize_online(argv[1], want);
+	return resize_offline(argv[1], want, S_ISBLK(st.st_mode));
+
+usage:
+	fprintf(stderr, "usage: uxresize mountpoint|device [blocks]\n");
+	exit(1);
+}
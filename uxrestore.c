@@ -0,0 +1,364 @@
+/*
+ * uxrestore - rebuild a uxfs file system from a uxdump stream.
+ *
+ * Inodes keep their numbers, so directories come back as they were.
+ * The image is built in memory and written in one pass, with the
+ * blocks of each file laid out contiguously in inode order. Blocks
+ * shared between clones stay shared.
+ *
+ * Without -i the image is made afresh, and a regular file is extended
+ * to the size of the dumped file system if it is smaller. With -i an
+ * incremental dump is applied to an image restored from the dumps
+ * before it: inodes the stream keeps are carried over from the image,
+ * the others are replaced or dropped, and the whole image is laid out
+ * again. The image must not be mounted.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "ux_fs.h"
+
+#define RS_FROM_STREAM	0
+#define RS_FROM_IMAGE	1
+
+/* One block's contents, however many inodes refer to it. */
+struct rs_key {
+	int	src;		/* RS_FROM_* */
+	__u32	blk;		/* number on the dumped device or old image */
+	char	*data;
+	__u32	newblk;
+};
+
+struct rs_node {
+	int	state;		/* UX_DUMP_INODE, UX_DUMP_KEEP or 0 */
+	char	tblock[UX_BSIZE];
+	int	slot[UX_DIRECT_BLOCKS + 1];	/* keys; the last is spill */
+};
+
+static struct rs_key	keys[2 * UX_NINODES * (UX_DIRECT_BLOCKS + 1)];
+static int		nkeys;
+static struct rs_node	nodes[UX_NINODES];
+static char		*oldimg, *image;
+static __u32		nblocks;
+static FILE		*in;
+
+#define BLOCK(img, n)	((img) + (size_t)(n) * UX_BSIZE)
+
+static void fail(const char *msg, __u32 ino)
+{
+	fprintf(stderr, "uxrestore: inode %u: %s\n", ino, msg);
+	exit(1);
+}
+
+static void get(void *buf, size_t len)
+{
+	if (fread(buf, len, 1, in) != 1) {
+		fprintf(stderr, "uxrestore: Stream %s\n",
+			ferror(in) ? strerror(errno) : "truncated");
+		exit(1);
+	}
+}
+
+static int find_key(int src, __u32 blk)
+{
+	int k;
+
+	for (k = 0; k < nkeys; k++) {
+		if (keys[k].src == src && keys[k].blk == blk)
+			return k;
+	}
+	return -1;
+}
+
+static int add_key(int src, __u32 blk, char *data)
+{
+	int k = find_key(src, blk);
+
+	if (k >= 0)
+		return k;
+	keys[nkeys].src = src;
+	keys[nkeys].blk = blk;
+	keys[nkeys].data = data;
+	keys[nkeys].newblk = 0;
+	return nkeys++;
+}
+
+static off_t device_blocks(int fd)
+{
+	struct stat st;
+	__u64 bytes;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if (!S_ISBLK(st.st_mode))
+		return st.st_size / UX_BSIZE;
+	if (ioctl(fd, BLKGETSIZE64, &bytes) < 0)
+		return -1;
+	return bytes / UX_BSIZE;
+}
+
+/* Carry an unchanged inode and its blocks over from the old image. */
+static void keep_inode(__u32 ino)
+{
+	struct ux_superblock *usb = (struct ux_superblock *)oldimg;
+	struct rs_node *np = &nodes[ino];
+	struct ux_inode *di = (struct ux_inode *)np->tblock;
+	struct ux_xattr_header *xh;
+	__u32 blk;
+	int i;
+
+	if (!oldimg)
+		fail("incremental dump, restore it with -i", ino);
+	if (usb->s_inode[ino] != UX_INODE_INUSE ||
+	    !(usb->s_inoinit & (1U << ino)))
+		fail("kept by the dump but not in the image", ino);
+	memcpy(np->tblock, BLOCK(oldimg, UX_INODE_BLOCK + ino), UX_BSIZE);
+	xh = (struct ux_xattr_header *)(np->tblock + UX_XATTR_OFFSET);
+	for (i = 0; i <= UX_DIRECT_BLOCKS; i++) {
+		if (i < UX_DIRECT_BLOCKS)
+			blk = di->i_addr[i];
+		else
+			blk = xh->x_magic == UX_XATTR_MAGIC ? xh->x_spill : 0;
+		if (!blk)
+			continue;
+		if (blk < UX_FIRST_DATA_BLOCK ||
+		    blk >= UX_FIRST_DATA_BLOCK + nblocks)
+			fail("bad block in the image", ino);
+		np->slot[i] = add_key(RS_FROM_IMAGE, blk, BLOCK(oldimg, blk));
+	}
+}
+
+static void read_stream(void)
+{
+	struct ux_dump_rec r;
+	struct rs_node *np;
+	char *data;
+	int k;
+
+	for (;;) {
+		get(&r, sizeof(r));
+		if (r.r_type == UX_DUMP_END)
+			return;
+		if (r.r_ino < UX_ROOT_INO || r.r_ino >= UX_NINODES)
+			fail("out of range", r.r_ino);
+		np = &nodes[r.r_ino];
+		switch (r.r_type) {
+		case UX_DUMP_INODE:
+		case UX_DUMP_KEEP:
+			if (np->state)
+				fail("dumped twice", r.r_ino);
+			memset(np->slot, -1, sizeof(np->slot));
+			np->state = r.r_type;
+			if (r.r_type == UX_DUMP_KEEP)
+				keep_inode(r.r_ino);
+			else
+				get(np->tblock, UX_BSIZE);
+			break;
+		case UX_DUMP_DATA:
+		case UX_DUMP_SPILL:
+		case UX_DUMP_SHARE:
+			if (np->state != UX_DUMP_INODE ||
+			    r.r_index >= UX_DIRECT_BLOCKS)
+				fail("unexpected block", r.r_ino);
+			if (r.r_type == UX_DUMP_SHARE) {
+				k = find_key(RS_FROM_STREAM, r.r_blk);
+				if (k < 0)
+					fail("shares a block never sent",
+					     r.r_ino);
+			} else {
+				data = malloc(UX_BSIZE);
+				if (!data) {
+					fprintf(stderr, "uxrestore: Out of"
+						" memory\n");
+					exit(1);
+				}
+				get(data, UX_BSIZE);
+				k = add_key(RS_FROM_STREAM, r.r_blk, data);
+			}
+			np->slot[r.r_type == UX_DUMP_SPILL ?
+				 UX_DIRECT_BLOCKS : r.r_index] = k;
+			break;
+		default:
+			fail("unknown record", r.r_ino);
+		}
+	}
+}
+
+/*
+ * Hand out blocks in inode order and fill in the superblock.
+ */
+static void layout(void)
+{
+	struct ux_superblock *sb = (struct ux_superblock *)image;
+	struct ux_xattr_header *xh;
+	struct ux_inode *di;
+	struct rs_key *kp;
+	__u32 ino, next = 0, nused = 0;
+	int i;
+
+	for (ino = UX_ROOT_INO; ino < UX_NINODES; ino++) {
+		if (!nodes[ino].state)
+			continue;
+		nused++;
+		di = (struct ux_inode *)BLOCK(image, UX_INODE_BLOCK + ino);
+		memcpy(di, nodes[ino].tblock, UX_BSIZE);
+		xh = (struct ux_xattr_header *)((char *)di + UX_XATTR_OFFSET);
+		for (i = 0; i <= UX_DIRECT_BLOCKS; i++) {
+			if (nodes[ino].slot[i] < 0) {
+				if (i < UX_DIRECT_BLOCKS)
+					di->i_addr[i] = 0;
+				else if (xh->x_magic == UX_XATTR_MAGIC)
+					xh->x_spill = 0;
+				continue;
+			}
+			kp = &keys[nodes[ino].slot[i]];
+			if (!kp->newblk) {
+				if (next == nblocks)
+					fail("no room left in the image", ino);
+				kp->newblk = UX_FIRST_DATA_BLOCK + next++;
+				memcpy(BLOCK(image, kp->newblk), kp->data,
+				       UX_BSIZE);
+			} else if (sb->s_block[kp->newblk - UX_FIRST_DATA_BLOCK] ==
+				   UX_BLOCK_MAXREF) {
+				fail("block shared too often", ino);
+			}
+			sb->s_block[kp->newblk - UX_FIRST_DATA_BLOCK]++;
+			if (i < UX_DIRECT_BLOCKS)
+				di->i_addr[i] = kp->newblk;
+			else
+				xh->x_spill = kp->newblk;
+		}
+		sb->s_inode[ino] = UX_INODE_INUSE;
+		sb->s_inoinit |= 1U << ino;
+	}
+	if (!nodes[UX_ROOT_INO].state)
+		fail("root directory missing from the dump", UX_ROOT_INO);
+
+	sb->s_magic = UX_MAGIC;
+	sb->s_mod = UX_FSCLEAN;
+	sb->s_nifree = UX_NINODES - UX_ROOT_INO - nused;
+	sb->s_nbfree = nblocks - next;
+	sb->s_nblocks = nblocks;
+	if (oldimg)
+		sb->s_features = ((struct ux_superblock *)oldimg)->s_features;
+	for (i = 0; i < UX_MAXFILES; i++) {
+		if (i < UX_ROOT_INO || i >= UX_NINODES)
+			sb->s_inode[i] = UX_INODE_INUSE;
+		if (i < UX_ROOT_INO)
+			sb->s_inoinit |= 1U << i;
+	}
+	for (i = nblocks; i < UX_MAXBLOCKS; i++)
+		sb->s_block[i] = UX_BLOCK_INUSE;
+	ux_count_regions(sb);
+	printf("uxrestore: %u/%u data blocks, %u/%d inodes used\n", next,
+	       nblocks, nused, UX_NINODES - UX_ROOT_INO);
+}
+
+int main(int argc, char **argv)
+{
+	struct ux_dump_header	h;
+	struct ux_superblock	*usb;
+	char			*inname = NULL;
+	size_t			len;
+	off_t			devblocks;
+	int			incr = 0, fd, c;
+
+	while ((c = getopt(argc, argv, "f:i")) != -1) {
+		switch (c) {
+		case 'f':
+			inname = optarg;
+			break;
+		case 'i':
+			incr = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	in = stdin;
+	if (inname && !(in = fopen(inname, "r"))) {
+		fprintf(stderr, "uxrestore: %s: %s\n", inname, strerror(errno));
+		exit(1);
+	}
+	get(&h, sizeof(h));
+	if (h.h_magic != UX_DUMP_MAGIC || !h.h_nblocks ||
+	    h.h_nblocks > UX_MAXBLOCKS) {
+		fprintf(stderr, "uxrestore: Not a uxdump stream\n");
+		exit(1);
+	}
+
+	fd = open(argv[optind], O_RDWR | (incr ? 0 : O_CREAT), 0644);
+	if (fd < 0) {
+		fprintf(stderr, "uxrestore: %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+	devblocks = device_blocks(fd);
+	if (devblocks < 0)
+		goto ioerr;
+	if (incr) {
+		len = (size_t)(devblocks < UX_FIRST_DATA_BLOCK + UX_MAXBLOCKS ?
+			       devblocks : UX_FIRST_DATA_BLOCK + UX_MAXBLOCKS) *
+		      UX_BSIZE;
+		oldimg = malloc(len);
+		if (!oldimg || len < UX_FIRST_DATA_BLOCK * UX_BSIZE ||
+		    pread(fd, oldimg, len, 0) != (ssize_t)len)
+			goto ioerr;
+		usb = (struct ux_superblock *)oldimg;
+		if (usb->s_magic != UX_MAGIC || usb->s_mod != UX_FSCLEAN) {
+			fprintf(stderr, "uxrestore: %s: Not a clean uxfs"
+				" file system\n", argv[optind]);
+			exit(1);
+		}
+		nblocks = ux_nblocks(usb);
+		if ((size_t)(UX_FIRST_DATA_BLOCK + nblocks) * UX_BSIZE > len)
+			goto ioerr;
+	} else {
+		if (devblocks < UX_FIRST_DATA_BLOCK + h.h_nblocks) {
+			if (ftruncate(fd, (off_t)(UX_FIRST_DATA_BLOCK +
+				      h.h_nblocks) * UX_BSIZE) < 0) {
+				fprintf(stderr, "uxrestore: %s: Too small,"
+					" need %u blocks\n", argv[optind],
+					UX_FIRST_DATA_BLOCK + h.h_nblocks);
+				exit(1);
+			}
+			devblocks = UX_FIRST_DATA_BLOCK + h.h_nblocks;
+		}
+		nblocks = devblocks - UX_FIRST_DATA_BLOCK;
+		if (nblocks > UX_MAXBLOCKS)
+			nblocks = UX_MAXBLOCKS;
+	}
+
+	image = calloc(UX_FIRST_DATA_BLOCK + nblocks, UX_BSIZE);
+	if (!image) {
+		fprintf(stderr, "uxrestore: Out of memory\n");
+		exit(1);
+	}
+	read_stream();
+	layout();
+
+	len = (size_t)(UX_FIRST_DATA_BLOCK + nblocks) * UX_BSIZE;
+	if (pwrite(fd, image, len, 0) != (ssize_t)len || fsync(fd) < 0)
+		goto ioerr;
+	close(fd);
+	return 0;
+
+ioerr:
+	fprintf(stderr, "uxrestore: %s: I/O error\n", argv[optind]);
+	exit(1);
+
+usage:
+	fprintf(stderr, "usage: uxrestore [-i] [-f file] image\n");
+	exit(1);
+}
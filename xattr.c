@@ -0,0 +1,445 @@
+/*
+ * Extended attributes, kept in the tail of the inode's table block.
+ *
+ * uxfs_iget copies the inline area into i_xattr, so finding an
+ * attribute stored there costs no I/O. The spill block, used once the
+ * inline area is full, is read on demand. Changes gather every entry
+ * into one list, edit it and pack it back, inline first. i_xattr_sem
+ * keeps readers out while that happens.
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/xattr.h>
+#include <linux/security.h>
+#include "uxfs.h"
+
+#define UX_XATTR_ESIZE(e)	UX_XATTR_SIZE((e)->e_name_len, (e)->e_value_len)
+
+static const char *uxfs_xattr_prefix[] = {
+	[UX_XATTR_INDEX_USER]		= XATTR_USER_PREFIX,
+	[UX_XATTR_INDEX_TRUSTED]	= XATTR_TRUSTED_PREFIX,
+	[UX_XATTR_INDEX_SECURITY]	= XATTR_SECURITY_PREFIX,
+};
+
+/*
+ * Return the entry at p if a whole one lies before end, or NULL at
+ * the end of the list.
+ */
+static struct ux_xattr_entry *uxfs_xattr_entry(char *p, char *end)
+{
+	struct ux_xattr_entry *e = (struct ux_xattr_entry *)p;
+
+	if (p + sizeof(*e) > end || !e->e_name_len ||
+	    p + UX_XATTR_ESIZE(e) > end)
+		return NULL;
+	return e;
+}
+
+static struct ux_xattr_entry *uxfs_xattr_find(char *p, char *end, int index,
+					       const char *name, int len)
+{
+	struct ux_xattr_entry *e;
+
+	for (; (e = uxfs_xattr_entry(p, end)); p += UX_XATTR_ESIZE(e)) {
+		if (e->e_index == index && e->e_name_len == len &&
+		    !memcmp(e->e_name, name, len))
+			return e;
+	}
+	return NULL;
+}
+
+/* Append the entries between p and end to dst; returns the new end. */
+static char *uxfs_xattr_copy(char *dst, char *p, char *end)
+{
+	struct ux_xattr_entry *e;
+
+	for (; (e = uxfs_xattr_entry(p, end)); p += UX_XATTR_ESIZE(e)) {
+		memcpy(dst, e, UX_XATTR_ESIZE(e));
+		dst += UX_XATTR_ESIZE(e);
+	}
+	return dst;
+}
+
+static __u32 uxfs_xattr_spill(struct inode *inode)
+{
+	struct ux_xattr_header *xh;
+
+	xh = (struct ux_xattr_header *)uxfs_i(inode)->i_xattr;
+	return xh ? xh->x_spill : 0;
+}
+
+static int uxfs_xattr_read_spill(struct inode *inode, char *buf)
+{
+	struct ux_sb_info *sbi = uxfs_sb(inode->i_sb);
+	struct buffer_head *bh;
+	__u32 blk = uxfs_xattr_spill(inode);
+
+	if (blk < UX_FIRST_DATA_BLOCK ||
+	    blk >= UX_FIRST_DATA_BLOCK + sbi->s_nblocks) {
+		printk("uxfs: %s: inode %lu: bad xattr block %u\n",
+		       inode->i_sb->s_id, inode->i_ino, blk);
+		return -EIO;
+	}
+	bh = sb_bread(inode->i_sb, blk);
+	if (!bh)
+		return -EIO;
+	memcpy(buf, bh->b_data, UX_BSIZE);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Called by uxfs_iget with the inode's table block at hand.
+ */
+int uxfs_xattr_load(struct inode *inode, char *area)
+{
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	struct ux_xattr_header *xh = (struct ux_xattr_header *)area;
+
+	if (xh->x_magic != UX_XATTR_MAGIC)
+		return 0;
+	ux_inode->i_xattr = kmalloc(UX_XATTR_INLINE, GFP_NOFS);
+	if (!ux_inode->i_xattr)
+		return -ENOMEM;
+	memcpy(ux_inode->i_xattr, area, UX_XATTR_INLINE);
+	return 0;
+}
+
+/*
+ * Free the spill block of an inode being released, given the area in
+ * its table block, and clear the area for the next user of the slot.
+ */
+void uxfs_xattr_clear(struct super_block *sb, char *area)
+{
+	struct ux_sb_info *sbi = uxfs_sb(sb);
+	struct ux_xattr_header *xh = (struct ux_xattr_header *)area;
+	__u32 blk = xh->x_spill;
+
+	if (xh->x_magic == UX_XATTR_MAGIC && blk >= UX_FIRST_DATA_BLOCK &&
+	    blk < UX_FIRST_DATA_BLOCK + sbi->s_nblocks &&
+	    sbi->s_block[blk - UX_FIRST_DATA_BLOCK] != UX_BLOCK_FREE)
+		uxfs_free_block(sb, blk);
+	memset(area, 0, UX_XATTR_INLINE);
+}
+
+static int uxfs_xattr_get(struct inode *inode, int index, const char *name,
+			  void *buffer, size_t size)
+{
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	struct ux_xattr_entry *e = NULL;
+	char *spill = NULL;
+	int len = strlen(name), err = -ENODATA;
+
+	if (len > 255)
+		return -ERANGE;
+	down_read(&ux_inode->i_xattr_sem);
+	if (ux_inode->i_xattr)
+		e = uxfs_xattr_find(ux_inode->i_xattr +
+				    sizeof(struct ux_xattr_header),
+				    ux_inode->i_xattr + UX_XATTR_INLINE,
+				    index, name, len);
+	if (!e && uxfs_xattr_spill(inode)) {
+		err = -ENOMEM;
+		spill = kmalloc(UX_BSIZE, GFP_NOFS);
+		if (!spill)
+			goto out;
+		err = uxfs_xattr_read_spill(inode, spill);
+		if (err)
+			goto out;
+		e = uxfs_xattr_find(spill, spill + UX_BSIZE, index, name, len);
+		err = -ENODATA;
+	}
+	if (e) {
+		err = e->e_value_len;
+		if (buffer && size < e->e_value_len)
+			err = -ERANGE;
+		else if (buffer)
+			memcpy(buffer, e->e_name + e->e_name_len,
+			       e->e_value_len);
+	}
+out:
+	up_read(&ux_inode->i_xattr_sem);
+	kfree(spill);
+	return err;
+}
+
+/* Add the names between p and end to the list; returns its new length. */
+static ssize_t uxfs_xattr_names(char *p, char *end, char *buffer,
+				size_t size, ssize_t total)
+{
+	struct ux_xattr_entry *e;
+	const char *prefix;
+	size_t plen, n;
+
+	for (; (e = uxfs_xattr_entry(p, end)); p += UX_XATTR_ESIZE(e)) {
+		if (e->e_index >= ARRAY_SIZE(uxfs_xattr_prefix) ||
+		    !uxfs_xattr_prefix[e->e_index])
+			continue;
+		if (e->e_index == UX_XATTR_INDEX_TRUSTED &&
+		    !capable(CAP_SYS_ADMIN))
+			continue;
+		prefix = uxfs_xattr_prefix[e->e_index];
+		plen = strlen(prefix);
+		n = plen + e->e_name_len + 1;
+		if (buffer) {
+			if (total + n > size)
+				return -ERANGE;
+			memcpy(buffer + total, prefix, plen);
+			memcpy(buffer + total + plen, e->e_name, e->e_name_len);
+			buffer[total + n - 1] = '\0';
+		}
+		total += n;
+	}
+	return total;
+}
+
+ssize_t uxfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
+{
+	struct inode *inode = dentry->d_inode;
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	char *spill = NULL;
+	ssize_t total = 0;
+
+	down_read(&ux_inode->i_xattr_sem);
+	if (ux_inode->i_xattr)
+		total = uxfs_xattr_names(ux_inode->i_xattr +
+					 sizeof(struct ux_xattr_header),
+					 ux_inode->i_xattr + UX_XATTR_INLINE,
+					 buffer, size, 0);
+	if (total >= 0 && uxfs_xattr_spill(inode)) {
+		spill = kmalloc(UX_BSIZE, GFP_NOFS);
+		if (!spill)
+			total = -ENOMEM;
+		else if (uxfs_xattr_read_spill(inode, spill))
+			total = -EIO;
+		else
+			total = uxfs_xattr_names(spill, spill + UX_BSIZE,
+						 buffer, size, total);
+	}
+	up_read(&ux_inode->i_xattr_sem);
+	kfree(spill);
+	return total;
+}
+
+/*
+ * Set or, with a NULL value, remove an attribute. Everything that can
+ * fail is done before the inline area or the spill block is touched.
+ */
+static int uxfs_xattr_set(struct inode *inode, int index, const char *name,
+			  const void *value, size_t size, int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_inode_info *ux_inode = uxfs_i(inode);
+	struct ux_xattr_header *xh;
+	struct ux_xattr_entry *e;
+	struct buffer_head *bh = NULL, *sbh;
+	char *list, *end, *in, *sp, *p, *ip, *spp;
+	int len = strlen(name), esize, err;
+	__u32 spill, blk;
+
+	if (len > 255)
+		return -ERANGE;
+	if (value && UX_XATTR_SIZE(len, size) > UX_BSIZE)
+		return -ENOSPC;
+	/* The whole list, plus a new entry, then the two packed images. */
+	list = kzalloc(2 * UX_XATTR_INLINE + 3 * UX_BSIZE, GFP_NOFS);
+	if (!list)
+		return -ENOMEM;
+	in = list + UX_XATTR_INLINE + 2 * UX_BSIZE;
+	sp = in + UX_XATTR_INLINE;
+
+	down_write(&ux_inode->i_xattr_sem);
+	err = -ENOMEM;
+	if (!ux_inode->i_xattr)
+		ux_inode->i_xattr = kzalloc(UX_XATTR_INLINE, GFP_NOFS);
+	if (!ux_inode->i_xattr)
+		goto out;
+	err = -EIO;
+	if (!uxfs_raw_inode(sb, inode->i_ino, &bh))
+		goto out;
+
+	spill = uxfs_xattr_spill(inode);
+	end = uxfs_xattr_copy(list, ux_inode->i_xattr + sizeof(*xh),
+			      ux_inode->i_xattr + UX_XATTR_INLINE);
+	if (spill) {
+		err = uxfs_xattr_read_spill(inode, sp);
+		if (err)
+			goto out;
+		end = uxfs_xattr_copy(end, sp, sp + UX_BSIZE);
+		memset(sp, 0, UX_BSIZE);
+	}
+
+	e = uxfs_xattr_find(list, end, index, name, len);
+	err = -EEXIST;
+	if (e && (flags & XATTR_CREATE))
+		goto out;
+	err = -ENODATA;
+	if (!e && (!value || (flags & XATTR_REPLACE)))
+		goto out;
+	if (e) {
+		esize = UX_XATTR_ESIZE(e);
+		memmove(e, (char *)e + esize, end - ((char *)e + esize));
+		end -= esize;
+		memset(end, 0, esize);
+	}
+	if (value) {
+		e = (struct ux_xattr_entry *)end;
+		e->e_index = index;
+		e->e_name_len = len;
+		e->e_value_len = size;
+		memcpy(e->e_name, name, len);
+		memcpy(e->e_name + len, value, size);
+		end += UX_XATTR_ESIZE(e);
+	}
+
+	/* Pack: whatever fits inline stays there, the rest spills. */
+	ip = in + sizeof(*xh);
+	spp = sp;
+	err = -ENOSPC;
+	for (p = list; p < end; p += esize) {
+		esize = UX_XATTR_ESIZE((struct ux_xattr_entry *)p);
+		if (ip + esize <= in + UX_XATTR_INLINE) {
+			memcpy(ip, p, esize);
+			ip += esize;
+		} else if (spp + esize <= sp + UX_BSIZE) {
+			memcpy(spp, p, esize);
+			spp += esize;
+		} else {
+			goto out;
+		}
+	}
+	if (spp > sp && !spill) {
+		blk = uxfs_new_block(sb, &err);
+		if (err)
+			goto out;
+		spill = blk;
+	}
+	err = 0;
+
+	if (spp > sp) {
+		sbh = sb_getblk(sb, spill);
+		lock_buffer(sbh);
+		memcpy(sbh->b_data, sp, UX_BSIZE);
+		set_buffer_uptodate(sbh);
+		unlock_buffer(sbh);
+		mark_buffer_dirty_inode(sbh, inode);
+		brelse(sbh);
+	} else if (spill) {
+		uxfs_free_block(sb, spill);
+		spill = 0;
+	}
+	xh = (struct ux_xattr_header *)in;
+	if (ip > in + sizeof(*xh) || spill) {
+		xh->x_magic = UX_XATTR_MAGIC;
+		xh->x_spill = spill;
+	}
+	memcpy(ux_inode->i_xattr, in, UX_XATTR_INLINE);
+	memcpy(bh->b_data + UX_XATTR_OFFSET, in, UX_XATTR_INLINE);
+	mark_buffer_dirty(bh);
+	inode->i_ctime = current_fs_time(sb);
+	mark_inode_dirty(inode);
+out:
+	up_write(&ux_inode->i_xattr_sem);
+	brelse(bh);
+	kfree(list);
+	return err;
+}
+
+static int uxfs_xattr_user_get(struct inode *inode, const char *name,
+			       void *buffer, size_t size)
+{
+	if (!*name)
+		return -EINVAL;
+	return uxfs_xattr_get(inode, UX_XATTR_INDEX_USER, name, buffer, size);
+}
+
+static int uxfs_xattr_user_set(struct inode *inode, const char *name,
+			       const void *value, size_t size, int flags)
+{
+	if (!*name)
+		return -EINVAL;
+	return uxfs_xattr_set(inode, UX_XATTR_INDEX_USER, name, value, size,
+			      flags);
+}
+
+static int uxfs_xattr_trusted_get(struct inode *inode, const char *name,
+				  void *buffer, size_t size)
+{
+	if (!*name)
+		return -EINVAL;
+	return uxfs_xattr_get(inode, UX_XATTR_INDEX_TRUSTED, name, buffer,
+			      size);
+}
+
+static int uxfs_xattr_trusted_set(struct inode *inode, const char *name,
+				  const void *value, size_t size, int flags)
+{
+	if (!*name)
+		return -EINVAL;
+	return uxfs_xattr_set(inode, UX_XATTR_INDEX_TRUSTED, name, value,
+			      size, flags);
+}
+
+static int uxfs_xattr_security_get(struct inode *inode, const char *name,
+				   void *buffer, size_t size)
+{
+	if (!*name)
+		return -EINVAL;
+	return uxfs_xattr_get(inode, UX_XATTR_INDEX_SECURITY, name, buffer,
+			      size);
+}
+
+static int uxfs_xattr_security_set(struct inode *inode, const char *name,
+				   const void *value, size_t size, int flags)
+{
+	if (!*name)
+		return -EINVAL;
+	return uxfs_xattr_set(inode, UX_XATTR_INDEX_SECURITY, name, value,
+			      size, flags);
+}
+
+static struct xattr_handler uxfs_xattr_user_handler = {
+	.prefix	= XATTR_USER_PREFIX,
+	.get	= uxfs_xattr_user_get,
+	.set	= uxfs_xattr_user_set,
+};
+
+static struct xattr_handler uxfs_xattr_trusted_handler = {
+	.prefix	= XATTR_TRUSTED_PREFIX,
+	.get	= uxfs_xattr_trusted_get,
+	.set	= uxfs_xattr_trusted_set,
+};
+
+static struct xattr_handler uxfs_xattr_security_handler = {
+	.prefix	= XATTR_SECURITY_PREFIX,
+	.get	= uxfs_xattr_security_get,
+	.set	= uxfs_xattr_security_set,
+};
+
+struct xattr_handler *uxfs_xattr_handlers[] = {
+	&uxfs_xattr_user_handler,
+	&uxfs_xattr_trusted_handler,
+	&uxfs_xattr_security_handler,
+	NULL
+};
+
+/*
+ * Give a new inode the label the security module wants for it.
+ */
+int uxfs_init_security(struct inode *inode, struct inode *dir)
+{
+	char *name;
+	void *value;
+	size_t len;
+	int err;
+
+	err = security_inode_init_security(inode, dir, &name, &value, &len);
+	if (err)
+		return err == -EOPNOTSUPP ? 0 : err;
+	err = uxfs_xattr_set(inode, UX_XATTR_INDEX_SECURITY, name, value, len,
+			     0);
+	kfree(name);
+	kfree(value);
+	return err;
+}